@@ -0,0 +1,363 @@
+// Benchmarks for referee.h
+// e.g. clang -O2 -Wall -Wno-unused-function bench_referee.c -lpthread
+// (add -DREFEREE_LOCKFREE=1 to compare against lock-free lookups,
+//  -DREFEREE_HEADERS=1 to compare against header lookups,
+//  -DREFEREE_DEFERRED=1 to compare against logged/coalesced incs and decs,
+//  -DREFEREE_COMPACT_INFO=1 to compare against 16-byte RefInfos,
+//  -DREFEREE_RECLAIM=1 to compare against freeing on a background thread,
+//  or -DREFEREE_SAMPLE=1 -lm to see what sampling callsites costs: build.sh builds both, as
+//  bench_referee and bench_referee_sample, so that their "tracked allocations" lines can be compared)
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define REFEREE_THREADS 1
+#define REFEREE_IMPLEMENTATION
+#include "referee.h"
+
+#if 1 // PLATFORM
+#ifdef _WIN32
+typedef HANDLE BenchThread;
+static DWORD WINAPI bench__thread_proc(void *arg) { void (*fn)(void *) = ((void **)arg)[0]; fn(((void **)arg)[1]); return 0; }
+# define bench_thread_start(t, fn, arg, tramp) ((tramp)[0] = (void *)(fn), (tramp)[1] = (arg), *(t) = CreateThread(0, 0, bench__thread_proc, (tramp), 0, 0))
+# define bench_thread_join(t)                  (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+
+static double
+bench_now(void)
+{
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+}
+#else
+#include <pthread.h>
+#include <time.h>
+typedef pthread_t BenchThread;
+static void *bench__thread_proc(void *arg) { void (*fn)(void *) = ((void **)arg)[0]; fn(((void **)arg)[1]); return 0; }
+# define bench_thread_start(t, fn, arg, tramp) ((tramp)[0] = (void *)(fn), (tramp)[1] = (arg), pthread_create((t), 0, bench__thread_proc, (tramp)))
+# define bench_thread_join(t)                  pthread_join((t), 0)
+
+static double
+bench_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + 1e-9 * (double)now.tv_nsec;
+}
+#endif
+#endif // PLATFORM
+
+// xorshift, so that threads don't contend on rand()'s state
+static inline uint32_t
+bench_rand(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+	return *state = x;
+}
+
+
+#if 1 // INC_DEC: lookup cost on a working set that doesn't fit in cache
+#define Bench_Blocks_N   (1 << 18)
+#define Bench_Inc_Dec_N  (1 << 24)
+#define Bench_Frame_N    4096
+
+static void
+bench_inc_dec(void)
+{
+	Referee ref    = {0};
+	void  **blocks = (void **)malloc(Bench_Blocks_N * sizeof(*blocks));
+	for (size_t i = 0; i < Bench_Blocks_N; ++i)
+	{   blocks[i] = ref_new(&ref, 32, 1);   }
+
+	uint32_t seed  = 0x9e3779b9u;
+	double   start = bench_now();
+	for (size_t i = 0; i < Bench_Inc_Dec_N; ++i)
+	{
+		void *ptr = blocks[bench_rand(&seed) % Bench_Blocks_N];
+		ref_inc(&ref, ptr);
+		ref_dec(&ref, ptr);
+	}
+	double elapsed = bench_now() - start;
+
+	printf("random inc+dec over %d blocks (%s%s%s): %.1f ns/pair\n", Bench_Blocks_N,
+	       REFEREE_HEADERS ? "header lookups" : "map lookups", REFEREE_DEFERRED ? ", deferred" : "",
+	       REFEREE_COMPACT_INFO ? ", compact info" : "",
+	       1e9 * elapsed / Bench_Inc_Dec_N);
+
+	// the same, but a frame's worth at a time through the batched API
+	void **frame = (void **)malloc(Bench_Frame_N * sizeof(*frame));
+	seed  = 0x9e3779b9u;
+	start = bench_now();
+	for (size_t i = 0; i < Bench_Inc_Dec_N; i += Bench_Frame_N)
+	{
+		for (size_t j = 0; j < Bench_Frame_N; ++j)
+		{   frame[j] = blocks[bench_rand(&seed) % Bench_Blocks_N];   }
+		ref_inc_many(&ref, frame, Bench_Frame_N, 0);
+		ref_dec_many(&ref, frame, Bench_Frame_N, 0);
+	}
+	elapsed = bench_now() - start;
+	printf("  ... with ref_inc_many/ref_dec_many (%d at a time): %.1f ns/pair\n", Bench_Frame_N,
+	       1e9 * elapsed / Bench_Inc_Dec_N);
+	free(frame);
+
+	// the same, by handle rather than by ptr
+	RefHandle *handles = (RefHandle *)malloc(Bench_Blocks_N * sizeof(*handles));
+	for (size_t i = 0; i < Bench_Blocks_N; ++i)
+	{   handles[i] = ref_new_h(&ref, 32, 1);   }
+	seed  = 0x9e3779b9u;
+	start = bench_now();
+	for (size_t i = 0; i < Bench_Inc_Dec_N; ++i)
+	{
+		RefHandle handle = handles[bench_rand(&seed) % Bench_Blocks_N];
+		ref_inc_h(&ref, handle);
+		ref_dec_h(&ref, handle);
+	}
+	elapsed = bench_now() - start;
+	printf("  ... with ref_inc_h/ref_dec_h: %.1f ns/pair\n\n", 1e9 * elapsed / Bench_Inc_Dec_N);
+	for (size_t i = 0; i < Bench_Blocks_N; ++i)
+	{   ref_dec_h(&ref, handles[i]);   }
+	free(handles);
+
+	for (size_t i = 0; i < Bench_Blocks_N; ++i)
+	{   ref_dec(&ref, blocks[i]);   }
+	ref_purge(&ref);
+	free(blocks);
+}
+#endif // INC_DEC
+
+
+#if 1 // ALLOCATORS: short-lived objects, default allocator vs RefArena/RefSlabs
+#define Bench_Frame_Objs  4096
+#define Bench_Frames      2048
+
+// allocate a frame's worth of temporaries, drop them all, then reclaim with purge (or reset)
+static double
+bench_frames(Referee *ref, int use_reset)
+{
+	uint32_t seed  = 0x2545f491u;
+	double   start = bench_now();
+	for (int frame = 0; frame < Bench_Frames; ++frame)
+	{
+		for (int i = 0; i < Bench_Frame_Objs; ++i)
+		{
+			size_t size = 16 + bench_rand(&seed) % 241;
+			char  *obj  = (char *)ref_new(ref, size, 1);
+			obj[0] = (char)i;
+			ref_dec(ref, obj);
+		}
+		if (use_reset) {   ref_reset(ref);   }
+		else           {   ref_purge(ref);   }
+	}
+	return 1e9 * (bench_now() - start) / ((double)Bench_Frames * Bench_Frame_Objs);
+}
+
+static void
+bench_allocators(void)
+{
+	printf("short-lived objects (%d per frame, 16-256 bytes), ns/object\n", Bench_Frame_Objs);
+
+	Referee plain = {0};
+	printf("%28s %8.1f\n", "ref_default_realloc + purge", bench_frames(&plain, 0));
+
+	RefArena arena       = {0};
+	Referee  arena_ref   = { &arena, ref_arena_realloc, ref_arena_free };
+	printf("%28s %8.1f\n", "ref_arena_realloc + purge", bench_frames(&arena_ref, 0));
+	printf("%28s %8.1f\n", "ref_arena_realloc + reset", bench_frames(&arena_ref, 1));
+	ref_arena_release(&arena);
+
+	RefSlabs slabs     = {0};
+	Referee  slabs_ref = { &slabs, ref_slabs_realloc, ref_slabs_free };
+	printf("%28s %8.1f\n", "ref_slabs_realloc + purge", bench_frames(&slabs_ref, 0));
+	ref_slabs_release(&slabs);
+	putchar('\n');
+}
+#endif // ALLOCATORS
+
+
+#if 1 // THREADS: inc/dec/new/purge stress
+#define Bench_Shared_N      4096
+#define Bench_Thread_Iters  (1 << 20)
+#define Bench_Max_Threads   32
+
+typedef struct BenchThreadCtx {
+	Referee  *ref;
+	void    **shared;
+	uint32_t  seed;
+	size_t    ops;
+} BenchThreadCtx;
+
+static void
+bench_threads_worker(void *arg)
+{
+	BenchThreadCtx *ctx = (BenchThreadCtx *)arg;
+	Referee        *ref = ctx->ref;
+	size_t          ops = 0;
+
+	for (size_t i = 0; i < Bench_Thread_Iters; ++i)
+	{
+		// hold and release a block that's shared with every other thread
+		void *ptr = ctx->shared[bench_rand(&ctx->seed) % Bench_Shared_N];
+		ref_inc(ref, ptr);
+		ref_dec(ref, ptr);
+		ops += 2;
+
+		if (i % 8 == 0)
+		{ // short-lived private block
+			void *tmp = ref_new(ref, 64, 1);
+			ref_dec(ref, tmp);
+			ops += 2;
+		}
+
+		if (i % 1024 == 0)
+		{   ref_purge(ref); ++ops;   }
+	}
+	ctx->ops = ops;
+}
+
+static void
+bench_threads(void)
+{
+	printf("inc/dec/new/purge across threads (%d shards, %s)\n", REFEREE_SHARD_N,
+	       REFEREE_LOCKFREE ? "lock-free lookups" : "rw-locked lookups");
+	printf("%8s %12s %12s\n", "threads", "Mops/s", "vs 1 thread");
+
+	double base_rate = 0;
+	for (int threads_n = 1; threads_n <= Bench_Max_Threads; threads_n *= 2)
+	{
+		Referee ref = {0};
+		void *shared[Bench_Shared_N];
+		for (size_t i = 0; i < Bench_Shared_N; ++i)
+		{   shared[i] = ref_new(&ref, 64, 1);   }
+
+		BenchThread    threads[Bench_Max_Threads];
+		BenchThreadCtx ctxs[Bench_Max_Threads];
+		void          *tramps[Bench_Max_Threads][2];
+
+		double start = bench_now();
+		for (int t = 0; t < threads_n; ++t)
+		{
+			BenchThreadCtx ctx = { &ref, shared, 0x9e3779b9u * (uint32_t)(t + 1), 0 };
+			ctxs[t] = ctx;
+			bench_thread_start(&threads[t], bench_threads_worker, &ctxs[t], tramps[t]);
+		}
+
+		size_t ops = 0;
+		for (int t = 0; t < threads_n; ++t)
+		{   bench_thread_join(threads[t]); ops += ctxs[t].ops;   }
+		double elapsed = bench_now() - start;
+
+		double rate = (double)ops / elapsed / 1e6;
+		if (threads_n == 1) {   base_rate = rate;   }
+		printf("%8d %12.2f %11.2fx\n", threads_n, rate, rate / base_rate);
+
+		for (size_t i = 0; i < Bench_Shared_N; ++i)
+		{   ref_dec(&ref, shared[i]);   }
+		ref_purge(&ref);
+	}
+	putchar('\n');
+}
+#endif // THREADS
+
+
+#if 1 // PURGE_LATENCY: how long ref_purge holds up the calling thread, with large (munmap'd) blocks
+#define Bench_Purge_Frames  256
+#define Bench_Purge_Small   256
+#define Bench_Purge_Large   2
+#define Bench_Large_Size    (33 << 20) // (over glibc's largest mmap threshold, so each free is a munmap)
+
+static int
+bench_cmp_double(void const *a, void const *b)
+{   double A = *(double const *)a, B = *(double const *)b; return (A > B) - (A < B);   }
+
+static void
+bench_purge_latency(void)
+{
+	Referee ref   = {0};
+	double *times = (double *)malloc(Bench_Purge_Frames * sizeof(*times));
+	for (int frame = 0; frame < Bench_Purge_Frames; ++frame)
+	{
+		for (int i = 0; i < Bench_Purge_Small + Bench_Purge_Large; ++i)
+		{
+			size_t size = i < Bench_Purge_Large ? Bench_Large_Size : 64;
+			char  *obj  = (char *)ref_new(&ref, size, 1);
+			for (size_t at = 0; at < size; at += 4096) {   obj[at] = (char)i;   } // (so the pages are really mapped)
+			ref_dec(&ref, obj);
+		}
+		double start = bench_now();
+		ref_purge(&ref);
+		times[frame] = 1e6 * (bench_now() - start);
+	}
+	double start = bench_now();
+	ref_reclaim_flush(&ref);
+	double flush = 1e6 * (bench_now() - start);
+	qsort(times, Bench_Purge_Frames, sizeof(*times), bench_cmp_double);
+
+	printf("ref_purge of %d small + %d x %d KiB blocks (%s), us on the calling thread\n",
+	       Bench_Purge_Small, Bench_Purge_Large, Bench_Large_Size >> 10,
+	       REFEREE_RECLAIM ? "freed by the reclaimer thread" : "freed by the caller");
+	printf("%8s %8s %8s %8s\n", "p50", "p99", "max", "flush");
+	printf("%8.1f %8.1f %8.1f %8.1f\n\n", times[Bench_Purge_Frames / 2], times[Bench_Purge_Frames * 99 / 100],
+	       times[Bench_Purge_Frames - 1], flush);
+	free(times);
+}
+#endif // PURGE_LATENCY
+
+
+#if 1 // SAMPLE: what REFEREE_SAMPLE adds to each tracked allocation and drop
+#define Bench_Sample_Objs   4096
+#define Bench_Sample_Frames 1024
+#define Bench_Sample_Runs   8
+
+// allocates and drops a frame's worth of mixed sizes at a time, purging after each
+// returns ns/object
+static double
+bench_sample_run(Referee *ref)
+{
+	uint32_t seed  = 0x85ebca6bu;
+	double   start = bench_now();
+	for (int frame = 0; frame < Bench_Sample_Frames; ++frame)
+	{
+		for (int i = 0; i < Bench_Sample_Objs; ++i)
+		{
+			size_t size = 16 + bench_rand(&seed) % 1009;
+			char  *obj  = (char *)ref_new(ref, size, 1);
+			obj[0] = (char)i;
+			ref_dec(ref, obj);
+		}
+		ref_purge(ref);
+	}
+	return 1e9 * (bench_now() - start) / ((double)Bench_Sample_Frames * Bench_Sample_Objs);
+}
+
+static void
+bench_sample(void)
+{
+	Referee ref  = {0};
+	double  best = 0;
+	for (int run = 0; run < Bench_Sample_Runs; ++run)
+	{ // (the best of a few, as the difference being looked for is small)
+		double ns = bench_sample_run(&ref);
+		if (! run || ns < best) {   best = ns;   }
+	}
+#if REFEREE_SAMPLE
+	printf("tracked allocations (16-1024 bytes, sampled about every %d KiB, %zu callsites seen): %.1f ns/object\n\n",
+	       Referee_Sample_Bytes >> 10, ref_callsites(0, 0), best);
+#else
+	printf("tracked allocations (16-1024 bytes, unsampled): %.1f ns/object\n\n", best);
+#endif
+	ref_reset(&ref);
+}
+#endif // SAMPLE
+
+
+int main()
+{
+	bench_inc_dec();
+	bench_allocators();
+	bench_threads();
+	bench_purge_latency();
+	bench_sample();
+	return 0;
+}
@@ -1 +1,13 @@
-clang-7 -g -Wall -Werror -Wno-unused-function test_refcount.c
+# the tests, once for each group of features they cover
+for flags in "" "-DREFEREE_THREADS=1 -DREFEREE_HEADERS=1" "-DREFEREE_LOCKFREE=1 -DREFEREE_DEFERRED=1 -DREFEREE_WEAK=1" \
+             "-DREFEREE_RECYCLE=1 -DREFEREE_COMPACT_INFO=1 -DREFEREE_DEBUG=1" "-DREFEREE_BUDGET=1 -DREFEREE_DEFERRED=1 -DREFEREE_HEADERS=1" \
+             "-DREFEREE_INTERIOR=1 -DREFEREE_CYCLES=1 -DREFEREE_FINALIZERS=1 -DREFEREE_THREADS=1" "-DREFEREE_RECLAIM=1 -DREFEREE_SAMPLE=1 -DREFEREE_HEADERS=1"; do
+	clang-7 -g -Wall -Werror -Wno-unused-function -Wno-unused-variable $flags test_referee.c -lpthread -lm -o test_referee && ./test_referee > /dev/null || { echo "test_referee failed with: $flags"; exit 1; }
+done
+# the threaded ones again, for races (the lock-free map stress, deferred logs flushed across threads)
+flags="-DREFEREE_LOCKFREE=1 -DREFEREE_DEFERRED=1 -DREFEREE_WEAK=1"
+clang-7 -g -O1 -fsanitize=thread $flags test_referee.c -lpthread -lm -o test_referee && ./test_referee > /dev/null || { echo "test_referee failed under tsan with: $flags"; exit 1; }
+clang-7 -O2 -Wall -Werror -Wno-unused-function bench_referee.c -lpthread -o bench_referee
+clang-7 -O2 -Wall -Werror -Wno-unused-function -DREFEREE_SAMPLE=1 bench_referee.c -lpthread -lm -o bench_referee_sample
+clang-7 -O2 -Wall -Werror -Wno-unused-function referee_snapshot.c -o referee_snapshot
+clang-7 -O2 -Wall -Werror -Wno-unused-function -shared -fPIC -ftls-model=initial-exec referee_preload.c -ldl -lpthread -o libreferee_preload.so
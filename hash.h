@@ -1,4 +1,22 @@
-/* TODO
+/* Compile-time options (define before including):
+ * - MAP_TYPES    (map_type_name, function_prefix, key_type, value_type) - required
+ * - MAP_MUTEX    (mutex_type, lock_fn, unlock_fn) - every operation is wrapped in the lock
+ * - MAP_LOCKFREE - lookups are wait-free, and inserts/removes are lock-free (CAS on the idxs slots).
+ *                  Keys/values live in segments that never move, so value ptrs stay valid while
+ *                  their key is in the map. Resizing only rebuilds idxs, and is done cooperatively
+ *                  by whichever writers find it in progress. 64-bit targets only.
+ *                  Tombstones are reused by inserts; a rehash still keeps the old idxs table
+ *                  alive (readers may be in it) until the map is cleared.
+ *                  Removed key slots are only reused once no thread can still be reading them:
+ *                  each map call is an epoch read section, and a caller that keeps a value ptr
+ *                  (map_ptr/map_at) past the call must wrap its use in map_lf_enter/map_lf_leave.
+ *                  Values written by map_set/map_update aren't atomic; use map_ptr + atomics
+ *                  for fields that are updated concurrently.
+ * - MAP_COLD     cold_type - a second value per key, kept in its own array in step with the values
+ *                (by key index), for data that's rarely read and would otherwise dilute the values'
+ *                cache lines. Inserting leaves it uninitialized; use map_cold_ptr/map_cold_at.
+ *
+ * TODO
  * - varying semantics based on whether key is already in table
  *   - `insert` succeeds if not already there
  *   - `update` succeeds only if already there
@@ -23,11 +41,24 @@
 # define map__mod_pow2(a, x) ((a) & (x - 1))
 # define map__assert(e) assert(e)
 # define Map_Load_Factor 2
+# define Map_Batch_N 16 // keys looked up together by map_ptr_many
+
+# if defined(_MSC_VER)
+#  include <xmmintrin.h>
+#  define MAP_PREFETCH(p) _mm_prefetch((char const *)(p), _MM_HINT_T0)
+# elif defined(__GNUC__) || defined(__clang__)
+#  define MAP_PREFETCH(p) __builtin_prefetch(p)
+# else
+#  define MAP_PREFETCH(p) (void)(p)
+# endif
 #endif /*MAP_GENERIC*/
 
 #define MAP_CAT1(a,b) a ## b
 #define MAP_CAT2(a,b) MAP_CAT1(a,b)
 #define MAP_CAT(a,b)  MAP_CAT2(a,b)
+// applies a macro to a parenthesised argument list, e.g. MAP_TYPES
+// (pasting a name onto a '(' only happens to work with MSVC)
+#define MAP_APPLY(fn, args) fn args
 
 #define MAP_DECORATE_TYPE(x) MAP_CAT(Map, x)
 #define MAP_DECORATE_FUNC(x) MAP_CAT(map_fn, _ ## x)
@@ -46,14 +77,17 @@
 #define MAP_KEY( map_t, func_prefix, key_t, val_t) key_t
 #define MAP_VAL( map_t, func_prefix, key_t, val_t) val_t
 
-#define Map    MAP_CAT(MAP_TYPE, MAP_TYPES)
-#define map_fn MAP_CAT(MAP_FUNC, MAP_TYPES)
-#define MapKey MAP_CAT(MAP_KEY,  MAP_TYPES)
-#define MapVal MAP_CAT(MAP_VAL,  MAP_TYPES)
+#define Map    MAP_APPLY(MAP_TYPE, MAP_TYPES)
+#define map_fn MAP_APPLY(MAP_FUNC, MAP_TYPES)
+#define MapKey MAP_APPLY(MAP_KEY,  MAP_TYPES)
+#define MapVal MAP_APPLY(MAP_VAL,  MAP_TYPES)
 
 #ifndef MapIdx
 #define MapIdx uint64_t
 #endif/*MapIdx*/
+#ifdef MAP_COLD
+#define MapCold MAP_COLD
+#endif/*MAP_COLD*/
 #endif // BASIC TYPES
 
 #if 1 // MUTEX TYPE
@@ -62,9 +96,9 @@
 #define MAP_MTX_UNLOCK(mtx_t, lock_fn, unlock_fn) unlock_fn
 
 #ifdef MAP_MUTEX
-#define MAP_MTX(name) MAP_CAT(MAP_MTX_TYPE,   MAP_MUTEX) name;
-#define MAP_LOCK      MAP_CAT(MAP_MTX_LOCK,   MAP_MUTEX)
-#define MAP_UNLOCK    MAP_CAT(MAP_MTX_UNLOCK, MAP_MUTEX)
+#define MAP_MTX(name) MAP_APPLY(MAP_MTX_TYPE,   MAP_MUTEX) name;
+#define MAP_LOCK      MAP_APPLY(MAP_MTX_LOCK,   MAP_MUTEX)
+#define MAP_UNLOCK    MAP_APPLY(MAP_MTX_UNLOCK, MAP_MUTEX)
 #else // MAP_MUTEX
 // mutex no-ops:
 #define MAP_MTX(x)
@@ -89,6 +123,7 @@
 // USER FUNCTIONS:
 #define map_has    MAP_DECORATE_FUNC(has)
 #define map_ptr    MAP_DECORATE_FUNC(ptr)
+#define map_ptr_many MAP_DECORATE_FUNC(ptr_many)
 #define map_get    MAP_DECORATE_FUNC(get)
 #define map_set    MAP_DECORATE_FUNC(set)
 #define map_clear  MAP_DECORATE_FUNC(clear)
@@ -96,6 +131,31 @@
 #define map_insert MAP_DECORATE_FUNC(insert)
 #define map_remove MAP_DECORATE_FUNC(remove)
 #define map_resize MAP_DECORATE_FUNC(resize)
+#define map_at     MAP_DECORATE_FUNC(at)
+#define map_cold_ptr MAP_DECORATE_FUNC(cold_ptr)
+#define map_cold_at  MAP_DECORATE_FUNC(cold_at)
+
+#ifdef MAP_LOCKFREE
+#define map__lf_key          MAP_DECORATE_FUNC(_lf_key)
+#define map__lf_val          MAP_DECORATE_FUNC(_lf_val)
+#define map__lf_cold         MAP_DECORATE_FUNC(_lf_cold)
+#define map__lf_free_next    MAP_DECORATE_FUNC(_lf_free_next)
+#define map__lf_reserve      MAP_DECORATE_FUNC(_lf_reserve)
+#define map__lf_key_get      MAP_DECORATE_FUNC(_lf_key_get)
+#define map__lf_key_set      MAP_DECORATE_FUNC(_lf_key_set)
+#define map__lf_retire_epoch MAP_DECORATE_FUNC(_lf_retire_epoch)
+#define map__lf_free_push    MAP_DECORATE_FUNC(_lf_free_push)
+#define map__lf_retire       MAP_DECORATE_FUNC(_lf_retire)
+#define map__lf_reclaim      MAP_DECORATE_FUNC(_lf_reclaim)
+#define map__lf_table        MAP_DECORATE_FUNC(_lf_table)
+#define map__lf_copy_in      MAP_DECORATE_FUNC(_lf_copy_in)
+#define map__lf_help_resize  MAP_DECORATE_FUNC(_lf_help_resize)
+#define map__lf_start_resize MAP_DECORATE_FUNC(_lf_start_resize)
+#define map__lf_has_other    MAP_DECORATE_FUNC(_lf_has_other)
+#define map__lf_unpublish    MAP_DECORATE_FUNC(_lf_unpublish)
+#define map__lf_publish      MAP_DECORATE_FUNC(_lf_publish)
+#define map__lf_add          MAP_DECORATE_FUNC(_lf_add)
+#endif//MAP_LOCKFREE
 #endif // FUNCTIONS
 
 #ifdef MAP_TEST
@@ -131,15 +191,226 @@ static MapVal const Map_Invalid_Val = MAP_INVALID_VAL;
 #include <stdlib.h>
 #include <assert.h>
 
+#ifdef MAP_LOCKFREE
+#ifndef MAP_LOCKFREE_GENERIC // only intended to be defined once total
+#define MAP_LOCKFREE_GENERIC
+#if UINTPTR_MAX != UINT64_MAX
+# error MAP_LOCKFREE is only supported on 64-bit targets
+#endif
+
+# if defined(_MSC_VER)
+#  include <intrin.h>
+#  define MAP_ATOMIC_LOAD(p)            (_ReadWriteBarrier(), *(uint64_t volatile *)(p)) // x64 loads already acquire
+#  define MAP_ATOMIC_STORE(p, v)        (_ReadWriteBarrier(), *(uint64_t volatile *)(p) = (v))
+#  define MAP_ATOMIC_ADD(p, v)          ((uint64_t)_InterlockedExchangeAdd64((__int64 volatile *)(p), (__int64)(v)))
+#  define MAP_ATOMIC_CAS(p, e, d)       ((uint64_t)_InterlockedCompareExchange64((__int64 volatile *)(p), (__int64)(d), (__int64)(e)) == (uint64_t)(e))
+#  define MAP_ATOMIC_LOAD_PTR(p)        (_ReadWriteBarrier(), *(void * volatile *)(p))
+#  define MAP_ATOMIC_CAS_PTR(p, e, d)   (_InterlockedCompareExchangePointer((void * volatile *)(p), (d), (e)) == (void *)(e))
+#  define MAP_ATOMIC_SWAP(p, v)         ((uint64_t)_InterlockedExchange64((__int64 volatile *)(p), (__int64)(v)))
+#  define MAP_FENCE()                   _mm_mfence()
+#  define MAP_THREAD_LOCAL              __declspec(thread)
+#  define MAP_PAUSE()                   _mm_pause()
+#  define map__log2(x)                  (_BitScanReverse64(&map__log2_result, (x)), (uint64_t)map__log2_result)
+#  define MAP_LOG2_DECL                 unsigned long map__log2_result;
+# else
+#  define MAP_ATOMIC_LOAD(p)            __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#  define MAP_ATOMIC_STORE(p, v)        __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#  define MAP_ATOMIC_ADD(p, v)          __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#  define MAP_ATOMIC_CAS(p, e, d)       __extension__({ __typeof__(*(p)) map__e = (e); \
+                                          __atomic_compare_exchange_n((p), &map__e, (d), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+#  define MAP_ATOMIC_LOAD_PTR(p)        MAP_ATOMIC_LOAD(p)
+#  define MAP_ATOMIC_CAS_PTR(p, e, d)   MAP_ATOMIC_CAS(p, e, d)
+#  define MAP_ATOMIC_SWAP(p, v)         __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#  if defined(__SANITIZE_THREAD__) // (TSan doesn't model fences; a seq_cst RMW is one on every target it runs on)
+#   define MAP_FENCE()                  (void)__atomic_fetch_add(&map__lf_fence_word, 0, __ATOMIC_SEQ_CST)
+static uint64_t map__lf_fence_word;
+#  else
+#   define MAP_FENCE()                  __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#  endif
+#  define MAP_THREAD_LOCAL              __thread
+#  if defined(__x86_64__) || defined(__i386__)
+#   define MAP_PAUSE()                  __builtin_ia32_pause()
+#  else
+#   define MAP_PAUSE()
+#  endif
+#  define map__log2(x)                  (63 - (uint64_t)__builtin_clzll(x))
+#  define MAP_LOG2_DECL
+# endif
+
+// idxs slot values (anything below these is a key index):
+# define Map_Lf_Empty        (~(MapIdx)0)     // never filled; ends a probe
+# define Map_Lf_Tomb         (~(MapIdx)0 - 1) // removed; probes continue past it
+# define Map_Lf_Frozen_Empty (~(MapIdx)0 - 2) // as above, but migrated to the next table by a resize
+# define Map_Lf_Frozen_Tomb  (~(MapIdx)0 - 3)
+# define Map_Lf_Frozen_Bit   ((MapIdx)1 << 62) // key indexes that have been migrated
+# define map__lf_is_frozen(v) ((v) == Map_Lf_Frozen_Empty || (v) == Map_Lf_Frozen_Tomb || ((v) >> 62) == 1)
+# define map__lf_unfreeze(v)  ((v) == Map_Lf_Frozen_Empty ? Map_Lf_Empty      : \
+                               (v) == Map_Lf_Frozen_Tomb  ? Map_Lf_Tomb       : \
+                               ((v) >> 62) == 1           ? (v) & ~Map_Lf_Frozen_Bit : (v))
+# define map__lf_freeze(v)    ((v) == Map_Lf_Empty ? Map_Lf_Frozen_Empty : \
+                               (v) == Map_Lf_Tomb  ? Map_Lf_Frozen_Tomb  : \
+                                                     (v) | Map_Lf_Frozen_Bit)
+
+// keys/vals are stored in segments that double in size, so they never have to move:
+// segment s holds Map_Lf_Seg_Base << s elements, starting at key index Map_Lf_Seg_Base * (2^s - 1)
+# define Map_Lf_Seg_Base   16
+# define Map_Lf_Segs_N     32
+# define Map_Lf_Copy_Chunk 256 // idxs slots claimed at a time by each thread helping a resize
+# define Map_Lf_Reclaim_Min 64 // removed key indexes waiting before an insert tries to reclaim them
+
+typedef struct MapLfIdxs MapLfIdxs;
+struct MapLfIdxs {
+    uint64_t   idxs_n;   // always a power of 2
+    uint64_t   used;     // slots that have been filled (live or removed); drives resizing
+    uint64_t   copy_i;   // next slot to be claimed for migration to `next`
+    uint64_t   copied;   // slots that have finished migrating
+    MapLfIdxs *next;     // set once a resize has started
+    MapLfIdxs *prev;     // old tables are kept for any readers still in them (bounded by the size of the current one)
+    MapIdx     idxs[1];  // really idxs_n
+};
+
+static inline uint64_t
+map__lf_seg(uint64_t key_i, uint64_t *offset_out)
+{
+    MAP_LOG2_DECL
+    uint64_t seg = map__log2(key_i / Map_Lf_Seg_Base + 1);
+    *offset_out  = key_i - Map_Lf_Seg_Base * ((1ull << seg) - 1);
+    return seg;
+}
+
+static MapLfIdxs *
+map__lf_new_table(uint64_t idxs_n)
+{
+    MapLfIdxs *result = (MapLfIdxs *)malloc(sizeof(MapLfIdxs) + (idxs_n - 1) * sizeof(MapIdx));
+    if (result)
+    {
+        result->idxs_n = idxs_n;
+        result->used   = result->copy_i = result->copied = 0;
+        result->next   = result->prev = 0;
+        for (uint64_t i = 0; i < idxs_n; ++i)
+        {   result->idxs[i] = Map_Lf_Empty;   }
+    }
+    return result;
+}
+
+// Removed key indexes are reclaimed by epoch: a thread reading any lock-free map announces the
+// global epoch it started in, and an index removed in epoch e is only reused once every
+// announcement is after e. Shared by all maps; records are reused by later threads, never freed.
+typedef struct MapLfReader MapLfReader;
+struct MapLfReader {
+    uint64_t     state; // (announced epoch << 1) | 1 while reading, 0 otherwise
+    uint64_t     depth; // of nested map_lf_enter calls (only touched by its thread)
+    uint64_t     owned; // by a live thread
+    MapLfReader *next;
+};
+
+static uint64_t                      map__lf_epoch = 1;
+static uint64_t                      map__lf_no_reclaim; // a reader couldn't be allocated; indexes are never reused from then on
+static MapLfReader                  *map__lf_readers;
+static MAP_THREAD_LOCAL MapLfReader *map__lf_me;
+
+// at thread exit: hands the thread's record to the next new thread
+static void map__lf_reader_exit(void *arg)
+{
+    MapLfReader *reader = (MapLfReader *)arg;
+    reader->depth = 0;
+    MAP_ATOMIC_STORE(&reader->state, 0);
+    map__lf_me = 0;
+    MAP_ATOMIC_STORE(&reader->owned, 0);
+}
+
+# ifdef _WIN32
+#  include <windows.h>
+static DWORD     map__lf_reader_key;
+static INIT_ONCE map__lf_reader_key_once = INIT_ONCE_STATIC_INIT;
+static VOID WINAPI map__lf_reader_exit_fls(PVOID arg) { if (arg) { map__lf_reader_exit(arg); } }
+static BOOL CALLBACK map__lf_reader_key_init(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+    (void)once, (void)param, (void)context;
+    map__lf_reader_key = FlsAlloc(map__lf_reader_exit_fls);
+    return map__lf_reader_key != FLS_OUT_OF_INDEXES;
+}
+#  define map__lf_reader_key_set(reader) (InitOnceExecuteOnce(&map__lf_reader_key_once, map__lf_reader_key_init, 0, 0) && \
+                                          FlsSetValue(map__lf_reader_key, (reader)))
+# else
+#  include <pthread.h>
+static pthread_key_t  map__lf_reader_key;
+static pthread_once_t map__lf_reader_key_once = PTHREAD_ONCE_INIT;
+static int            map__lf_reader_key_ok;
+static void map__lf_reader_key_init(void)
+{   map__lf_reader_key_ok = ! pthread_key_create(&map__lf_reader_key, map__lf_reader_exit);   }
+#  define map__lf_reader_key_set(reader) (pthread_once(&map__lf_reader_key_once, map__lf_reader_key_init), \
+                                          map__lf_reader_key_ok && ! pthread_setspecific(map__lf_reader_key, (reader)))
+# endif
+
+// the calling thread's record, claiming one on first use
+// returns 0 if one couldn't be allocated (which turns reclamation off rather than risk it)
+static MapLfReader * map__lf_reader(void)
+{
+    MapLfReader *reader = map__lf_me;
+    if (reader || MAP_ATOMIC_LOAD(&map__lf_no_reclaim)) { return reader; }
+
+    for (reader = (MapLfReader *)MAP_ATOMIC_LOAD_PTR(&map__lf_readers); reader; reader = reader->next)
+    {   if (! MAP_ATOMIC_LOAD(&reader->owned) && MAP_ATOMIC_CAS(&reader->owned, 0, 1)) { break; }   }
+    if (! reader)
+    {
+        reader = (MapLfReader *)calloc(1, sizeof(MapLfReader));
+        if (! reader) { MAP_ATOMIC_STORE(&map__lf_no_reclaim, 1); return 0; }
+        reader->owned = 1;
+        do {   reader->next = (MapLfReader *)MAP_ATOMIC_LOAD_PTR(&map__lf_readers);   }
+        while (! MAP_ATOMIC_CAS_PTR(&map__lf_readers, reader->next, reader));
+    }
+    map__lf_me = reader;
+    (void)map__lf_reader_key_set(reader); // (if this fails the record just isn't reused after the thread exits)
+    return reader;
+}
+
+// bracket any use of lock-free map values/keys; nestable
+static inline void map_lf_enter(void)
+{
+    MapLfReader *reader = map__lf_reader();
+    if (reader && ! reader->depth++) // the swap is a full fence: the announcement is visible before anything is read
+    {   (void)MAP_ATOMIC_SWAP(&reader->state, MAP_ATOMIC_LOAD(&map__lf_epoch) << 1 | 1);   }
+}
+
+static inline void map_lf_leave(void)
+{
+    MapLfReader *reader = map__lf_me;
+    if (reader && ! --reader->depth) { MAP_ATOMIC_STORE(&reader->state, 0); }
+}
+#endif//MAP_LOCKFREE_GENERIC
+
+typedef struct Map {
+    MapLfIdxs *table;
+    MapKey    *key_segs[Map_Lf_Segs_N];
+    MapVal    *val_segs[Map_Lf_Segs_N];
+#ifdef MAP_COLD
+    MapCold   *cold_segs[Map_Lf_Segs_N];
+#endif
+    MapIdx    *free_segs[Map_Lf_Segs_N]; // next links of the removed-key free and retired lists
+    uint64_t  *retire_segs[Map_Lf_Segs_N]; // the epoch each retired key index was removed in
+    uint64_t   free_head; // (ABA tag << 32) | (key index + 1); 0 when empty
+    uint64_t   retired;   // key index + 1 of the last removed index that may still be read; 0 when empty
+    uint64_t   retired_n;
+    uint64_t   reclaiming; // set while a thread is moving retired indexes to the free list
+    size_t     n;         // key slots ever handed out, i.e. the upper bound for map_at
+    size_t     live;      // keys currently in the map
+} Map;
+
+#else //MAP_LOCKFREE
 typedef struct Map {
 	MapIdx *idxs; // TODO: add at end of keys allocation?
 	MapVal *vals;
 	MapKey *keys;
+#ifdef MAP_COLD
+	MapCold *colds;
+#endif
 	size_t  max; // always a power of 2; the size of the array is 2x this (allows super-quick mod_pow2)
 	size_t  n;
 
     MAP_MTX (lock)
 } Map;
+#endif//MAP_LOCKFREE
 
 #if 1 // CONSTANTS
 #ifndef MAP_CONSTANTS
@@ -166,6 +437,571 @@ static uint64_t map__hash(MapKey key)
 }
 #endif//MAP_HASH_KEY
 
+#ifdef MAP_LOCKFREE
+static inline MapKey * map__lf_key(Map const *map, MapIdx key_i)
+{   uint64_t off, seg = map__lf_seg(key_i, &off); return &((MapKey *)MAP_ATOMIC_LOAD_PTR(&map->key_segs[seg]))[off];   }
+static inline MapVal * map__lf_val(Map const *map, MapIdx key_i)
+{   uint64_t off, seg = map__lf_seg(key_i, &off); return &((MapVal *)MAP_ATOMIC_LOAD_PTR(&map->val_segs[seg]))[off];   }
+static inline MapIdx * map__lf_free_next(Map const *map, MapIdx key_i)
+{   uint64_t off, seg = map__lf_seg(key_i, &off); return &((MapIdx *)MAP_ATOMIC_LOAD_PTR(&map->free_segs[seg]))[off];   }
+static inline uint64_t * map__lf_retire_epoch(Map const *map, MapIdx key_i)
+{   uint64_t off, seg = map__lf_seg(key_i, &off); return &((uint64_t *)MAP_ATOMIC_LOAD_PTR(&map->retire_segs[seg]))[off];   }
+
+// keys are written and read atomically, as a removed index's key may be cleared/rewritten under a reader
+// (which then just doesn't match); they need to be word-sized scalars
+static inline MapKey map__lf_key_get(Map const *map, MapIdx key_i)
+{
+# if defined(_MSC_VER)
+    _ReadWriteBarrier(); return *(MapKey volatile *)map__lf_key(map, key_i);
+# else
+    return __atomic_load_n(map__lf_key(map, key_i), __ATOMIC_ACQUIRE);
+# endif
+}
+static inline void map__lf_key_set(Map *map, MapIdx key_i, MapKey key)
+{
+# if defined(_MSC_VER)
+    _ReadWriteBarrier(); *(MapKey volatile *)map__lf_key(map, key_i) = key;
+# else
+    __atomic_store_n(map__lf_key(map, key_i), key, __ATOMIC_RELEASE);
+# endif
+}
+#ifdef MAP_COLD
+static inline MapCold * map__lf_cold(Map const *map, MapIdx key_i)
+{   uint64_t off, seg = map__lf_seg(key_i, &off); return &((MapCold *)MAP_ATOMIC_LOAD_PTR(&map->cold_segs[seg]))[off];   }
+#endif
+
+// get a key index for a new entry, either a removed one or a fresh one from the end
+// returns ~0 if a new segment couldn't be allocated
+static void map__lf_reclaim(Map *map);
+static MapIdx map__lf_reserve(Map *map)
+{
+    for (int reclaimed = 0; ; reclaimed = 1)
+    {
+        for (;;)
+        { // pop the free list
+            uint64_t head = MAP_ATOMIC_LOAD(&map->free_head),
+                     top  = head & 0xffffffff;
+            if (! top) { break; }
+            uint64_t next     = MAP_ATOMIC_LOAD(map__lf_free_next(map, top - 1)), // may be stale, in which case the CAS fails
+                     new_head = (((head >> 32) + 1) << 32) | next;
+            if (MAP_ATOMIC_CAS(&map->free_head, head, new_head)) { return top - 1; }
+        }
+        if (reclaimed || MAP_ATOMIC_LOAD(&map->retired_n) < Map_Lf_Reclaim_Min) { break; }
+        map__lf_reclaim(map);
+    }
+
+    MapIdx   key_i = MAP_ATOMIC_ADD(&map->n, 1);
+    uint64_t off, seg = map__lf_seg(key_i, &off);
+    if (seg >= Map_Lf_Segs_N) { return ~(MapIdx)0; }
+
+    if (! MAP_ATOMIC_LOAD_PTR(&map->val_segs[seg]))
+    { // first into the segment; whoever installs their allocations first wins, the rest free theirs
+        uint64_t seg_n = (uint64_t)Map_Lf_Seg_Base << seg;
+        MapKey *keys = (MapKey *)malloc(seg_n * sizeof(MapKey));
+        MapIdx *frees = (MapIdx *)malloc(seg_n * sizeof(MapIdx));
+        uint64_t *epochs = (uint64_t *)malloc(seg_n * sizeof(uint64_t));
+        MapVal *vals = (MapVal *)malloc(seg_n * sizeof(MapVal));
+        if (! (keys && frees && epochs && vals)) { free(keys); free(frees); free(epochs); free(vals); return ~(MapIdx)0; }
+        for (uint64_t i = 0; i < seg_n; ++i) { keys[i] = Map_Invalid_Key; }
+
+        if (! MAP_ATOMIC_CAS_PTR(&map->key_segs[seg],  (MapKey *)0, keys))  { free(keys);  }
+        if (! MAP_ATOMIC_CAS_PTR(&map->free_segs[seg], (MapIdx *)0, frees)) { free(frees); }
+        if (! MAP_ATOMIC_CAS_PTR(&map->retire_segs[seg], (uint64_t *)0, epochs)) { free(epochs); }
+#ifdef MAP_COLD
+        MapCold *colds = (MapCold *)malloc(seg_n * sizeof(MapCold));
+        if (! colds) { return ~(MapIdx)0; } // (the others are kept for whoever gets the segment next)
+        if (! MAP_ATOMIC_CAS_PTR(&map->cold_segs[seg], (MapCold *)0, colds)) { free(colds); }
+#endif
+        // vals last, as this is what's checked
+        if (! MAP_ATOMIC_CAS_PTR(&map->val_segs[seg],  (MapVal *)0, vals))  { free(vals);  }
+    }
+    else
+    { // make sure the other segments are visible too, in case their installer is still part-way through
+        while (! MAP_ATOMIC_LOAD_PTR(&map->key_segs[seg]) || ! MAP_ATOMIC_LOAD_PTR(&map->free_segs[seg]) ||
+               ! MAP_ATOMIC_LOAD_PTR(&map->retire_segs[seg]))
+        {   MAP_PAUSE();   }
+#ifdef MAP_COLD
+        while (! MAP_ATOMIC_LOAD_PTR(&map->cold_segs[seg])) {   MAP_PAUSE();   }
+#endif
+    }
+    return key_i;
+}
+
+static void map__lf_free_push(Map *map, MapIdx key_i)
+{
+    for (;;)
+    {
+        uint64_t head = MAP_ATOMIC_LOAD(&map->free_head);
+        MAP_ATOMIC_STORE(map__lf_free_next(map, key_i), head & 0xffffffff);
+        uint64_t new_head = (((head >> 32) + 1) << 32) | (key_i + 1);
+        if (MAP_ATOMIC_CAS(&map->free_head, head, new_head)) { return; }
+    }
+}
+
+// give back a key index that isn't (or is no longer) referenced by any idxs slot.
+// It's only reused (by map__lf_reclaim) once no reader can still be looking at it
+static void map__lf_retire(Map *map, MapIdx key_i)
+{
+    map__lf_key_set(map, key_i, Map_Invalid_Key);
+    if (key_i >= 0xffffffff) { return; } // too big for the lists, leak it
+    MAP_FENCE(); // (pairs with map_lf_enter's: a reader that could have found key_i announced an epoch <= this one)
+    MAP_ATOMIC_STORE(map__lf_retire_epoch(map, key_i), MAP_ATOMIC_LOAD(&map__lf_epoch));
+    uint64_t head;
+    do {
+        head = MAP_ATOMIC_LOAD(&map->retired);
+        MAP_ATOMIC_STORE(map__lf_free_next(map, key_i), head);
+    } while (! MAP_ATOMIC_CAS(&map->retired, head, key_i + 1));
+    MAP_ATOMIC_ADD(&map->retired_n, 1);
+}
+
+// moves the retired key indexes that every current reader started after onto the free list
+static void map__lf_reclaim(Map *map)
+{
+    if (MAP_ATOMIC_LOAD(&map__lf_no_reclaim) || ! MAP_ATOMIC_CAS(&map->reclaiming, 0, 1)) { return; }
+
+    uint64_t safe = MAP_ATOMIC_ADD(&map__lf_epoch, 1) + 1;
+    MAP_FENCE();
+    for (MapLfReader *reader = (MapLfReader *)MAP_ATOMIC_LOAD_PTR(&map__lf_readers); reader; reader = reader->next)
+    {
+        uint64_t state = MAP_ATOMIC_LOAD(&reader->state);
+        if ((state & 1) && (state >> 1) < safe) { safe = state >> 1; }
+    }
+
+    uint64_t retired = MAP_ATOMIC_SWAP(&map->retired, 0), freed_n = 0;
+    while (retired)
+    {
+        MapIdx key_i = retired - 1;
+        retired = MAP_ATOMIC_LOAD(map__lf_free_next(map, key_i));
+        if (MAP_ATOMIC_LOAD(map__lf_retire_epoch(map, key_i)) < safe) { map__lf_free_push(map, key_i); ++freed_n; continue; }
+
+        uint64_t head; // still visible to someone; put it back
+        do {
+            head = MAP_ATOMIC_LOAD(&map->retired);
+            MAP_ATOMIC_STORE(map__lf_free_next(map, key_i), head);
+        } while (! MAP_ATOMIC_CAS(&map->retired, head, key_i + 1));
+    }
+    MAP_ATOMIC_ADD(&map->retired_n, (uint64_t)0 - freed_n);
+    MAP_ATOMIC_STORE(&map->reclaiming, 0);
+}
+
+static MapLfIdxs * map__lf_table(Map *map)
+{
+    MapLfIdxs *table = (MapLfIdxs *)MAP_ATOMIC_LOAD_PTR(&map->table);
+    if (! table)
+    {
+        MapLfIdxs *new_table = map__lf_new_table(Map_Load_Factor * MAP_MIN_ELEMENTS);
+        if (! new_table) { return 0; }
+        if (MAP_ATOMIC_CAS_PTR(&map->table, (MapLfIdxs *)0, new_table)) { table = new_table; }
+        else { free(new_table); table = (MapLfIdxs *)MAP_ATOMIC_LOAD_PTR(&map->table); }
+    }
+    return table;
+}
+
+// add a migrated key index to a table that only other migrating threads can be writing to
+static void map__lf_copy_in(Map *map, MapLfIdxs *table, MapIdx key_i)
+{
+    MapIdx hash = MAP_HASH_KEY(map__lf_key_get(map, key_i));
+    for (MapIdx i = 0; ; ++i)
+    { // always sized so there's room
+        MapIdx *slot = &table->idxs[map__mod_pow2(hash + i, table->idxs_n)];
+        if (MAP_ATOMIC_LOAD(slot) == Map_Lf_Empty &&
+            MAP_ATOMIC_CAS(slot, Map_Lf_Empty, key_i))
+        {   MAP_ATOMIC_ADD(&table->used, 1); return;   }
+    }
+}
+
+// migrate chunks of `table` to its successor until there are none left, then make sure the successor
+// is published as the current table.
+// Any writer that finds a resize in progress calls this before retrying, so they all finish it together.
+static void map__lf_help_resize(Map *map, MapLfIdxs *table)
+{
+    MapLfIdxs *next = (MapLfIdxs *)MAP_ATOMIC_LOAD_PTR(&table->next);
+    for (;;)
+    {
+        uint64_t start = MAP_ATOMIC_ADD(&table->copy_i, Map_Lf_Copy_Chunk);
+        if (start >= table->idxs_n) { break; }
+        uint64_t end = start + Map_Lf_Copy_Chunk < table->idxs_n ? start + Map_Lf_Copy_Chunk : table->idxs_n;
+
+        for (uint64_t i = start; i < end; ++i)
+        { // freeze the slot so that no writer can change it after it's been copied
+            MapIdx v;
+            do {   v = MAP_ATOMIC_LOAD(&table->idxs[i]);   }
+            while (! MAP_ATOMIC_CAS(&table->idxs[i], v, map__lf_freeze(v)));
+
+            if (v < Map_Lf_Frozen_Tomb) { map__lf_copy_in(map, next, v); } // tombstones are dropped here
+        }
+        MAP_ATOMIC_ADD(&table->copied, end - start);
+    }
+
+    // wait on any chunks still being copied by others
+    while (MAP_ATOMIC_LOAD(&table->copied) < table->idxs_n) { MAP_PAUSE(); }
+    MAP_ATOMIC_CAS_PTR(&map->table, table, next);
+}
+
+// returns 0 if the new table couldn't be allocated
+static int map__lf_start_resize(Map *map, MapLfIdxs *table, uint64_t min_idxs_n)
+{
+    if (! MAP_ATOMIC_LOAD_PTR(&table->next))
+    { // size for the live keys (dropping tombstones), not the used slots, with some slack for the
+      // inserts that were already under way when the resize started (at most 1 per thread)
+        uint64_t m = Map_Load_Factor * 2 * (MAP_ATOMIC_LOAD(&map->live) + Map_Lf_Copy_Chunk);
+        if (m < min_idxs_n) { m = min_idxs_n; }
+        --m, m|=m>>1, m|=m>>2, m|=m>>4, m|=m>>8, m|=m>>16, m|=m>>32, ++m; // ceiling pow 2
+
+        MapLfIdxs *next = map__lf_new_table(m);
+        if (! next) { return 0; }
+        next->prev = table;
+        if (! MAP_ATOMIC_CAS_PTR(&table->next, (MapLfIdxs *)0, next)) { free(next); }
+    }
+    map__lf_help_resize(map, table);
+    return 1;
+}
+
+// wait-free: a bounded probe that never writes
+// returns key index if found, or ~0 (0xFF...FF) otherwise
+// (the caller should be in a map_lf_enter section for the index to stay meaningful)
+MAP_API MapIdx map__key_i(Map const *map, MapKey key)
+{
+    map__assert(map);
+    MapLfIdxs *table = (MapLfIdxs *)MAP_ATOMIC_LOAD_PTR(&map->table);
+    if (! table) { return ~(MapIdx)0; }
+
+    MapIdx idxs_n = table->idxs_n,
+           hash_i = MAP_HASH_KEY(key);
+    for(MapIdx i = 0; i < idxs_n; ++i)
+    { // frozen slots still hold their (pre-migration) values, so readers never need to wait for a resize
+        MapIdx v = MAP_ATOMIC_LOAD(&table->idxs[map__mod_pow2(hash_i + i, idxs_n)]);
+        v = map__lf_unfreeze(v);
+        if (v == Map_Lf_Empty) { break; }
+        if (v != Map_Lf_Tomb)
+        {
+            MapKey slot_key = map__lf_key_get(map, v);
+            if (MAP_KEY_EQ(slot_key, key)) { return v; }
+        }
+    }
+    return ~(MapIdx)0;
+}
+
+// is key in the chain of table at any slot other than key_i's?
+static int map__lf_has_other(Map *map, MapLfIdxs *table, MapKey key, MapIdx key_i)
+{
+    MapIdx idxs_n = table->idxs_n,
+           hash_i = MAP_HASH_KEY(key);
+    for(MapIdx i = 0; i < idxs_n; ++i)
+    {
+        MapIdx v = MAP_ATOMIC_LOAD(&table->idxs[map__mod_pow2(hash_i + i, idxs_n)]);
+        v = map__lf_unfreeze(v);
+        if (v == Map_Lf_Empty) { break; }
+        if (v != Map_Lf_Tomb && v != key_i)
+        {
+            MapKey slot_key = map__lf_key_get(map, v);
+            if (MAP_KEY_EQ(slot_key, key)) { return 1; }
+        }
+    }
+    return 0;
+}
+
+// takes key_i back out of the idxs, following it into the next table if it's been migrated
+static void map__lf_unpublish(Map *map, MapKey key, MapIdx key_i)
+{
+    for (;;)
+    {
+        MapLfIdxs *table  = (MapLfIdxs *)MAP_ATOMIC_LOAD_PTR(&map->table);
+        MapIdx     idxs_n = table->idxs_n,
+                   hash_i = MAP_HASH_KEY(key);
+        int        retry  = 0;
+        for(MapIdx i = 0; i < idxs_n; ++i)
+        {
+            MapIdx *slot = &table->idxs[map__mod_pow2(hash_i + i, idxs_n)];
+            MapIdx  v    = MAP_ATOMIC_LOAD(slot);
+            MapIdx  u    = map__lf_unfreeze(v);
+            if (u == Map_Lf_Empty) { break; }
+            if (u != key_i)        { continue; }
+            if (map__lf_is_frozen(v)) { map__lf_help_resize(map, table); retry = 1; break; }
+            if (MAP_ATOMIC_CAS(slot, key_i, Map_Lf_Tomb)) { return; }
+            retry = 1; break; // frozen under us
+        }
+        if (! retry) { return; }
+    }
+}
+
+// tries to add key_i (whose key has already been written) to the idxs.
+// returns MAP_absent if it was added, or MAP_present with the existing key index in found_out
+static MapResult map__lf_publish(Map *map, MapKey key, MapIdx key_i, MapIdx *found_out)
+{
+    for (;;)
+    {
+        MapLfIdxs *table = map__lf_table(map);
+        if (! table) { return MAP_error; }
+
+        MapLfIdxs *next = (MapLfIdxs *)MAP_ATOMIC_LOAD_PTR(&table->next);
+        if (next) { map__lf_help_resize(map, table); continue; }
+        if (Map_Load_Factor * (MAP_ATOMIC_LOAD(&table->used) + 1) > table->idxs_n)
+        {
+            if (! map__lf_start_resize(map, table, 0)) { return MAP_error; }
+            continue;
+        }
+
+        // look through the whole chain for the key, remembering the first tombstone so that
+        // churn reuses slots rather than forcing a rehash (which leaves an old table behind)
+        MapIdx  idxs_n = table->idxs_n,
+                hash_i = MAP_HASH_KEY(key);
+        MapIdx *target = 0, expected = Map_Lf_Empty;
+        int     frozen = 0;
+        for(MapIdx i = 0; i < idxs_n; ++i)
+        {
+            MapIdx *slot = &table->idxs[map__mod_pow2(hash_i + i, idxs_n)];
+            MapIdx  v    = MAP_ATOMIC_LOAD(slot);
+            if (map__lf_is_frozen(v)) { frozen = 1; break; } // a resize has started; help it then retry
+            if (v == Map_Lf_Empty)
+            {
+                if (! target) { target = slot; }
+                break;
+            }
+            if (v == Map_Lf_Tomb)
+            {
+                if (! target) { target = slot, expected = Map_Lf_Tomb; }
+                continue;
+            }
+            MapKey slot_key = map__lf_key_get(map, v);
+            if (MAP_KEY_EQ(slot_key, key)) { *found_out = v; return MAP_present; }
+        }
+
+        if (frozen || ! target)
+        { // either the table was full or it's being resized
+            if (! map__lf_start_resize(map, table, 0)) { return MAP_error; }
+            continue;
+        }
+        if (! MAP_ATOMIC_CAS(target, expected, key_i)) { continue; } // slot changed under us; rescan
+
+        if (expected == Map_Lf_Empty) { MAP_ATOMIC_ADD(&table->used, 1); }
+        MAP_ATOMIC_ADD(&map->live, 1);
+
+        // the same key may have been added concurrently into a slot we'd already passed.
+        // Both back out and retry, so one of them will find the other next time around.
+        if (! map__lf_has_other(map, table, key, key_i)) { return MAP_absent; }
+        map__lf_unpublish(map, key, key_i);
+        MAP_ATOMIC_ADD(&map->live, -1);
+        MAP_PAUSE();
+    }
+}
+
+// the value is only guaranteed not to be reused for another key within the caller's map_lf_enter section
+MAP_API MapVal * map_ptr(Map const *map, MapKey key)
+{
+	map_lf_enter();
+	MapIdx key_i = map__key_i(map, key);
+	map_lf_leave();
+	return (~key_i) ? map__lf_val(map, key_i)
+	                : 0;
+}
+
+// as map_ptr for each of keys_n keys, with the slots for a group of keys prefetched together
+// so that their cache misses overlap. Returns the number found
+MAP_API size_t map_ptr_many(Map const *map, MapKey const *keys, size_t keys_n, MapVal **vals_out)
+{
+    map_lf_enter();
+    size_t     found_n = 0;
+    MapLfIdxs *table   = (MapLfIdxs *)MAP_ATOMIC_LOAD_PTR(&map->table);
+    for (size_t start = 0; start < keys_n; start += Map_Batch_N)
+    {
+        size_t batch_n = keys_n - start < Map_Batch_N ? keys_n - start : Map_Batch_N;
+        if (table)
+        {
+            for (size_t i = 0; i < batch_n; ++i)
+            {   MAP_PREFETCH(&table->idxs[map__mod_pow2(MAP_HASH_KEY(keys[start + i]), table->idxs_n)]);   }
+            for (size_t i = 0; i < batch_n; ++i)
+            {
+                MapIdx key_i = map__lf_unfreeze(MAP_ATOMIC_LOAD(&table->idxs[map__mod_pow2(MAP_HASH_KEY(keys[start + i]), table->idxs_n)]));
+                if (key_i < Map_Lf_Frozen_Tomb) {   MAP_PREFETCH(map__lf_key(map, key_i)); MAP_PREFETCH(map__lf_val(map, key_i));   }
+            }
+        }
+        for (size_t i = 0; i < batch_n; ++i)
+        {
+            vals_out[start + i] = map_ptr(map, keys[start + i]);
+            found_n += !! vals_out[start + i];
+        }
+    }
+    map_lf_leave();
+    return found_n;
+}
+
+MAP_API MapVal map_get(Map const *map, MapKey key)
+{
+    map_lf_enter();
+    MapVal result = Map_Invalid_Val;
+    MapIdx key_i  = map__key_i(map, key);
+    if (~key_i)
+    {
+        result = *map__lf_val(map, key_i);
+        MapKey slot_key = map__lf_key_get(map, key_i);
+        if (! (MAP_KEY_EQ(slot_key, key))) { result = Map_Invalid_Val; } // removed while the value was copied
+    }
+    map_lf_leave();
+    return result;
+}
+
+// returns non-zero if map contains key
+MAP_API MapResult map_has(Map const *map, MapKey key)
+{
+    map_lf_enter();
+    MapResult result = (MapResult)!!(~map__key_i(map, key));
+    map_lf_leave();
+    return result;
+}
+
+// ensures the idxs have room for values_n keys without another resize
+// returns non-zero on success
+MAP_API int map_resize(Map *map, uint64_t values_n)
+{
+    map__assert(map);
+    MapLfIdxs *table = map__lf_table(map);
+    if (! table) { return 0; }
+    map_lf_enter();
+    int result = (Map_Load_Factor * values_n <= table->idxs_n ||
+                  map__lf_start_resize(map, table, Map_Load_Factor * 2 * values_n));
+    map_lf_leave();
+    return result;
+}
+
+// as with the locked versions:
+// -1 - isn't in map, couldn't allocate sufficient space
+//  0 - wasn't previously in map, successfully inserted
+//  1 - was already in map (map_set: successfully updated, map_insert: no change made)
+static MapResult map__lf_add(Map *map, MapKey key, MapVal val, int should_update)
+{
+    map__assert(map);
+    map_lf_enter();
+    MapIdx key_i = map__lf_reserve(map);
+    if (! ~key_i) { map_lf_leave(); return MAP_error; }
+    *map__lf_val(map, key_i) = val;
+    map__lf_key_set(map, key_i, key); // (after the value, so a reader that sees the key sees it too)
+
+    MapIdx    found_i = ~(MapIdx)0;
+    MapResult result  = map__lf_publish(map, key, key_i, &found_i);
+    if (result != MAP_absent)
+    {
+        map__lf_retire(map, key_i); // (a reader may have seen it in the idxs before it was backed out)
+        if (result == MAP_present && should_update)
+        {   *map__lf_val(map, found_i) = val;   }
+    }
+    map_lf_leave();
+    return result;
+}
+
+MAP_API MapResult map_set(Map *map, MapKey key, MapVal val)
+{   return map__lf_add(map, key, val, 1);   }
+
+MAP_API MapResult map_insert(Map *map, MapKey key, MapVal val)
+{   return map__lf_add(map, key, val, 0);   }
+
+MAP_API MapResult map_update(Map *map, MapKey key, MapVal val)
+{
+    map_lf_enter();
+    MapVal *ptr = map_ptr(map, key);
+    if (ptr) { *ptr = val; }
+    map_lf_leave();
+    return ptr ? MAP_present : MAP_absent;
+}
+
+// removed slots are tombstoned rather than shuffled, so that probes never need to be rearranged
+MAP_API MapVal map_remove(Map *map, MapKey key)
+{
+    map__assert(map);
+    map_lf_enter();
+    MapVal result = Map_Invalid_Val;
+    for (;;)
+    {
+        MapLfIdxs *table = (MapLfIdxs *)MAP_ATOMIC_LOAD_PTR(&map->table);
+        if (! table) { break; }
+
+        MapIdx idxs_n = table->idxs_n,
+               hash_i = MAP_HASH_KEY(key);
+        int    frozen = 0;
+        for(MapIdx i = 0; i < idxs_n && ! frozen; ++i)
+        {
+            MapIdx *slot = &table->idxs[map__mod_pow2(hash_i + i, idxs_n)];
+            for (;;)
+            {
+                MapIdx v = MAP_ATOMIC_LOAD(slot);
+                if (v == Map_Lf_Empty)    { goto done; } // not in map
+                if (map__lf_is_frozen(v)) { frozen = 1; break; }
+                if (v == Map_Lf_Tomb)     { break; }
+
+                MapKey slot_key = map__lf_key_get(map, v);
+                if (! (MAP_KEY_EQ(slot_key, key))) { break; }
+
+                if (MAP_ATOMIC_CAS(slot, v, Map_Lf_Tomb))
+                {
+                    result = *map__lf_val(map, v);
+                    MAP_ATOMIC_ADD(&map->live, ~(size_t)0);
+                    map__lf_retire(map, v);
+                    goto done;
+                }
+                // slot changed under us (removed or frozen), look again
+            }
+        }
+
+        if (! frozen) { break; }
+        map__lf_help_resize(map, table);
+    }
+done:
+    map_lf_leave();
+    return result;
+}
+
+// NOTE: not safe to call concurrently with any other operation
+MAP_API uint64_t map_clear(Map *map)
+{
+    map__assert(map);
+    uint64_t n = map->live;
+    if (map->table)
+    {
+        MapLfIdxs *table = map->table;
+        for (MapIdx i = 0; i < table->idxs_n; ++i)
+        {   table->idxs[i] = Map_Lf_Empty;   }
+        table->used = 0;
+        for (MapLfIdxs *prev = table->prev, *p; prev; prev = p) // retired by earlier resizes
+        {   p = prev->prev; free(prev);   }
+        table->prev = 0;
+    }
+    for (size_t i = 0; i < map->n; ++i)
+    {   *map__lf_key(map, i) = Map_Invalid_Key;   }
+    map->n = map->live = 0;
+    map->free_head = map->retired = map->retired_n = 0;
+    return n;
+}
+
+// iterate with: for (i = 0; i < map->n; ++i) { if ((val = map_at(map, i, &key))) {...} }
+// returns 0 for key slots that aren't currently in use
+MAP_API MapVal * map_at(Map const *map, size_t i, MapKey *key_out)
+{
+    if (i >= map->n) { return 0; }
+    uint64_t off, seg = map__lf_seg(i, &off);
+    if (! MAP_ATOMIC_LOAD_PTR(&map->val_segs[seg])) { return 0; }
+
+    MapKey key = map__lf_key_get(map, i);
+    if (MAP_KEY_EQ(key, Map_Invalid_Key)) { return 0; }
+    if (key_out) { *key_out = key; }
+    return map__lf_val(map, i);
+}
+
+#ifdef MAP_COLD
+MAP_API MapCold * map_cold_ptr(Map const *map, MapKey key)
+{
+	map_lf_enter();
+	MapIdx key_i = map__key_i(map, key);
+	map_lf_leave();
+	return (~key_i) ? map__lf_cold(map, key_i)
+	                : 0;
+}
+
+// the cold value for the key at i, as with map_at
+MAP_API MapCold * map_cold_at(Map const *map, size_t i)
+{   return map_at(map, i, 0) ? map__lf_cold(map, i) : 0;   }
+#endif//MAP_COLD
+
+#else //MAP_LOCKFREE
 // returns:
 // 1) the index of a key index that may or may not be valid (but will always be within array bounds)
 // 2) ~0 -> no allocation has been made so far, allocate
@@ -219,6 +1055,44 @@ MAP_API MapVal * map_ptr(Map const *map, MapKey key)
     return result;
 }
 
+// as map_ptr for each of keys_n keys, with the slots for a group of keys prefetched together
+// so that their cache misses overlap. Returns the number found
+MAP_API size_t map_ptr_many(Map const *map, MapKey const *keys, size_t keys_n, MapVal **vals_out)
+{
+    map__assert(map);
+    MAP_LOCK(&((Map *)map)->lock);
+    size_t found_n = 0;
+    MapIdx idxs_n  = Map_Load_Factor * map->max;
+    for (size_t start = 0; start < keys_n; start += Map_Batch_N)
+    {
+        size_t batch_n = keys_n - start < Map_Batch_N ? keys_n - start : Map_Batch_N;
+        MapIdx hashes[Map_Batch_N];
+        if (map->n)
+        { // hash everything, then fetch the idxs, then the keys/vals they point to
+            for (size_t i = 0; i < batch_n; ++i)
+            {
+                hashes[i] = map__mod_pow2(MAP_HASH_KEY(keys[start + i]), idxs_n);
+                MAP_PREFETCH(&map->idxs[hashes[i]]);
+            }
+            for (size_t i = 0; i < batch_n; ++i)
+            {
+                MapIdx key_i = map->idxs[hashes[i]];
+                if (~key_i) {   MAP_PREFETCH(&map->keys[key_i]); MAP_PREFETCH(&map->vals[key_i]);   }
+            }
+        }
+        for (size_t i = 0; i < batch_n; ++i)
+        {
+            MapIdx key_i = map__key_i(map, keys[start + i]);
+            vals_out[start + i] = (~key_i) ? &map->vals[key_i]
+                                           : 0;
+            found_n += !! ~key_i;
+        }
+    }
+    MAP_TEST_INVARIANTS(map);
+    MAP_UNLOCK(&((Map *)map)->lock);
+    return found_n;
+}
+
 MAP_API MapVal map_get(Map const *map, MapKey key)
 {
     map__assert(map);
@@ -271,6 +1145,10 @@ MAP_API int map_resize(Map *map, uint64_t values_n)
         new.vals = (MapVal *)realloc((void *)old.vals, vals_size);
         new.idxs = (MapIdx *)realloc((void *)old.idxs, idxs_size);
         if (! (new.keys && new.vals && new.idxs)) { goto end; }
+#ifdef MAP_COLD
+        new.colds = (MapCold *)realloc((void *)old.colds, new.max * sizeof(MapCold));
+        if (! new.colds) { goto end; }
+#endif
     }
 
     { // set up new indexes
@@ -430,6 +1308,9 @@ MAP_API MapVal map_remove(Map *map, MapKey key)
 
         keys[rm_idx]    = swap_key;    // overwrite deleted key with key from end
         vals[rm_idx]    = vals[end_i]; // overwrite deleted val with val from end
+#ifdef MAP_COLD
+        map->colds[rm_idx] = map->colds[end_i];
+#endif
     }
 
     // move back elements to make sure they're valid for linear-probing
@@ -477,6 +1358,33 @@ MAP_API uint64_t map_clear(Map *map)
 	return n;
 }
 
+// iterate with: for (i = 0; i < map->n; ++i) { if ((val = map_at(map, i, &key))) {...} }
+// (removing swaps the last entry into the removed one's place; iterate backwards to remove as you go)
+MAP_API MapVal * map_at(Map const *map, size_t i, MapKey *key_out)
+{
+    if (i >= map->n) { return 0; }
+    if (key_out) { *key_out = map->keys[i]; }
+    return &map->vals[i];
+}
+
+#ifdef MAP_COLD
+MAP_API MapCold * map_cold_ptr(Map const *map, MapKey key)
+{
+    map__assert(map);
+    MAP_LOCK(&((Map *)map)->lock);
+	MapIdx   key_i  = map__key_i(map, key);
+	MapCold *result = (~key_i) ? &map->colds[key_i]
+	                           : 0;
+    MAP_UNLOCK(&((Map *)map)->lock);
+    return result;
+}
+
+// the cold value for the key at i, as with map_at
+MAP_API MapCold * map_cold_at(Map const *map, size_t i)
+{   return i < map->n ? &map->colds[i] : 0;   }
+#endif//MAP_COLD
+#endif//MAP_LOCKFREE
+
 #if 1 // INVARIANTS
 #ifdef MAP_TEST
 # ifndef MAP_TEST_CONSTANTS
@@ -578,6 +1486,8 @@ static void map__test_invariants(Map *map)
 
 // USER FUNCTIONS:
 #undef map_has
+#undef map_ptr
+#undef map_ptr_many
 #undef map_get
 #undef map_set
 #undef map_clear
@@ -585,11 +1495,38 @@ static void map__test_invariants(Map *map)
 #undef map_insert
 #undef map_remove
 #undef map_resize
+#undef map_at
+#undef map_cold_ptr
+#undef map_cold_at
+
+#undef map__lf_key
+#undef map__lf_val
+#undef map__lf_cold
+#undef map__lf_free_next
+#undef map__lf_reserve
+#undef map__lf_key_get
+#undef map__lf_key_set
+#undef map__lf_retire_epoch
+#undef map__lf_free_push
+#undef map__lf_retire
+#undef map__lf_reclaim
+#undef map__lf_table
+#undef map__lf_copy_in
+#undef map__lf_help_resize
+#undef map__lf_start_resize
+#undef map__lf_has_other
+#undef map__lf_unpublish
+#undef map__lf_publish
+#undef map__lf_add
 
 #undef MAP_TYPES
+#undef MAP_COLD
+#undef MapCold
+#undef MAP_LOCKFREE
 #undef MAP_MUTEX
 
 #undef MAP_CAT1
 #undef MAP_CAT2
 #undef MAP_CAT
+#undef MAP_APPLY
 #endif /*undefs*/
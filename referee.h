@@ -7,24 +7,17 @@
 // - add key array (delete by swapping in last key) to allow looping?
 // 		- (this is for general hashmap, is it needed here?)
 // - ensure you can't track NULL ptrs
-// - allow relocatable heaps
-//       mem: |   A   |  B  |     C    |
-//       ptr:               ^
-//       free B
-//       mem: |   A   |-----|     C    |
-//       ptr:               ^
-//       shift C down to fill gap
-//       mem: |   A   |     C    |------
-//       ptr:               ^
-//       make sure ptr(s) point to the right place (if > B, shift down by size of B)
-//       mem: |   A   |     C    |------
-//       ptr:         ^
+
+#ifndef REFEREE_H // (so that e.g. referee_snapshot.c's reader can be included after it)
+#define REFEREE_H
 
 #ifndef REFEREE_NOSTDLIB
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #endif//REFEREE_NOSTDLIB
+#include <stddef.h>
+#include <stdint.h>
 
 #ifndef REFEREE_API
 #define REFEREE_API static
@@ -35,8 +28,11 @@
 #ifndef REFEREE_FREE
 #define REFEREE_FREE(allocator, ptr) free(ptr)
 #endif//REFEREE_FREE
+#ifndef REFEREE_register_realloc // hook for external tools, e.g. ITT
+#define REFEREE_register_realloc(...)
+#endif//REFEREE_register_realloc
 
-#if REFEREE_DEBUG // control whether callsite is recorded
+#if REFEREE_DEBUG || REFEREE_SAMPLE // control whether callsite is recorded (for every ptr, or a sample)
 #define REF_DBG(fn, ...) fn##_dbg(__VA_ARGS__, int line, char const *file, char const *func, char const *call)
 
 #define ref_add(...)                ref_add_dbg(__VA_ARGS__,                __LINE__, __FILE__, __func__, "ref_add("#__VA_ARGS__")")
@@ -46,6 +42,8 @@
 #define ref_realloc(...)            ref_realloc_dbg(__VA_ARGS__,            __LINE__, __FILE__, __func__, "ref_realloc("#__VA_ARGS__")")
 #define ref_realloc_n(...)          ref_realloc_n_dbg(__VA_ARGS__,          __LINE__, __FILE__, __func__, "ref_realloc_n("#__VA_ARGS__")")
 #define ref_register_realloc_n(...) ref_register_realloc_n_dbg(__VA_ARGS__, __LINE__, __FILE__, __func__, "ref_register_realloc_n("#__VA_ARGS__")")
+#define ref_dup(...)                ref_dup_dbg(__VA_ARGS__,                __LINE__, __FILE__, __func__, "ref_dup("#__VA_ARGS__")")
+#define ref_new_h(...)              ref_new_h_dbg(__VA_ARGS__,              __LINE__, __FILE__, __func__, "ref_new_h("#__VA_ARGS__")")
 
 #define ref_add_n_(...)              ref_add_n_dbg(__VA_ARGS__,     line, file, func, call)
 #define ref_new_n_(...)              ref_new_n_dbg(__VA_ARGS__,     line, file, func, call)
@@ -53,6 +51,7 @@
 #define ref_register_realloc_n_(...) ref_register_realloc_n_dbg(__VA_ARGS__, line, file, func, call)
 
 // internal functions
+#define ref__header_add_(...)        ref__header_add_dbg(__VA_ARGS__,  line, file, func, call)
 
 #else //REFEREE_DEBUG
 #define REF_DBG(fn, ...) fn(__VA_ARGS__)
@@ -61,10 +60,14 @@
 #define ref_new_n_(...)              ref_new_n(__VA_ARGS__)
 #define ref_realloc_n_(...)          ref_realloc_n(__VA_ARGS__)
 #define ref_register_realloc_n_(...) ref_register_realloc_n(__VA_ARGS__)
+
+#define ref__header_add_(...)        ref__header_add(__VA_ARGS__)
 #endif//REFEREE_DEBUG
 
 typedef struct Referee Referee;
 typedef struct RefInfo RefInfo;
+typedef struct RefArena RefArena;
+typedef struct RefSlabs RefSlabs;
 
 // suffix 'n' for breaking allocations to el_size/num_els
 // suffix 'c' for referring to the refcount
@@ -81,6 +84,8 @@ REFEREE_API void *REF_DBG(ref_new_n, Referee *ref, size_t el_n, size_t el_size,
 REFEREE_API void *REF_DBG(ref_add,   Referee *ref, void *ptr, size_t alloc_size, size_t init_refs);
 REFEREE_API void *REF_DBG(ref_add_n, Referee *ref, void *ptr, size_t el_n, size_t el_size, size_t init_refs);
 // stop tracking a ptr without deallocating it ("forget"?)
+// returns ptr, or NULL if it has a header (with REFEREE_HEADERS, ptrs from ref_new/ref_realloc can't be
+// separated from their info, so stay tracked)
 REFEREE_API void *ref_remove(Referee *ref, void *ptr);
 
 // duplicate a given piece of memory that is already tracked by ref
@@ -100,9 +105,56 @@ REFEREE_API void *ref_dec_c(Referee *ref, void *ptr, size_t count);
 // count of references to a particular ptr
 REFEREE_API size_t ref_count(Referee *ref, void *ptr);
 
+// as ref_info/ref_inc/ref_dec, but addr can be anywhere inside the block rather than just its start
+// (with REFEREE_INTERIOR; otherwise only the start of a block is found)
+// base_out: if given, set to the start of the block (or NULL if addr isn't in one)
+// blocks only reachable by handle aren't found, nor are blocks that overlap lots of other blocks
+// returns as the non-interior versions, i.e. ref_inc_interior/ref_dec_interior return addr
+REFEREE_API RefInfo *ref_info_containing(Referee *ref, void *addr, void **base_out);
+REFEREE_API void    *ref_inc_interior   (Referee *ref, void *addr);
+REFEREE_API void    *ref_dec_interior   (Referee *ref, void *addr);
+
+// as ref_inc_c/ref_dec_c/ref_count for each of ptrs_n ptrs (0s are skipped), with the lookups for
+// a batch done together so that their cache misses overlap
+// deltas: the count to add/remove for each ptr, or NULL for 1 each
+// returns the number of ptrs that were being refcounted
+REFEREE_API size_t ref_inc_many  (Referee *ref, void *const *ptrs, size_t ptrs_n, size_t const *deltas);
+REFEREE_API size_t ref_dec_many  (Referee *ref, void *const *ptrs, size_t ptrs_n, size_t const *deltas);
+REFEREE_API size_t ref_count_many(Referee *ref, void *const *ptrs, size_t ptrs_n, size_t *counts_out);
+
 // frees and removes all pointers with a refcount of 0
 // returns number removed
 REFEREE_API size_t ref_purge(Referee *ref);
+// as ref_purge, but stops once max_blocks have been freed or max_ns nanoseconds have passed (0 for no
+// limit), so that freeing lots of garbage can be spread out. The next call carries on from there.
+// A ptr that's revived (by ref_inc) before it's reached is skipped, and doesn't count towards max_blocks.
+// garbage_left_out: if given, set to the number of ptrs with a refcount of 0 still waiting
+// (their bytes are ref_stats(ref).zero_bytes)
+// returns number removed
+REFEREE_API size_t ref_purge_step(Referee *ref, size_t max_blocks, uint64_t max_ns, size_t *garbage_left_out);
+// with REFEREE_BUDGET: caps the bytes that ref holds (live_bytes, which includes ptrs with a refcount of
+// 0, plus recycled_bytes), so that zero-count ptrs can be left for later (e.g. as a cache) rather than
+// purged. Once ref_new/ref_new_n/ref_realloc/ref_realloc_n would take ref over the budget, the ptrs
+// whose counts reached 0 longest ago are freed first (as ref_purge would) until there's room.
+// An inc in the meantime revives a ptr and takes it off that list. If freeing every zero-count ptr
+// isn't enough, the allocation goes ahead anyway. (With threads, allocations racing each other can
+// free a little more than they need to, or briefly go over.)
+// bytes: 0 for no budget
+// returns the previous budget, or REFEREE_INVALID without REFEREE_BUDGET
+REFEREE_API size_t ref_set_budget(Referee *ref, size_t bytes);
+
+// with REFEREE_DEFERRED: applies every thread's logged incs/decs (to whichever Referee they're for),
+// all of the incs first
+// ref_purge does this itself; call it before relying on ref_count/ref_info
+REFEREE_API void ref_flush(void);
+// with REFEREE_RECLAIM: waits until every ptr purged so far has actually been freed, then stops the
+// reclaimer thread (the next purge starts it again). Call before releasing/resetting ref's allocator,
+// and at shutdown.
+REFEREE_API void ref_reclaim_flush(Referee *ref);
+// with REFEREE_RECYCLE: frees blocks kept for reuse until at most max_bytes of them are left, e.g. 0
+// when memory runs short (ref_new/ref_new_n do that themselves before giving up on an allocation)
+// returns the number of bytes freed
+REFEREE_API size_t ref_recycle_trim(Referee *ref, size_t max_bytes);
 
 // TODO: work out how refs should work
 // sort out naming convention with new above
@@ -121,7 +173,37 @@ REFEREE_API size_t ref_recount(Referee *ref, void *ptr, size_t new_count);
 // returns a pointer to the reference-count information on ptr.
 // This can be read from or written to
 // returns NULL if ptr is not being refcounted
+// NOTE: the pointer is into ptr's shard's map, which isn't locked once this returns, so with
+// REFEREE_THREADS it's only valid while no other thread can add/remove/purge anything (use
+// ref_info_copy otherwise)
 REFEREE_API RefInfo *ref_info(Referee *ref, void *ptr);
+// copies the reference-count information on ptr into info_out (safe with REFEREE_THREADS)
+// returns 1 if ptr is being refcounted, otherwise 0 (and info_out isn't written)
+REFEREE_API int      ref_info_copy(Referee *ref, void *ptr, RefInfo *info_out);
+// what the info's ptr was allocated/added with (REFEREE_COMPACT_INFO packs these, so use these
+// rather than reading the fields)
+REFEREE_API size_t ref_info_el_n   (RefInfo const *info);
+REFEREE_API size_t ref_info_el_size(RefInfo const *info);
+
+// Handles: an alternative to ptrs as keys, for blocks that are only referred to through them.
+// A handle is an index into a dense table of slots (the low Referee_Handle_Index_Bits) plus the slot's
+// generation (the rest), so a lookup is an array index rather than a hash probe, and a handle whose
+// block has since been freed is rejected (a slot is retired rather than let its generation wrap, so
+// after about 2^32 ref_new_h the table can fill up). 0 is never a valid handle.
+// Handle blocks aren't tracked by ptr, so ref_inc/ref_dec/ref_info etc. don't find them, and with
+// REFEREE_DEFERRED their incs/decs are still applied immediately.
+// ref_purge, ref_reset and ref_compact cover them along with everything else.
+typedef uint32_t RefHandle;
+// returns 0 if allocation failed or the table is full
+REFEREE_API RefHandle REF_DBG(ref_new_h, Referee *ref, size_t alloc_size, size_t init_refs);
+// each returns the block's current ptr, or NULL if handle is stale
+REFEREE_API void  *ref_inc_h  (Referee *ref, RefHandle handle);
+REFEREE_API void  *ref_dec_h  (Referee *ref, RefHandle handle);
+REFEREE_API void  *ref_get_h  (Referee *ref, RefHandle handle);
+REFEREE_API size_t ref_count_h(Referee *ref, RefHandle handle);
+// force a free, regardless of number of references
+// returns 1 if the block was freed, 0 if handle is stale
+REFEREE_API int    ref_free_h (Referee *ref, RefHandle handle);
 
 // uses stdlib allocation (mainly for transition from normal malloc/free code)
 /* void *ref_stdmalloc(size_t size); */
@@ -137,306 +219,5033 @@ REFEREE_API void *ref_free(Referee *ref, void *ptr); // TODO: size_t *refcount_o
 // force a free, but only if number of refs is below the given max (should this be < or <=?)
 /* REFEREE_API int ref_free_c(void *ptr, size_t max_refs); */
 
-// returns total memory tracked by referee (in bytes)
-REFEREE_API size_t ref_total_size(Referee *ref);
-REFEREE_API void ref_dump_mem_usage(FILE *out, Referee *ref, int should_destructively_sort);
+// stop tracking everything, freeing it regardless of refcount
+// (with a RefArena, all of its memory is reclaimed at once instead of freeing each ptr)
+// returns number of ptrs dropped
+REFEREE_API size_t ref_reset(Referee *ref);
 
-#if defined(REFEREE_IMPLEMENTATION) || defined(REFEREE_TEST)
+// called for each block that ref_compact moves; every copy of old_ptr needs replacing with new_ptr
+typedef void RefRelocateFn(void *user, void *old_ptr, void *new_ptr, size_t size);
+// for a Referee allocating from a RefArena: moves tracked ptrs out of chunks that are mostly garbage
+// (below Referee_Compact_Occupancy) into fresh ones, then frees the old chunks.
+// Every ptr tracked must come from the arena, and nothing else may use ref or its ptrs meanwhile.
+// (handle blocks are moved too, without relocate being called, as their handles stay the same)
+// returns number of ptrs moved, or REFEREE_INVALID if ref doesn't use a RefArena (or it ran out of memory)
+REFEREE_API size_t ref_compact(Referee *ref, RefRelocateFn *relocate, void *user);
 
-#define REFEREE_INVALID (~((size_t)0))
+// Cycle collection (with REFEREE_CYCLES): blocks that reference each other never reach a count of 0
+// by themselves. Each block whose count is dec'd but stays above 0 is remembered as a possible root
+// of a garbage cycle, and the collector trial-deletes the references inside the graph reachable
+// from those roots (without changing any counts) to find blocks that nothing outside of it holds.
+// Only ptr-tracked blocks take part (not handle blocks).
+// children calls visit(ctx, child) for each tracked ptr that ptr holds one counted reference to
+typedef void RefVisitFn(void *ctx, void *child);
+typedef void RefChildrenFn(void *user, void *ptr, RefVisitFn *visit, void *ctx);
+// takes possible roots until about budget blocks have been visited (finishing the graph reachable
+// from the last root), so each call's pause is bounded by the budget rather than the heap. Garbage
+// blocks have the references they hold to blocks that aren't garbage dec'd, and their own count
+// set to 0, so the next ref_purge frees them.
+// Nothing else may change the counts of, or references between, the blocks reached until it returns.
+// roots_left_out: if given, set to the number of possible roots still waiting for a later call
+// returns the number of garbage blocks found, or REFEREE_INVALID if it ran out of memory
+REFEREE_API size_t ref_collect_cycles_step(Referee *ref, RefChildrenFn *children, void *user, size_t budget, size_t *roots_left_out);
+// as ref_collect_cycles_step, with every possible root taken at once
+REFEREE_API size_t ref_collect_cycles     (Referee *ref, RefChildrenFn *children, void *user);
 
-struct RefInfo {
-	size_t refcount; // is size_t excessive?
-	size_t el_n;
-	size_t el_size;
+// Finalizers (with REFEREE_FINALIZERS): run just before a block's memory is released by ref_purge,
+// ref_purge_step or ref_free, e.g. to close what it owns or dec the blocks it holds (those that reach 0
+// are freed by the same ref_purge). A purge's blocks are finalized a batch at a time, grouped by type.
+// Not run by ref_remove (nothing is released) or ref_reset. Only ptr-tracked blocks (not handle blocks).
+typedef void RefFinalizeFn(void *user, void *const *ptrs, size_t ptrs_n);
+// returns the type to give blocks to be finalized by fn (the same one for the same fn and user), or
+// 0 if there are already Referee_Finalizer_Types_N
+REFEREE_API uint32_t ref_finalizer_type(Referee *ref, RefFinalizeFn *fn, void *user);
+// type: as given by ref_finalizer_type, or 0 for none
+// ptr mustn't be freed or purged while this is running
+// returns ptr's previous type, or REFEREE_INVALID if ptr isn't tracked or type isn't known
+REFEREE_API size_t ref_set_finalizer(Referee *ref, void *ptr, uint32_t type);
 
-#if REFEREE_DEBUG
-	size_t line;
+// Weak refs (with REFEREE_WEAK): refer to a ptr-tracked block without keeping it alive. Once the block
+// is purged, freed, removed or realloc'd its weak refs go stale (its memory isn't held back for them).
+// They follow it through ref_compact. (A RefHandle already works this way for handle blocks.)
+typedef uint64_t RefWeak;
+// returns a weak ref to ptr (the same one while ptr lives), or 0 if ptr isn't tracked or out of memory
+REFEREE_API RefWeak ref_weak(Referee *ref, void *ptr);
+// incs the block that weak refers to and returns its ptr, or returns 0 if the block has gone
+// (one with a count of 0 that hasn't been purged yet is revived)
+REFEREE_API void *ref_upgrade(Referee *ref, RefWeak weak);
+
+// Bump allocator that hands out blocks from large chunks, for many short-lived allocations.
+// A chunk goes back to the system once every block in it has been freed (e.g. by ref_purge),
+// or all at once with ref_reset/ref_arena_reset.
+// e.g. RefArena arena = {0}; Referee ref = { &arena, ref_arena_realloc, ref_arena_free };
+REFEREE_API void *ref_arena_realloc(void *arena, void *ptr, size_t el_n, size_t el_size);
+REFEREE_API void  ref_arena_free   (void *arena, void *ptr);
+// frees every block allocated from arena in one go, keeping a chunk for reuse
+REFEREE_API void  ref_arena_reset  (RefArena *arena);
+// returns all of arena's memory to the system
+REFEREE_API void  ref_arena_release(RefArena *arena);
+
+// Pools of fixed-size blocks for small allocations (up to Referee_Slab_Max_Size), one per size class,
+// carved out of aligned slabs so blocks need no header. Larger sizes go to REFEREE_REALLOC/REFEREE_FREE.
+// e.g. RefSlabs slabs = {0}; Referee ref = { &slabs, ref_slabs_realloc, ref_slabs_free };
+REFEREE_API void *ref_slabs_realloc(void *slabs, void *ptr, size_t el_n, size_t el_size);
+REFEREE_API void  ref_slabs_free   (void *slabs, void *ptr);
+// returns all of the slabs' memory to the system (but not the large blocks)
+REFEREE_API void  ref_slabs_release(RefSlabs *slabs);
+
+typedef struct RefSlabStats {
+	size_t size;       // of each block in the class (0 for the large fallback)
+	size_t slabs_n;
+	size_t live_n;     // blocks currently allocated
+	size_t capacity_n; // blocks that the class's slabs can hold
+} RefSlabStats;
+// fills stats_out with up to stats_max classes, followed by the large fallback
+// returns the number of entries that there are in total
+REFEREE_API size_t ref_slabs_stats(RefSlabs *slabs, RefSlabStats *stats_out, size_t stats_max);
+REFEREE_API void   ref_slabs_dump (FILE *out, RefSlabs *slabs);
+
+// With REFEREE_DEBUG: a place that ptrs have been tracked from (by ref_new, ref_add etc.), with totals
+// over every Referee that are kept up to date as its ptrs are tracked and dropped
+// With REFEREE_SAMPLE: a place that sampled ptrs were allocated from, with the totals estimated for
+// every ptr allocated there (each sample counting for as many ptrs and bytes as it stands for)
+typedef struct RefCallsite {
+	size_t      line;
 	char const *file;
 	char const *func;
 	char const *call;
-#endif//REFEREE_DEBUG
-};
 
+	size_t live_n;     // ptrs tracked from here that still are
+	size_t live_bytes;
+	size_t peak_bytes; // the most that live_bytes has been
+	size_t total_n;    // ptrs ever tracked from here
+} RefCallsite;
+// copies up to callsites_max callsites into callsites_out, in the order that they were first seen
+// (this is O(callsites), rather than a walk of everything tracked)
+// returns the number of callsites there are in total (always 0 without REFEREE_DEBUG or REFEREE_SAMPLE)
+REFEREE_API size_t ref_callsites(RefCallsite *callsites_out, size_t callsites_max);
+// with REFEREE_SAMPLE: writes each live sample as text, biggest estimate first, with its backtrace
+// (if Referee_Sample_Frames_N), symbolized where the platform can
+// returns the number of samples written, or REFEREE_INVALID if out of memory
+REFEREE_API size_t ref_samples_dump(FILE *out, Referee *ref);
 
-#define MAP_INVALID_VAL { REFEREE_INVALID, REFEREE_INVALID, REFEREE_INVALID }
-#define MAP_TYPES (RefereePtrInfoMap, ref__map, void *, RefInfo)
-#include "hash.h"
+// Running totals, kept up to date as ptrs are tracked/dropped and refcounts hit/leave 0
+typedef struct RefStats {
+	size_t live_bytes; // tracked now (as ref_total_size)
+	size_t live_n;
+	size_t zero_bytes; // of ptrs with a refcount of 0, i.e. what the next ref_purge would free
+	size_t peak_bytes; // the most that live_bytes has been
+	size_t allocs_n;   // ptrs that have started being tracked (ref_new, ref_add, ref_realloc...)
+	size_t frees_n;    // ptrs that have stopped being tracked (ref_free, ref_purge, ref_realloc...)
+	// with REFEREE_RECYCLE (0 otherwise):
+	size_t recycled_bytes;   // purged blocks kept for reuse (not in live_bytes)
+	size_t recycle_hits_n;   // ref_new/ref_new_n calls given a kept block
+	size_t recycle_misses_n; // ... that had to allocate
+} RefStats;
+// O(1) (or O(shards)), without locking, so it's fine to poll often. While other threads are
+// changing ref, the fields are each current but not necessarily as of the same moment.
+// (writing sizes through ref_info isn't seen)
+REFEREE_API RefStats ref_stats(Referee *ref);
 
-#define Referee_Test_Len 8
-struct Referee {
-	// Ordered so that this can be created with constants in any scope (including global)
-	// e.g. Referee ref = { my_allocator, my_alloc, my_free };
-	void *allocator;
-	void *(*realloc)(void *allocator, void *ptr, size_t el_n, size_t el_size); // must allocate if given NULL ptr as per realloc
-	void  (*free)   (void *allocator, void *ptr);
+// returns total memory tracked by referee (in bytes), as ref_stats(ref).live_bytes
+REFEREE_API size_t ref_total_size(Referee *ref);
+// writes every tracked ptr as text (biggest first if should_sort). Nothing tracked is changed
+REFEREE_API void ref_dump_mem_usage(FILE *out, Referee *ref, int should_sort);
 
-	RefereePtrInfoMap ptr_infos;
-};
+// what each row of ref_report totals up
+typedef enum RefReportBy {
+	REF_REPORT_PTR,      // each ptr on its own
+	REF_REPORT_CALLSITE, // (only split up with REFEREE_DEBUG, or estimated from samples with REFEREE_SAMPLE)
+	REF_REPORT_FILE,     // (as REF_REPORT_CALLSITE)
+	REF_REPORT_SIZE,     // power-of-2 buckets of ptr size
+} RefReportBy;
+typedef enum RefReportFormat {
+	REF_REPORT_TEXT, // as ref_dump_mem_usage
+	REF_REPORT_CSV,  // bytes,n,min_size,max_size,ptr,file,line,func,call,sizes_up_to (with a header line)
+	REF_REPORT_JSON, // {"total_bytes": ..., "rows_n": <before top_n>, "rows": [{"bytes": ..., ...}, ...]}
+	                 // (sizes_up_to: the REF_REPORT_SIZE bucket's limit, left out of other rows)
+} RefReportFormat;
+// writes the memory tracked by ref grouped by `by`, biggest (by bytes) first
+// top_n: if non-0, only the top_n biggest rows are written (found without sorting all of them)
+// Nothing tracked is changed; the rows are gathered into scratch memory first.
+// returns the number of rows written, or REFEREE_INVALID if the scratch memory couldn't be allocated
+REFEREE_API size_t ref_report(FILE *out, Referee *ref, RefReportBy by, RefReportFormat format, size_t top_n);
 
-REFEREE_API RefInfo *
-ref_info(Referee *ref, void *ptr)
+// The snapshot format written by ref_snapshot_write (and read by referee_snapshot.c). Every number is
+// a LEB128 varint:
+//   Referee_Snapshot_Magic (8 bytes, the last of which is the version), flags
+//   records, each starting with its tag:
+//     REF_SNAPSHOT_PTR:      address (zigzag delta from the previous ptr's), el_n, el_size, refcount,
+//                            callsite id (if flags has Referee_Snapshot_Has_Callsites; 0 if unknown)
+//     REF_SNAPSHOT_CALLSITE: id, line, then file, func and call (each as a length then its bytes)
+//     REF_SNAPSHOT_END
+enum { REF_SNAPSHOT_END, REF_SNAPSHOT_PTR, REF_SNAPSHOT_CALLSITE };
+#define Referee_Snapshot_Magic         "REFSNAP\1"
+#define Referee_Snapshot_Has_Callsites 1 // (with REFEREE_DEBUG)
+// streams every ptr tracked by ref to out, buffered
+// returns the number of ptrs written, or REFEREE_INVALID if writing failed
+REFEREE_API size_t ref_snapshot_write(FILE *out, Referee *ref);
+
+#if defined(REFEREE_IMPLEMENTATION) || defined(REFEREE_TEST)
+
+#define REFEREE_INVALID (~((size_t)0))
+
+// REFEREE_COMPACT_INFO: RefInfo is packed into 16 bytes (from 32, or 64 with REFEREE_DEBUG), so that
+// more of them share each cache line of the map:
+// - the refcount is 32-bit. A count that would overflow sticks at Referee_Count_Sticky instead,
+//   after which incs/decs leave it alone and it's never purged (only ref_free/ref_reset drop it)
+// - el_n/el_size are replaced by a 48-bit byte size, and a 16-bit el_size (0 if it didn't fit, when
+//   el_n is taken as 1); read them with ref_info_el_n/ref_info_el_size
+// - with REFEREE_DEBUG, the callsite is kept out of line (in a parallel cold array for map entries)
+#ifndef  REFEREE_COMPACT_INFO
+# define REFEREE_COMPACT_INFO 0
+#endif
+#if REFEREE_COMPACT_INFO
+typedef uint32_t RefCount;
+#else
+typedef size_t   RefCount;
+#endif
+
+#if 1 // THREADING
+// REFEREE_THREADS: refcounts are updated atomically and ptr_infos is split into 2^REFEREE_SHARD_BITS
+// shards (chosen by ptr hash), each with its own reader/writer lock.
+// inc/dec/count only take a shard's read lock; inserting, removing and purging take its write lock.
+// The allocator given to the Referee must be thread-safe itself.
+//
+// REFEREE_LOCKFREE (implies REFEREE_THREADS): the shards' maps are built with hash.h's MAP_LOCKFREE,
+// so inc/dec/count don't take any lock at all. The write lock only serializes writers (e.g. the zero
+// list). Purge claims a zero count by swapping it for REFEREE_DEAD, which a racing inc/dec backs off from.
+// Readers mark themselves with hash.h's epochs instead, so removed entries aren't reused under them.
+#ifndef  REFEREE_LOCKFREE
+# define REFEREE_LOCKFREE 0
+#endif
+#if REFEREE_LOCKFREE && ! REFEREE_THREADS
+# undef  REFEREE_THREADS
+# define REFEREE_THREADS 1
+#endif
+// REFEREE_RECLAIM (implies REFEREE_THREADS): ref_purge/ref_purge_step only unlink zero-count ptrs,
+// handing them a batch at a time (over a lock-free queue) to a background thread that frees them,
+// so that the purging thread doesn't pay for slow frees (e.g. munmap of large blocks).
+// The thread is started by the first purge that hands anything over. ref->free is called from it.
+// Needs -lpthread outside of Windows.
+#ifndef  REFEREE_RECLAIM
+# define REFEREE_RECLAIM 0
+#endif
+#if REFEREE_RECLAIM && ! REFEREE_THREADS
+# undef  REFEREE_THREADS
+# define REFEREE_THREADS 1
+#endif
+#ifndef  REFEREE_SHARD_BITS
+# if REFEREE_THREADS
+#  define REFEREE_SHARD_BITS 6
+# else
+#  define REFEREE_SHARD_BITS 0
+# endif
+#endif //REFEREE_SHARD_BITS
+#define REFEREE_SHARD_N (1 << REFEREE_SHARD_BITS)
+
+#if REFEREE_THREADS
+# if defined(_MSC_VER)
+#  include <intrin.h>
+#  include <windows.h>
+// (32-bit operands are only RefCounts with REFEREE_COMPACT_INFO)
+#  define REFEREE_ATOMIC_ADD32(p, v)   ((uint32_t)_InterlockedExchangeAdd((long volatile *)(p), (long)(v)))
+#  define REFEREE_ATOMIC_CAS32(p, e, d) ((uint32_t)_InterlockedCompareExchange((long volatile *)(p), (long)(d), (long)(e)) == (uint32_t)(e))
+#  ifdef _WIN64
+#   define REFEREE_ATOMIC_ADD(p, v)    (sizeof(*(p)) == 4 ? (size_t)REFEREE_ATOMIC_ADD32(p, v) : \
+                                        (size_t)_InterlockedExchangeAdd64((__int64 volatile *)(p), (__int64)(v)))
+#   define REFEREE_ATOMIC_CAS(p, e, d) (sizeof(*(p)) == 4 ? REFEREE_ATOMIC_CAS32(p, e, d) : \
+                                        (size_t)_InterlockedCompareExchange64((__int64 volatile *)(p), (__int64)(d), (__int64)(e)) == (size_t)(e))
+#  else
+#   define REFEREE_ATOMIC_ADD(p, v)    ((size_t)REFEREE_ATOMIC_ADD32(p, v))
+#   define REFEREE_ATOMIC_CAS(p, e, d) REFEREE_ATOMIC_CAS32(p, e, d)
+#  endif
+#  define REFEREE_ATOMIC_LOAD(p)       (sizeof(*(p)) == 4 ? (size_t)*(uint32_t volatile *)(p) : *(size_t volatile *)(p))
+#  define REFEREE_ATOMIC_STORE(p, v)   (_ReadWriteBarrier(), sizeof(*(p)) == 4 ? (void)(*(uint32_t volatile *)(p) = (uint32_t)(v)) \
+                                                                            : (void)(*(size_t volatile *)(p) = (size_t)(v)))
+#  define REFEREE_YIELD()              SwitchToThread()
+# else
+#  include <sched.h>
+#  define REFEREE_ATOMIC_ADD(p, v)     __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#  define REFEREE_ATOMIC_CAS(p, e, d)  __extension__({ __typeof__(*(p)) ref__e = (e); \
+                                        __atomic_compare_exchange_n((p), &ref__e, (d), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+#  define REFEREE_ATOMIC_LOAD(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#  define REFEREE_ATOMIC_STORE(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#  define REFEREE_YIELD()              sched_yield()
+# endif
+
+// Minimal reader/writer spinlock, valid when zero-initialized (so Referees can still be made with {0})
+// The top bit is held by a writer, the next by writers waiting (which stops new readers from
+// starving them out), and the rest count readers.
+# define REFEREE_LOCK_WRITER  ((size_t)1 << (8 * sizeof(size_t) - 1))
+# define REFEREE_LOCK_PENDING ((size_t)1 << (8 * sizeof(size_t) - 2))
+
+static void
+ref__read_lock(size_t *lock)
 {
-    return ((ref && ptr)
-            ? ref__map_ptr(&ref->ptr_infos, ptr)
-            : 0);
+    for (;;)
+    {
+        size_t state = REFEREE_ATOMIC_LOAD(lock);
+        if (! (state & (REFEREE_LOCK_WRITER | REFEREE_LOCK_PENDING)) &&
+            REFEREE_ATOMIC_CAS(lock, state, state + 1))
+        {   return;   }
+        REFEREE_YIELD();
+    }
 }
 
-REFEREE_API size_t
-ref_count(Referee *ref, void *ptr)
-{   
-    RefInfo *info = ref_info(ref, ptr);
-    return (info
-            ? info->refcount
-            : 0);
+static void
+ref__write_lock(size_t *lock)
+{
+    for (;;)
+    {
+        size_t state = REFEREE_ATOMIC_LOAD(lock);
+        if (! (state & ~REFEREE_LOCK_PENDING))
+        { // no readers or writer
+            if (REFEREE_ATOMIC_CAS(lock, state, REFEREE_LOCK_WRITER)) {   return;   }
+        }
+        else if (! (state & REFEREE_LOCK_PENDING))
+        {   REFEREE_ATOMIC_CAS(lock, state, state | REFEREE_LOCK_PENDING);   } // fine if this fails, try again next time round
+        REFEREE_YIELD();
+    }
 }
 
+# define REFEREE_LOCK(name)        size_t name;
+# if REFEREE_LOCKFREE // (an epoch read section, so a removed RefInfo isn't reused while it's being read)
+#  define REFEREE_READ_LOCK(lock)   map_lf_enter()
+#  define REFEREE_READ_UNLOCK(lock) map_lf_leave()
+# else
+#  define REFEREE_READ_LOCK(lock)   ref__read_lock(lock)
+#  define REFEREE_READ_UNLOCK(lock) REFEREE_ATOMIC_ADD((lock), REFEREE_INVALID) // i.e. -1
+# endif
+# define REFEREE_WRITE_LOCK(lock)   ref__write_lock(lock)
+# define REFEREE_WRITE_UNLOCK(lock) REFEREE_ATOMIC_STORE((lock), 0)
 
-REFEREE_API void *
-REF_DBG(ref_add_n, Referee *ref, void *ptr, size_t el_n, size_t el_size, size_t init_refs)
-{
-	if (! ref || ! ptr) { return 0; }
+#else //REFEREE_THREADS
+// single-threaded no-ops:
+# define REFEREE_ATOMIC_ADD(p, v)    ((*(p) += (v)) - (v))
+# define REFEREE_ATOMIC_CAS(p, e, d) (*(p) = (d), 1) // only ever used when *p is known to be e
+# define REFEREE_ATOMIC_LOAD(p)      (*(p))
+# define REFEREE_ATOMIC_STORE(p, v)  (*(p) = (v))
 
-	RefInfo info  = {0};
-	info.refcount = init_refs;
-	info.el_n     = el_n;
-	info.el_size  = el_size;
+# define REFEREE_LOCK(name)
+# define REFEREE_READ_LOCK(lock)
+# define REFEREE_READ_UNLOCK(lock)
+# define REFEREE_WRITE_LOCK(lock)
+# define REFEREE_WRITE_UNLOCK(lock)
+#endif//REFEREE_THREADS
 
-#if REFEREE_DEBUG
-    info.line = line;
-    info.file = file;
-    info.func = func;
-    info.call = call;
-#endif//REFEREE_DEBUG
+// for what isn't a shard's map (the handle table, the interior index): its memory moves as it grows,
+// so (unlike the shards) even REFEREE_LOCKFREE takes the read lock
+#if REFEREE_THREADS
+# define REFEREE_HANDLES_READ_LOCK(lock)   ref__read_lock(lock)
+# define REFEREE_HANDLES_READ_UNLOCK(lock) REFEREE_ATOMIC_ADD((lock), REFEREE_INVALID)
+#else
+# define REFEREE_HANDLES_READ_LOCK(lock)
+# define REFEREE_HANDLES_READ_UNLOCK(lock)
+#endif//REFEREE_THREADS
 
-	int insert_result = ref__map_insert(&ref->ptr_infos, ptr, info);
-	switch (insert_result)
-	{
-		default:          return 0;
-		case MAP_absent:  return ptr;
-		case MAP_present: return ref_inc_c(ref, ptr, init_refs);
-	}
-}
+#if ! REFEREE_THREADS
+# define REFEREE_THREAD_LOCAL
+#elif defined(_MSC_VER)
+# define REFEREE_THREAD_LOCAL __declspec(thread)
+#else
+# define REFEREE_THREAD_LOCAL __thread
+#endif
 
-REFEREE_API inline void *
-REF_DBG(ref_add, Referee *ref, void *ptr, size_t alloc_size, size_t init_refs)
-{   return ref_add_n_(ref, ptr, 1, alloc_size, init_refs);   }
+#if REFEREE_LOCKFREE
+# define REFEREE_DEAD ((RefCount)1 << (8 * sizeof(RefCount) - 1)) // refcount of a ptr that's being purged
+# define MAP_LOCKFREE
+#else
+# define REFEREE_DEAD 0 // never set
+#endif//REFEREE_LOCKFREE
+#endif // THREADING
 
-REFEREE_API inline void *
-ref_remove(Referee *ref, void *ptr)
-{   ref__map_remove(&ref->ptr_infos, ptr); return ptr;   }
+// REFEREE_HEADERS: ref_new/ref_realloc allocate a header in front of the memory they return, holding
+// its RefInfo, so that inc/dec/count find it by pointer arithmetic instead of a hash lookup.
+// ptrs given to ref_add are still kept in the map.
+// Every lookup checks for a tagged header first. That reads in front of ptr directly when the tag would
+// be on ptr's own page; otherwise (ptr near the start of a page) only if that page is known to hold a
+// live header's tag, as counted in a radix table shared by every Referee (its 32 KiB nodes are kept).
+// NOTE: so ptrs passed in need to point to mapped memory (as any tracked or freshly allocated one does).
+#ifndef  REFEREE_HEADERS
+# define REFEREE_HEADERS 0
+#endif
+// REFEREE_INTERIOR: ptrs are also indexed by the range of addresses they cover, so that
+// ref_info_containing/ref_inc_interior/ref_dec_interior can find a block from any address inside it.
+// Costs an extra (locked) index update each time a ptr is tracked or dropped.
+#ifndef  REFEREE_INTERIOR
+# define REFEREE_INTERIOR 0
+#endif
+// REFEREE_CYCLES: each dec that leaves a ptr's count above 0 also remembers the ptr (in a locked
+// set) as a possible root for ref_collect_cycles/ref_collect_cycles_step
+#ifndef  REFEREE_CYCLES
+# define REFEREE_CYCLES 0
+#endif
+// REFEREE_FINALIZERS: blocks can be given finalizers (see ref_set_finalizer). Which blocks have one is
+// kept in a separate (locked) map of ptr to type rather than in each RefInfo, and each ptr that's
+// purged or freed is looked up in it.
+#ifndef  REFEREE_FINALIZERS
+# define REFEREE_FINALIZERS 0
+#endif
+#ifndef  Referee_Finalizer_Types_N
+# define Referee_Finalizer_Types_N 255 // (types are stored in 16 bits)
+#endif
+// REFEREE_WEAK: ref_weak/ref_upgrade. A block with weak refs has a slot (with a generation, as handles
+// do) in a separate table, found through a (locked) map of ptr to slot that each dropped ptr is
+// looked up in.
+#ifndef  REFEREE_WEAK
+# define REFEREE_WEAK 0
+#endif
+// REFEREE_RECYCLE: blocks purged by ref_purge/ref_purge_step are kept (in a locked map of size to
+// blocks, up to Referee_Recycle_Bytes in all) instead of freed, and ref_new/ref_new_n take one of
+// exactly the size they'd allocate from there first. Pays off when the same sizes are purged and made
+// over and over. (Handle blocks aren't kept.) See ref_recycle_trim.
+#ifndef  REFEREE_RECYCLE
+# define REFEREE_RECYCLE 0
+#endif
+#ifndef  Referee_Recycle_Bytes
+# define Referee_Recycle_Bytes ((size_t)4 << 20)
+#endif
+// REFEREE_BUDGET: ref_set_budget. The zero lists are already oldest first, and an inc takes a ptr off
+// in O(1); each node is also stamped with a (global, atomic) tick as it's pushed, so that the oldest
+// across every shard can be found.
+#ifndef  REFEREE_BUDGET
+# define REFEREE_BUDGET 0
+#endif
+// REFEREE_SAMPLE: a cheap stand-in for REFEREE_DEBUG's callsites. ref_new/ref_add/ref_realloc etc.
+// take their callsite as with REFEREE_DEBUG, but only record it for about 1 in every
+// Referee_Sample_Bytes bytes that they start tracking. The bytes between samples are drawn (per thread) from an
+// exponential distribution, so a block of size bytes is sampled with a chance of
+// 1 - exp(-size / Referee_Sample_Bytes), and big blocks are represented in proportion to their size.
+// Each sampled ptr is kept in a (locked) side table, counting for 1/that chance ptrs and size/chance
+// bytes, which the callsite totals (ref_callsites) and ref_report's REF_REPORT_CALLSITE/FILE rows are
+// made of. A counting filter on ptr hashes keeps drops of unsampled ptrs from looking in the table;
+// drops only read its bitmap (a bit per count, 4KB by default), so that it stays cached.
+// Needs -lm (and with Referee_Sample_Frames_N, -rdynamic for symbols). Ignored with REFEREE_DEBUG.
+#ifndef  REFEREE_SAMPLE
+# define REFEREE_SAMPLE 0
+#endif
+#if REFEREE_SAMPLE && REFEREE_DEBUG
+# undef  REFEREE_SAMPLE
+# define REFEREE_SAMPLE 0
+#endif
+#ifndef  Referee_Sample_Bytes
+# define Referee_Sample_Bytes (512 * 1024) // mean bytes allocated per sample
+#endif
+#ifndef  Referee_Sample_Frames_N
+# define Referee_Sample_Frames_N 0 // return addresses kept per sample (backtrace/CaptureStackBackTrace)
+#endif
+#ifndef  Referee_Sample_Filter_Bits
+# define Referee_Sample_Filter_Bits 15
+#endif
+// REFEREE_DEFERRED: ref_inc/ref_dec (and the _c variants) only append the change to the calling
+// thread's log. Logs are coalesced (summing the changes per ptr) and applied in one pass at ref_purge
+// or at ref_flush, every log's incs before any log's decs (as a dec can be of a ref that an inc still
+// in another thread's log made). A log that fills up is applied on its own, except for decs that would
+// take a count below 0, which stay logged. ref_count/ref_info don't see changes still in a log.
+// Forgetting a ptr (free/remove/realloc/recount) first applies what every thread has logged for it.
+// With REFEREE_THREADS, every log is applied when a thread exits, and its log freed (so every Referee
+// it has changes logged for needs to outlive it, or be flushed first).
+#ifndef  REFEREE_DEFERRED
+# define REFEREE_DEFERRED 0
+#endif
+#ifndef  Referee_Log_N
+# define Referee_Log_N 1024 // distinct ptrs per log (a power of 2)
+#endif
 
+// that check deliberately reads in front of ptrs that don't have headers (within a mapped page, but
+// maybe inside another block's redzone)
+#if defined(__GNUC__) || defined(__clang__)
+# define REFEREE_NO_ASAN __attribute__((no_sanitize_address))
+#elif defined(_MSC_VER) && _MSC_VER >= 1927
+# define REFEREE_NO_ASAN __declspec(no_sanitize_address)
+#else
+# define REFEREE_NO_ASAN
+#endif
 
-REFEREE_API void *
-ref_default_realloc(void *allocator, void *ptr, size_t el_n, size_t el_size)
+#if REFEREE_COMPACT_INFO
+struct RefInfo {
+	RefCount refcount;
+	uint32_t zero_i;       // node in the zero list while refcount is 0, Referee_Zero_None otherwise
+	uint64_t size    : 48; // in bytes, i.e. el_n * el_size
+	uint64_t el_size : 16; // 0 if it doesn't fit
+};
+// (counts stop short of REFEREE_DEAD)
+# define Referee_Count_Sticky ((RefCount)~(RefCount)0 >> 1)
+# define Referee_Zero_None    ((uint32_t)REFEREE_INVALID)
+# define Referee_Zero_Max     ((size_t)Referee_Zero_None) // nodes a zero list can have, as zero_i indexes them
+
+# define MAP_INVALID_VAL { (RefCount)REFEREE_INVALID, (uint32_t)REFEREE_INVALID, 0, 0 }
+# if REFEREE_DEBUG
+#  define MAP_COLD uint32_t // callsite
+# endif
+#else
+struct RefInfo {
+	size_t refcount; // is size_t excessive?
+	size_t el_n;
+	size_t el_size;
+	size_t zero_i; // node in the zero list while refcount is 0, REFEREE_INVALID otherwise
+
+#if REFEREE_DEBUG
+	uint32_t callsite; // see CALLSITES
+#endif//REFEREE_DEBUG
+};
+# define Referee_Count_Sticky REFEREE_INVALID // (unreachable)
+# define Referee_Zero_None    REFEREE_INVALID
+# define Referee_Zero_Max     REFEREE_INVALID
+
+# define MAP_INVALID_VAL { REFEREE_INVALID, REFEREE_INVALID, REFEREE_INVALID, REFEREE_INVALID }
+#endif//REFEREE_COMPACT_INFO
+#define MAP_TYPES (RefereePtrInfoMap, ref__map, void *, RefInfo)
+#include "hash.h"
+
+// the callsite stored apart from its RefInfo with REFEREE_COMPACT_INFO, or 0 (unevaluated) otherwise
+#if REFEREE_DEBUG && REFEREE_COMPACT_INFO
+# define REFEREE_COLD(callsite) (callsite)
+#else
+# define REFEREE_COLD(callsite) ((uint32_t *)0)
+#endif
+
+// cold: as given by REFEREE_COLD
+static inline uint32_t
+ref__info_callsite(RefInfo const *info, uint32_t const *cold)
 {
-    (void)allocator;
-    return REFEREE_REALLOC(allocator, ptr, el_n, el_size);
+#if REFEREE_DEBUG && ! REFEREE_COMPACT_INFO
+    (void)cold;
+    return info->callsite;
+#else
+    (void)info;
+    return cold ? *cold : 0;
+#endif
 }
 
-REFEREE_API void
-ref_default_free(void *allocator, void *ptr)
+static inline size_t
+ref__info_size(RefInfo const *info)
 {
-    (void)allocator;
-    REFEREE_FREE(allocator, ptr);
+#if REFEREE_COMPACT_INFO
+    return (size_t)info->size;
+#else
+    return info->el_n * info->el_size;
+#endif
 }
 
-REFEREE_API void
-ref_set_default_allocator(Referee *ref)
+REFEREE_API inline size_t
+ref_info_el_size(RefInfo const *info)
 {
-    ref->realloc = ref_default_realloc;
-    ref->free    = ref_default_free;
+#if REFEREE_COMPACT_INFO
+    return info->el_size ? (size_t)info->el_size : (size_t)info->size;
+#else
+    return info->el_size;
+#endif
 }
 
-REFEREE_API inline void *
-REF_DBG(ref_new_n, Referee *ref, size_t el_n, size_t el_size, size_t init_refs)
+REFEREE_API inline size_t
+ref_info_el_n(RefInfo const *info)
 {
-	if (! ref->realloc || ! ref->free) { ref_set_default_allocator(ref); }
-    /* __itt_heap_allocate_begin(0, el_n * el_size, 0); */
-	void *ptr = ref->realloc(ref->allocator, 0, el_n, el_size);
-    /* __itt_heap_allocate_end(0, ptr, el_n * el_size, 0); */
-
-    return (ptr
-            ? ref_add_n_(ref, ptr, el_n, el_size, init_refs)
-            : ptr);
+#if REFEREE_COMPACT_INFO
+    return info->el_size ? (size_t)info->size / info->el_size : 1;
+#else
+    return info->el_n;
+#endif
 }
 
-// i.e. 1 block of the full size
-REFEREE_API inline void *
-REF_DBG(ref_new, Referee *ref, size_t size, size_t init_refs)
-{   return ref_new_n_(ref, 1, size, init_refs);   }
+static inline void
+ref__info_set_size(RefInfo *info, size_t el_n, size_t el_size)
+{
+#if REFEREE_COMPACT_INFO
+    info->size    = (uint64_t)(el_n * el_size);
+    info->el_size = el_size <= 0xffff ? (uint64_t)el_size : 0;
+#else
+    info->el_n    = el_n;
+    info->el_size = el_size;
+#endif
+}
 
+// for setting a count outright
+#define ref__count_clamp(count) ((count) < (size_t)Referee_Count_Sticky ? (RefCount)(count) : Referee_Count_Sticky)
 
-// TODO(api): this is to realloc as add is to new - make naming scheme consistent
-// doesn't perform the reallocation, just tracks that it has happened
-REFEREE_API inline void *
-REF_DBG(ref_register_realloc_n, Referee *ref, void *ptr, void *ptr_p, size_t el_n, size_t el_size, size_t init_refs)
+// adds c to info's count, returning the count before (with REFEREE_DEAD set if purge got there first)
+static inline size_t
+ref__count_add(RefInfo *info, size_t c)
 {
-    REFEREE_register_realloc(ptr, ptr_p, el_n, el_size, line, file, func, call);
-    if (ptr)
-    {
-        // TODO: incorporate init_refs for existing ptrs?
-        RefInfo info = ref__map_remove(&ref->ptr_infos, ptr_p);
-        ref_add_n_(ref, ptr, el_n, el_size, (~ info.refcount
-                                             ? info.refcount
-                                             : init_refs));
-    }
-    return ptr;
+#if REFEREE_COMPACT_INFO
+    RefCount old_count, new_count;
+    do {
+        old_count = (RefCount)REFEREE_ATOMIC_LOAD(&info->refcount);
+        if ((old_count & REFEREE_DEAD) || old_count == Referee_Count_Sticky) {   return old_count;   }
+        new_count = (c < (size_t)(Referee_Count_Sticky - old_count)
+                     ? (RefCount)(old_count + c)
+                     : Referee_Count_Sticky);
+    } while (! REFEREE_ATOMIC_CAS(&info->refcount, old_count, new_count));
+    return old_count;
+#else
+    return REFEREE_ATOMIC_ADD(&info->refcount, c);
+#endif
 }
 
-REFEREE_API inline void *
-REF_DBG(ref_realloc_n, Referee *ref, void *ptr, size_t el_n, size_t el_size, size_t init_refs)
+// takes c from info's count (stopping at 0), returning the count before and setting *new_out to after
+// is_whole: if the count is below c, leave it as it is instead
+static inline size_t
+ref__count_sub(RefInfo *info, size_t c, int is_whole, size_t *new_out)
 {
-	if (! ref->realloc || ! ref->free) { ref_set_default_allocator(ref); }
-    /* __itt_heap_reallocate_begin(0, ptr, el_n * el_size, 0); */
-    void *result = ref->realloc   (ref->allocator, ptr, el_n, el_size);
-    /* __itt_heap_reallocate_end(0, ptr, result, el_n * el_size, 0); */
-
-    ref_register_realloc_n_(ref, result, ptr, el_n, el_size, init_refs);
-    return result;
+    RefCount old_count, new_count;
+    do {
+        old_count = (RefCount)REFEREE_ATOMIC_LOAD(&info->refcount);
+        if ((old_count & REFEREE_DEAD) || old_count == Referee_Count_Sticky || (is_whole && old_count < c))
+        {   *new_out = old_count; return old_count;   }
+        new_count = (old_count >= c
+                     ? (RefCount)(old_count - c)
+                     : 0); // TODO (api): is this the right behaviour? should it cause error?
+    } while (! REFEREE_ATOMIC_CAS(&info->refcount, old_count, new_count));
+    *new_out = new_count;
+    return old_count;
 }
 
-REFEREE_API inline void *
-REF_DBG(ref_realloc, Referee *ref, void *ptr, size_t size, size_t init_refs)
-{   return ref_realloc_n_(ref, ptr, 1, size, init_refs);   }
+#if 1 // CALLSITES
+// With REFEREE_DEBUG, the callsites passed in by the ref_*_dbg macros are interned into one table
+// (shared by every Referee), and each tracked ptr only keeps the 32-bit id of its callsite.
+// Each callsite keeps running totals as its ptrs are tracked and dropped, which ref_callsites reads.
+// Ids start at 1; 0 is "unknown" (e.g. the table couldn't grow).
+// (With REFEREE_SAMPLE, only sampled ptrs' callsites are interned, with their estimated totals.)
+#ifndef  Referee_Callsite_Cache_N
+# define Referee_Callsite_Cache_N 64 // per thread, so that most interning doesn't take the lock (a power of 2)
+#endif
+#define Referee_Callsite_Page_Bits 8
+#define Referee_Callsite_Pages_N   256 // i.e. up to 65535 callsites
 
-REFEREE_API void *
-REF_DBG(ref_dup, Referee *ref, void *ptr, size_t init_refs)
-{
-	void    *result = 0;
-	RefInfo *info   = ref_info(ref, ptr);
+#if REFEREE_DEBUG || REFEREE_SAMPLE
+typedef struct RefCallsiteKey {
+	char const *file;
+	char const *call;
+	size_t      line;
+} RefCallsiteKey;
 
-	if (info)
-	{
-		result = ref_new_n_(ref, info->el_n, info->el_size, init_refs);
-		memcpy(result, ptr, info->el_n * info->el_size);
-	}
-	return result;
+static inline uint64_t
+ref__callsite_hash(RefCallsiteKey key)
+{
+	uint64_t hash = ((uint64_t)(uintptr_t)key.call ^ (uint64_t)(uintptr_t)key.file * 31 ^ key.line) * 0xff51afd7ed558ccd;
+	return hash ^ hash >> 32;
 }
+// (the strings are literals, so are compared by address)
+#define ref__callsite_key_eq(a, b) ((a).call == (b).call && (a).file == (b).file && (a).line == (b).line)
+
+#define MAP_TYPES (RefCallsiteMap, ref__callsite_map, RefCallsiteKey, uint32_t)
+#define MAP_HASH_KEY(key) ref__callsite_hash(key)
+#define MAP_KEY_EQ(a, b)  ref__callsite_key_eq(a, b)
+#include "hash.h"
 
+typedef struct RefCallsiteTable {
+	RefCallsiteMap ids;
+	RefCallsite   *pages[Referee_Callsite_Pages_N]; // never move, so that totals can be updated without the lock
+	uint32_t       n;
 
-REFEREE_API inline void *
-ref_inc_c(Referee *ref, void *ptr, size_t c)
-{
-	RefInfo *info = ref_info(ref, ptr);
-	if (info) {   info->refcount += c; return ptr;   }
-	else return 0;
-}
-REFEREE_API inline void *
-ref_inc(Referee *ref, void *ptr)
+	REFEREE_LOCK (lock)
+} RefCallsiteTable;
+static RefCallsiteTable ref__callsites;
+
+static inline RefCallsite *
+ref__callsite(uint32_t id)
 {
-	RefInfo *info = ref_info(ref, ptr);
-	if (info) {   ++info->refcount; return ptr;   }
-	else return 0;
+	return (id
+	        ? &ref__callsites.pages[id >> Referee_Callsite_Page_Bits][id & ((1 << Referee_Callsite_Page_Bits) - 1)]
+	        : 0);
 }
 
-REFEREE_API void *
-ref_dec_c(Referee *ref, void *ptr, size_t c)
+static uint32_t
+ref__callsite_intern(size_t line, char const *file, char const *func, char const *call)
 {
-	RefInfo *info = ref_info(ref, ptr);
-	if (info) {
-		if (info->refcount >= c) {   info->refcount -= c;   }
-		else                     {   info->refcount  = 0;   } // TODO (api): is this the right behaviour? should it cause error?
-		return ptr;
+	typedef struct RefCallsiteCached { RefCallsiteKey key; uint32_t id; } RefCallsiteCached;
+	static REFEREE_THREAD_LOCAL RefCallsiteCached cache[Referee_Callsite_Cache_N];
+
+	RefCallsiteKey     key    = { file, call, line };
+	RefCallsiteCached *cached = &cache[ref__callsite_hash(key) & (Referee_Callsite_Cache_N - 1)];
+	if (cached->id && ref__callsite_key_eq(cached->key, key)) {   return cached->id;   }
+
+	REFEREE_WRITE_LOCK(&ref__callsites.lock);
+	uint32_t id = ref__callsite_map_get(&ref__callsites.ids, key);
+	if (! id && ref__callsites.n + 1 < (Referee_Callsite_Pages_N << Referee_Callsite_Page_Bits))
+	{
+		id = ref__callsites.n + 1;
+		RefCallsite **page = &ref__callsites.pages[id >> Referee_Callsite_Page_Bits];
+		if (! *page) {   *page = (RefCallsite *)calloc(1 << Referee_Callsite_Page_Bits, sizeof(**page));   }
+		if (*page && ref__callsite_map_insert(&ref__callsites.ids, key, id) == MAP_absent)
+		{
+			RefCallsite *site = ref__callsite(id);
+			site->line = line;
+			site->file = file;
+			site->func = func;
+			site->call = call;
+			REFEREE_ATOMIC_STORE(&ref__callsites.n, id);
+		}
+		else {   id = 0;   }
 	}
-	else return 0;
+	REFEREE_WRITE_UNLOCK(&ref__callsites.lock);
+
+	if (id) {   cached->key = key; cached->id = id;   }
+	return id;
 }
-REFEREE_API void *
-ref_dec(Referee *ref, void *ptr)
+
+// n: ptrs that bytes are the size of (1, or more for a sample)
+// new_n: 0 if they're only moving (e.g. by ref_compact), so were untracked in between, otherwise n
+static void
+ref__callsite_track(uint32_t id, size_t n, size_t bytes, size_t new_n)
 {
-	RefInfo *info = ref_info(ref, ptr);
-	if (info) {
-		if (info->refcount > 0) {   --info->refcount;   }
-		return ptr;
-	}
-	else return 0;
+	RefCallsite *site = ref__callsite(id);
+	if (! site) {   return;   }
+	(void)REFEREE_ATOMIC_ADD(&site->live_n,  n);
+	(void)REFEREE_ATOMIC_ADD(&site->total_n, new_n);
+	size_t live_bytes = REFEREE_ATOMIC_ADD(&site->live_bytes, bytes) + bytes;
+	for (size_t peak = REFEREE_ATOMIC_LOAD(&site->peak_bytes);
+	     live_bytes > peak && ! REFEREE_ATOMIC_CAS(&site->peak_bytes, peak, live_bytes);
+	     peak = REFEREE_ATOMIC_LOAD(&site->peak_bytes)) {}
 }
 
-REFEREE_API void *
-ref_free(Referee *ref, void *ptr)
+static void
+ref__callsite_untrack(uint32_t id, size_t n, size_t bytes)
 {
-    RefInfo info = ref__map_remove(&ref->ptr_infos, ptr);
-    if (~ info.refcount)
-    {
-        assert(ref->free && "this should be set on initial allocation");
-        /* __itt_heap_free_begin(0, ptr); */
-        ref->free(ref->allocator, ptr);
-        /* __itt_heap_free_end(0, ptr); */
-    }
-    return 0;
+	RefCallsite *site = ref__callsite(id);
+	if (! site) {   return;   }
+	(void)REFEREE_ATOMIC_ADD(&site->live_n,     (size_t)0 - n);
+	(void)REFEREE_ATOMIC_ADD(&site->live_bytes, (size_t)0 - bytes);
 }
+#else
+static inline RefCallsite *ref__callsite(uint32_t id) {   (void)id; return 0;   }
+#endif//REFEREE_DEBUG || REFEREE_SAMPLE
 
-// clear all that have a refcount of 0
-REFEREE_API size_t 
-ref_purge(Referee *ref)
+REFEREE_API size_t
+ref_callsites(RefCallsite *callsites_out, size_t callsites_max)
 {
-	// TODO (opt): this should be sped up by keeping an array of the zero counts
-	size_t deleted_n = 0;
-	if(! ref) { return REFEREE_INVALID; }
-
-	for(size_t i = 0,
-			   n = ref->ptr_infos.n;
-		i < n; ++i)
+#if REFEREE_DEBUG || REFEREE_SAMPLE
+	size_t n = REFEREE_ATOMIC_LOAD(&ref__callsites.n);
+	for (size_t i = 0; i < n && i < callsites_max; ++i)
 	{
-		void *ptr = ref->ptr_infos.keys[i];
-		RefInfo *info = ref_info(ref, ptr);
-		if (info && info->refcount == 0)
-		{
-			++deleted_n;
-			ref__map_remove(&ref->ptr_infos, ptr);
-
-            if (ref->free) { ref->free(ref->allocator, ptr); }
-            else           { REFEREE_FREE(ref->allocator, ptr); }
-		}
+		RefCallsite const *site = ref__callsite((uint32_t)i + 1);
+		RefCallsite        copy = {0}; // (field by field, as the totals are updated without the lock)
+		copy.line       = site->line;
+		copy.file       = site->file;
+		copy.func       = site->func;
+		copy.call       = site->call;
+		copy.live_n     = REFEREE_ATOMIC_LOAD(&site->live_n);
+		copy.live_bytes = REFEREE_ATOMIC_LOAD(&site->live_bytes);
+		copy.peak_bytes = REFEREE_ATOMIC_LOAD(&site->peak_bytes);
+		copy.total_n    = REFEREE_ATOMIC_LOAD(&site->total_n);
+		callsites_out[i] = copy;
 	}
-	return deleted_n;
+	return n;
+#else
+	(void)callsites_out, (void)callsites_max;
+	return 0;
+#endif
 }
+#endif // CALLSITES
 
-REFEREE_API size_t
-ref_total_size(Referee *ref)
+// whether a zero-count info can be purged, called holding its shard's write lock
+// (purge can't exclude lock-free incs, so the count is swapped for REFEREE_DEAD, which they back off from)
+static inline int
+ref__claim_for_purge(RefInfo *info)
 {
-	size_t result = 0;
-	RefInfo const *vals = ref->ptr_infos.vals;
-	for(size_t i = 0,
-			   n = ref->ptr_infos.n;
-		i < n; ++i)
-    {   result += vals[i].el_n * vals[i].el_size;   }
-    return result;
+#if REFEREE_LOCKFREE
+    return REFEREE_ATOMIC_CAS(&info->refcount, 0, REFEREE_DEAD);
+#else
+    return info->refcount == 0;
+#endif
 }
 
+typedef struct RefHeader RefHeader;
+struct RefHeader {
+#if REFEREE_DEBUG && REFEREE_COMPACT_INFO
+    uint32_t   callsite;    // (first, so that the tag stays just in front of ptr)
+#endif
+    RefInfo    info;
+    RefHeader *prev, *next; // the shard's other header blocks, for walking everything tracked
+    uintptr_t  tag;         // ref__header_tag(shard, ptr) while ptr is tracked, 0 otherwise
+};
+// rounded up so that the ptr after the header keeps the allocator's alignment
+#define REFEREE_HEADER_SIZE  ((sizeof(RefHeader) + 15) & ~(size_t)15)
+#define Referee_Header_Magic ((uintptr_t)0x5ee1fab1e5a17ed5ull)
+
+// Intrusive doubly-linked list of the ptrs with a refcount of 0, so that purge only touches garbage.
+// Nodes live in a pool (linked by index rather than address) so that they survive the pool being
+// realloc'd, and unlinking never needs to look up any other ptr's RefInfo.
+// Ordered from the oldest zero at the head to the most recent at the tail.
+typedef struct RefZeroNode {
+    void  *ptr;
+    size_t prev, next;
+    size_t bytes;           // ptr's size, taken off the list's total when it's unlinked
+#if REFEREE_BUDGET
+    size_t tick;            // from ref__zero_ticks, as ptr's count reached 0
+#endif
+} RefZeroNode;
+
+typedef struct RefZeroList {
+    RefZeroNode *nodes;
+    size_t       max;       // nodes allocated
+    size_t       used;      // nodes handed out at some point (the rest are untouched)
+    size_t       unused;    // head of the free-node list
+    size_t       head, tail;
+    size_t       n;         // ptrs currently in the list
+    size_t       bytes;     // their total size (also read without the lock, by ref_stats)
+    int          lost;      // a node couldn't be allocated; the next purge has to do a full scan
+} RefZeroList;
 
-static inline int
-RefInfo_cmp_size(const void *a, const void *b)
+// Everything needed to track a subset of ptrs, selected by ref__shard
+typedef struct RefereeShard {
+	RefereePtrInfoMap ptr_infos;
+	RefZeroList       zeros;
+	RefHeader        *headers; // only used with REFEREE_HEADERS
+
+	REFEREE_LOCK (lock)
+} RefereeShard;
+
+// Slot index bits of a RefHandle; the rest hold the generation
+#ifndef  Referee_Handle_Index_Bits
+# define Referee_Handle_Index_Bits 22
+#endif
+#define Referee_Handle_Index_Mask (((uint32_t)1 << Referee_Handle_Index_Bits) - 1)
+#define Referee_Handle_Gen_Mask   (~(uint32_t)0 >> Referee_Handle_Index_Bits)
+
+typedef struct RefHandleSlot {
+	void    *ptr;       // 0 while the slot is free
+	RefInfo  info;      // (zero_i is the slot's node in the table's zero list)
+	uint32_t gen;       // of the handle to the current block, or the next one if free (0 once retired)
+	uint32_t next_free;
+} RefHandleSlot;
+
+// Dense table of handle blocks. Free slots are reused least-recently-freed first, so that each
+// slot's generation advances as slowly as possible, and the table only grows past the most blocks
+// ever live at once by the slots retired when their generation ran out.
+typedef struct RefHandles {
+	RefHandleSlot *slots;
+	uint32_t       max, used;
+	uint32_t       free_head, free_tail; // slot index + 1, so that a zero-initialized table has no free list
+	RefZeroList    zeros;     // node ptrs are slot indices
+#if REFEREE_DEBUG && REFEREE_COMPACT_INFO
+	uint32_t      *callsites; // in step with slots
+#endif
+
+	REFEREE_LOCK (lock)
+} RefHandles;
+
+#if 1 // INTERIOR
+// With REFEREE_INTERIOR, every ptr-tracked block is indexed by the address range it covers.
+// A block of size s goes in level L = ceil(log2(s)), filed under the 2^L-aligned grain that it starts in.
+// Blocks in one level are each over half a grain in size, so (if they don't overlap each other) no
+// grain has more than 2 of them starting in it, and a block with an address in grain g starts in g or
+// g-1. Finding the block an address is in is then 2 lookups per level in use, however many blocks
+// there are, and adding/removing a block is 1.
+#define Referee_Interior_Slots 2
+
+typedef struct RefInteriorBucket {
+	uintptr_t starts[Referee_Interior_Slots]; // 0 for an empty slot
+	uintptr_t ends  [Referee_Interior_Slots];
+} RefInteriorBucket;
+
+#if REFEREE_INTERIOR
+// key: level in the top byte, grain (address >> level) in the rest
+#define MAP_TYPES (RefInteriorMap, ref__interior_map, uint64_t, RefInteriorBucket)
+#include "hash.h"
+
+typedef struct RefInteriorIndex {
+	RefInteriorMap grains;
+	size_t         level_ns[64]; // blocks per level, so that empty levels are skipped
+	size_t         lost_n;       // blocks that overlapped others too much to be indexed (see ref_info_containing)
+
+	REFEREE_LOCK (lock)
+} RefInteriorIndex;
+
+static inline size_t
+ref__interior_level(size_t size)
 {
-    RefInfo ref_a = *(const RefInfo *)a,
-            ref_b = *(const RefInfo *)b;
-    size_t A = ref_a.el_n * ref_a.el_size,
-           B = ref_b.el_n * ref_b.el_size;
-    int result = (B < A) - (A < B);
-    return result;
+	size_t level = 0;
+	for (size_t n = size - 1; n; n >>= 1) {   ++level;   }
+	return level;
 }
 
-REFEREE_API void
-ref_dump_mem_usage(FILE *out, Referee *ref, int should_destructively_sort)
+static inline uint64_t
+ref__interior_key(size_t level, uintptr_t addr)
+{   return (uint64_t)level << 56 | (uint64_t)(addr >> level);   }
+
+// call holding the index's write lock
+static void
+ref__interior_add_locked(RefInteriorIndex *index, uintptr_t start, size_t size)
 {
-    fprintf(out, "Total memory tracked: %zu\n", ref_total_size(ref));
+	size_t             level  = ref__interior_level(size);
+	uint64_t           key    = ref__interior_key(level, start);
+	RefInteriorBucket *bucket = ref__interior_map_ptr(&index->grains, key);
+	if (! bucket)
+	{
+		RefInteriorBucket empty = {{0}};
+		if (ref__interior_map_insert(&index->grains, key, empty) != MAP_absent) {   ++index->lost_n; return;   }
+		bucket = ref__interior_map_ptr(&index->grains, key);
+	}
 
-    if (should_destructively_sort)
-    {   qsort(ref->ptr_infos.vals, ref->ptr_infos.n, sizeof(ref->ptr_infos.vals[0]), RefInfo_cmp_size);   }
+	int slot = 0;
+	while (slot < Referee_Interior_Slots && bucket->starts[slot]) {   ++slot;   }
+	if (slot == Referee_Interior_Slots) {   ++index->lost_n; return;   }
 
-    for(size_t i = 0,
-        n = ref->ptr_infos.n;
-        i < n; ++i)
+	bucket->starts[slot] = start;
+	bucket->ends  [slot] = start + size;
+	++index->level_ns[level];
+}
+
+// call holding the index's write lock
+// size: the block's size now, whose level it was filed in unless its size has been written through
+// ref_info since, so every other level in use is looked in before it's taken to be a lost block
+static void
+ref__interior_remove_locked(RefInteriorIndex *index, uintptr_t start, size_t size)
+{
+	size_t guess = ref__interior_level(size);
+	for (size_t l = 0; l <= 64; ++l)
+	{
+		size_t level = l ? l - 1 : guess;
+		if (l && (level == guess || ! index->level_ns[level])) {   continue;   }
+
+		uint64_t           key    = ref__interior_key(level, start);
+		RefInteriorBucket *bucket = ref__interior_map_ptr(&index->grains, key);
+		for (int i = 0; bucket && i < Referee_Interior_Slots; ++i)
+		{
+			if (bucket->starts[i] != start) {   continue;   }
+			bucket->starts[i] = 0;
+			if (! bucket->starts[0] && ! bucket->starts[1])
+			{   ref__interior_map_remove(&index->grains, key);   }
+			--index->level_ns[level];
+			return;
+		}
+	}
+	--index->lost_n; // (only lost blocks aren't in the index)
+}
+
+// returns the start of the indexed block that addr is in, or 0
+static uintptr_t
+ref__interior_find(RefInteriorIndex *index, uintptr_t addr)
+{
+	uintptr_t result = 0;
+	size_t    levels[64], levels_n = 0;
+	REFEREE_HANDLES_READ_LOCK(&index->lock);
+	for (size_t level = 0; level < 64; ++level)
+	{ // most populated first, as that's where addr most likely is
+		size_t n = index->level_ns[level], i = levels_n++;
+		for (; n && i && index->level_ns[levels[i - 1]] < n; --i) {   levels[i] = levels[i - 1];   }
+		if (n) {   levels[i] = level;   }
+		else   {   --levels_n;          }
+	}
+
+	for (size_t l = 0; l < levels_n && ! result; ++l)
+	{ // both grains that a block with addr in it could start in, looked up together so that their cache misses overlap
+		uint64_t           keys[2] = { ref__interior_key(levels[l], addr), ref__interior_key(levels[l], addr) - 1 };
+		RefInteriorBucket *buckets[2];
+		ref__interior_map_ptr_many(&index->grains, keys, 2, buckets); // (grain 0 - 1 wraps to a level that's never used)
+		for (int k = 0; k < 2 && ! result; ++k)
+		{
+			for (int i = 0; buckets[k] && i < Referee_Interior_Slots; ++i)
+			{
+				if (buckets[k]->starts[i] && buckets[k]->starts[i] <= addr && addr < buckets[k]->ends[i])
+				{   result = buckets[k]->starts[i]; break;   }
+			}
+		}
+	}
+	REFEREE_HANDLES_READ_UNLOCK(&index->lock);
+	return result;
+}
+#endif//REFEREE_INTERIOR
+#endif // INTERIOR
+
+#if REFEREE_CYCLES
+#define MAP_TYPES (RefCycleRootSet, ref__cycle_roots, void *, unsigned char)
+#include "hash.h"
+
+enum { Ref_Cycle_Black, Ref_Cycle_Gray, Ref_Cycle_White };
+typedef struct RefCycleNode {
+	int64_t   count; // scratch count (can go below 0 if a block's count was already short)
+	int       color;
+} RefCycleNode;
+#define MAP_TYPES (RefCycleNodeMap, ref__cycle_nodes, void *, RefCycleNode)
+#include "hash.h"
+
+// see ref_collect_cycles_step
+typedef struct RefCycles {
+	RefCycleRootSet roots; // possible roots of garbage cycles
+
+	// scratch for a step, kept between them (cleared) rather than reallocated each time
+	RefCycleNodeMap nodes; // every block reached
+	void          **stack;
+	size_t          stack_n, stack_max;
+
+	REFEREE_LOCK (lock)      // roots
+	REFEREE_LOCK (step_lock) // the scratch, so that only one step runs at a time
+} RefCycles;
+#endif//REFEREE_CYCLES
+
+#if REFEREE_FINALIZERS
+#define MAP_TYPES (RefFinalMap, ref__final_map, void *, uint16_t)
+#include "hash.h"
+
+typedef struct RefFinalType {
+	RefFinalizeFn *fn;
+	void          *user;
+} RefFinalType;
+
+// see ref_set_finalizer
+typedef struct RefFinalizers {
+	RefFinalMap  blocks;                               // ptr -> type, only for ptrs that have one
+	RefFinalType types[Referee_Finalizer_Types_N + 1]; // [0] is none
+	size_t       types_n;
+	size_t       run_n;                                // blocks finalized so far (so ref_purge can tell when to go again)
+	REFEREE_LOCK(lock)
+} RefFinalizers;
+#endif//REFEREE_FINALIZERS
+
+#if REFEREE_WEAK
+#define MAP_TYPES (RefWeakMap, ref__weak_map, void *, uint32_t)
+#include "hash.h"
+
+typedef struct RefWeakSlot {
+	void    *ptr;       // 0 while free
+	uint32_t gen;       // bumped as the slot is freed, so that its old weak refs go stale
+	uint32_t next_free; // slot index + 1
+} RefWeakSlot;
+
+// see ref_weak
+typedef struct RefWeaks {
+	RefWeakMap   of;        // ptr -> slot index + 1, for ptrs that have weak refs
+	RefWeakSlot *slots;
+	uint32_t     max, used;
+	uint32_t     free_head; // slot index + 1
+	REFEREE_LOCK(lock)      // taken after (never before) a shard's lock
+} RefWeaks;
+#endif//REFEREE_WEAK
+
+#if REFEREE_RECYCLE
+// a stack of kept blocks of one size, linked through their first bytes
+typedef struct RefRecycleBucket {
+	void  *head;
+	size_t n;
+} RefRecycleBucket;
+#define MAP_TYPES (RefRecycleMap, ref__recycle_map, size_t, RefRecycleBucket)
+#include "hash.h"
+
+// see REFEREE_RECYCLE
+typedef struct RefRecycle {
+	RefRecycleMap buckets; // allocation size -> blocks of that size (no empty buckets)
+	size_t        bytes;   // kept in all of them
+	size_t        hits_n, misses_n;
+	REFEREE_LOCK(lock)     // never held with any other
+} RefRecycle;
+#endif//REFEREE_RECYCLE
+
+#if REFEREE_SAMPLE
+# include <math.h>
+# if Referee_Sample_Frames_N && ! defined(_WIN32)
+#  include <execinfo.h>
+# elif Referee_Sample_Frames_N
+#  include <windows.h>
+# endif
+// see REFEREE_SAMPLE
+typedef struct RefSampled {
+	uint32_t callsite;
+	size_t   size;             // of the ptr (never 0)
+	size_t   est_n, est_bytes; // what it counts for
+# if Referee_Sample_Frames_N
+	void    *frames[Referee_Sample_Frames_N];
+	size_t   frames_n;
+# endif
+} RefSampled;
+#define MAP_TYPES (RefSampleMap, ref__sample_map, void *, RefSampled)
+#include "hash.h"
+
+// counts of sampled ptrs by hash; counts are only touched under the samples' lock, and each bit
+// (set while its count is nonzero) is what drops check
+typedef struct RefSampleFilter {
+	size_t   bits[((size_t)1 << Referee_Sample_Filter_Bits) / (8 * sizeof(size_t))];
+	uint32_t counts[(size_t)1 << Referee_Sample_Filter_Bits];
+} RefSampleFilter;
+
+typedef struct RefSamples {
+	RefSampleMap of;     // ptr -> its sample
+	size_t       filter; // RefSampleFilter *, allocated with the first sample
+	REFEREE_LOCK(lock)
+} RefSamples;
+#endif//REFEREE_SAMPLE
+
+#if REFEREE_RECLAIM
+# ifdef _WIN32
+#  include <windows.h>
+typedef HANDLE    RefReclaimThread;
+# else
+#  include <pthread.h>
+typedef pthread_t RefReclaimThread;
+# endif
+// see ref__reclaim_push
+typedef struct RefReclaim {
+	size_t           queue; // RefReclaimBatch * (newest first), pushed by purges, taken all at once by the thread
+	size_t           state; // Ref_Reclaim_Idle/Starting/Running
+	size_t           stop;  // set by ref_reclaim_flush to have the thread exit once the queue is empty
+	RefReclaimThread thread;
+	// what the thread blocks on while the queue is empty (made when it's started, only signalled while
+	// it's running, and released once it's been joined)
+# ifdef _WIN32
+	HANDLE           wake; // (auto-reset event)
+# else
+	pthread_mutex_t  wake_lock;
+	pthread_cond_t   wake;
+# endif
+	REFEREE_LOCK    (flush_lock) // read-locked to signal wake, write-locked to stop the thread
+} RefReclaim;
+#endif//REFEREE_RECLAIM
+
+#define Referee_Test_Len 8
+// the parts of RefStats that aren't kept by the zero lists
+typedef struct RefStatsCounters {
+	size_t live_bytes, live_n, peak_bytes, allocs_n, frees_n;
+} RefStatsCounters;
+
+struct Referee {
+	// Ordered so that this can be created with constants in any scope (including global)
+	// e.g. Referee ref = { my_allocator, my_alloc, my_free };
+	void *allocator;
+	void *(*realloc)(void *allocator, void *ptr, size_t el_n, size_t el_size); // must allocate if given NULL ptr as per realloc
+	void  (*free)   (void *allocator, void *ptr);
+
+	RefereeShard     shards[REFEREE_SHARD_N];
+	RefHandles       handles;
+	RefStatsCounters stats;
+	size_t           purge_at; // shard that ref_purge_step carries on from (REFEREE_SHARD_N for handles)
+#if REFEREE_INTERIOR
+	RefInteriorIndex interior;
+#endif
+#if REFEREE_CYCLES
+	RefCycles        cycles;
+#endif
+#if REFEREE_RECLAIM
+	RefReclaim       reclaim;
+#endif
+#if REFEREE_FINALIZERS
+	RefFinalizers    finals;
+#endif
+#if REFEREE_WEAK
+	RefWeaks         weaks;
+#endif
+#if REFEREE_RECYCLE
+	RefRecycle       recycle;
+#endif
+#if REFEREE_BUDGET
+	size_t           budget; // see ref_set_budget, 0 for none
+#endif
+#if REFEREE_SAMPLE
+	RefSamples       samples;
+#endif
+};
+
+static void ref__weak_drop(Referee *ref, void *ptr);
+static void ref__sample_drop(Referee *ref, void *ptr);
+#if REFEREE_SAMPLE
+static inline int ref__sample_due(size_t bytes);
+static void ref__sample_add(Referee *ref, void *ptr, size_t size, int line, char const *file, char const *func, char const *call);
+#endif
+static void ref__budget_make_room(Referee *ref, void *old_ptr, size_t new_bytes);
+
+// keeps ref's totals (and with REFEREE_DEBUG, the callsite's, and with REFEREE_INTERIOR, the index)
+// in step as a ptr starts being tracked
+// ptr: 0 if it's only reachable by handle
+// cold: as given by REFEREE_COLD
+// new_n: 0 if the ptr is only moving (e.g. by ref_compact), so was dropped with a dropped_n of 0
+static void
+ref__tracked(Referee *ref, void *ptr, RefInfo const *info, uint32_t const *cold, size_t new_n)
+{
+    size_t bytes      = ref__info_size(info),
+           live_bytes = REFEREE_ATOMIC_ADD(&ref->stats.live_bytes, bytes) + bytes;
+    (void)REFEREE_ATOMIC_ADD(&ref->stats.live_n,   1);
+    (void)REFEREE_ATOMIC_ADD(&ref->stats.allocs_n, new_n);
+    for (size_t peak = REFEREE_ATOMIC_LOAD(&ref->stats.peak_bytes);
+         live_bytes > peak && ! REFEREE_ATOMIC_CAS(&ref->stats.peak_bytes, peak, live_bytes);
+         peak = REFEREE_ATOMIC_LOAD(&ref->stats.peak_bytes)) {}
+#if REFEREE_DEBUG
+    ref__callsite_track(ref__info_callsite(info, cold), 1, bytes, new_n);
+#else
+    (void)cold;
+#endif
+#if REFEREE_INTERIOR
+    if (ptr && bytes)
+    {
+        REFEREE_WRITE_LOCK(&ref->interior.lock);
+        ref__interior_add_locked(&ref->interior, (uintptr_t)ptr, bytes);
+        REFEREE_WRITE_UNLOCK(&ref->interior.lock);
+    }
+#else
+    (void)ptr;
+#endif
+}
+
+// the inverse of ref__tracked, as a ptr stops being tracked (which with REFEREE_WEAK, unless it's only
+// moving, makes its weak refs stale, and with REFEREE_SAMPLE drops its sample)
+static void
+ref__dropped(Referee *ref, void *ptr, RefInfo const *info, uint32_t const *cold, size_t dropped_n)
+{
+    size_t bytes = ref__info_size(info);
+    (void)REFEREE_ATOMIC_ADD(&ref->stats.live_bytes, (size_t)0 - bytes);
+    (void)REFEREE_ATOMIC_ADD(&ref->stats.live_n,     REFEREE_INVALID); // i.e. -1
+    (void)REFEREE_ATOMIC_ADD(&ref->stats.frees_n,    dropped_n);
+#if REFEREE_DEBUG
+    ref__callsite_untrack(ref__info_callsite(info, cold), 1, bytes);
+#else
+    (void)cold;
+#endif
+#if REFEREE_INTERIOR
+    if (ptr && bytes)
+    {
+        REFEREE_WRITE_LOCK(&ref->interior.lock);
+        ref__interior_remove_locked(&ref->interior, (uintptr_t)ptr, bytes);
+        REFEREE_WRITE_UNLOCK(&ref->interior.lock);
+    }
+#endif
+    if (ptr && dropped_n) {   ref__weak_drop(ref, ptr); ref__sample_drop(ref, ptr);   }
+}
+
+// called after a dec leaves ptr's count at new_count
+static inline void
+ref__cycles_suspect(Referee *ref, void *ptr, size_t new_count)
+{
+#if REFEREE_CYCLES
+    if (! new_count || (new_count & REFEREE_DEAD)) {   return;   }
+    REFEREE_WRITE_LOCK(&ref->cycles.lock);
+    ref__cycle_roots_insert(&ref->cycles.roots, ptr, 1); // (no room just means one less root looked at)
+    REFEREE_WRITE_UNLOCK(&ref->cycles.lock);
+#else
+    (void)ref, (void)ptr, (void)new_count;
+#endif
+}
+
+// how many ptrs a shard is unlinked before its write lock is dropped and they're actually freed
+#define Referee_Purge_Batch 64
+
+#if 1 // FINALIZERS
+// runs the finalizers of those of ptrs that have one, a type at a time, and forgets their types
+// ptrs: no more than Referee_Purge_Batch, no longer tracked but not yet released
+static void
+ref__finalize(Referee *ref, void *const *ptrs, size_t ptrs_n)
+{
+#if REFEREE_FINALIZERS
+	RefFinalizers *finals = &ref->finals;
+	void          *found      [Referee_Purge_Batch];
+	uint16_t       found_types[Referee_Purge_Batch];
+	size_t         found_n = 0;
+	REFEREE_WRITE_LOCK(&finals->lock);
+	for (size_t i = 0; i < ptrs_n && finals->blocks.n; ++i)
+	{
+		uint16_t type = ref__final_map_remove(&finals->blocks, ptrs[i]); // (0 if it has none)
+		if (! type) {   continue;   }
+
+		size_t at = found_n++; // insertion sort, so that each type's ptrs end up side by side
+		for (; at && found_types[at - 1] > type; --at)
+		{   found[at] = found[at - 1], found_types[at] = found_types[at - 1];   }
+		found[at] = ptrs[i], found_types[at] = type;
+	}
+	REFEREE_WRITE_UNLOCK(&finals->lock);
+
+	for (size_t start = 0, end; start < found_n; start = end)
+	{
+		for (end = start + 1; end < found_n && found_types[end] == found_types[start]; ++end) {}
+		RefFinalType final = finals->types[found_types[start]]; // (never changes once given out)
+		final.fn(final.user, found + start, end - start);
+	}
+	if (found_n) {   (void)REFEREE_ATOMIC_ADD(&finals->run_n, found_n);   }
+#else
+	(void)ref, (void)ptrs, (void)ptrs_n;
+#endif
+}
+
+// keeps a ptr's finalizer with it when it moves (or forgets it, if new_ptr is 0)
+static void
+ref__finalizer_move(Referee *ref, void *old_ptr, void *new_ptr)
+{
+#if REFEREE_FINALIZERS
+	RefFinalizers *finals = &ref->finals;
+	REFEREE_WRITE_LOCK(&finals->lock);
+	if (finals->blocks.n && old_ptr != new_ptr)
+	{
+		uint16_t type = ref__final_map_remove(&finals->blocks, old_ptr);
+		if (type && new_ptr) {   ref__final_map_set(&finals->blocks, new_ptr, type);   }
+	}
+	REFEREE_WRITE_UNLOCK(&finals->lock);
+#else
+	(void)ref, (void)old_ptr, (void)new_ptr;
+#endif
+}
+
+// how many blocks have been finalized, so that a purge can tell whether any finalizers ran
+static size_t
+ref__finalized_n(Referee *ref)
+{
+#if REFEREE_FINALIZERS
+	return REFEREE_ATOMIC_LOAD(&ref->finals.run_n);
+#else
+	(void)ref;
+	return 0;
+#endif
+}
+#endif // FINALIZERS
+
+static inline RefereeShard *
+ref__shard(Referee *ref, void *ptr)
+{
+#if REFEREE_SHARD_BITS
+    // use the top bits of a different hash to the map's, so that ptrs in the same shard don't all
+    // share the low bits that the map probes with
+    uint64_t hash = (uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15;
+    return &ref->shards[hash >> (64 - REFEREE_SHARD_BITS)];
+#else
+    (void)ptr;
+    return &ref->shards[0];
+#endif
+}
+
+// includes the shard so that a ptr tracked by a different Referee isn't mistaken for one of ours
+static inline uintptr_t
+ref__header_tag(RefereeShard *shard, void *ptr)
+{   return (uintptr_t)ptr ^ (uintptr_t)shard ^ Referee_Header_Magic;   }
+
+#if REFEREE_HEADERS
+// Pages holding the tag of a tracked header that starts on an earlier page than its ptr: a 3-level
+// radix table of counts, indexed by the page number of a 48-bit address. Nodes are made as needed and
+// never freed, so lookups don't need a lock.
+#define Referee_Header_Page_Bits  12
+#define Referee_Header_Level_Bits 12
+#define Referee_Header_Level_Mask (((size_t)1 << Referee_Header_Level_Bits) - 1)
+static size_t ref__header_pages[(size_t)1 << Referee_Header_Level_Bits]; // size_t * to the next level
+
+// the counts for the pages around page, or 0 if there aren't any (and make is 0, or they can't be made)
+static size_t *
+ref__header_pages_leaf(uint64_t page, int make)
+{
+    size_t *level = ref__header_pages;
+    for (int shift = 2 * Referee_Header_Level_Bits; shift; shift -= Referee_Header_Level_Bits)
+    {
+        size_t *slot = &level[(page >> shift) & Referee_Header_Level_Mask];
+        size_t  next = REFEREE_ATOMIC_LOAD(slot);
+        if (! next && make)
+        {
+            size_t *made = (size_t *)calloc((size_t)1 << Referee_Header_Level_Bits, sizeof(*made));
+            if (! made) {   return 0;   }
+            if (REFEREE_ATOMIC_CAS(slot, 0, (size_t)made)) {   next = (size_t)made;                        }
+            else                                           {   free(made); next = REFEREE_ATOMIC_LOAD(slot);   } // (lost the race)
+        }
+        if (! next) {   return 0;   }
+        level = (size_t *)next;
+    }
+    return level;
+}
+
+// the page that the tag of a header in front of ptr would be on, if that's not ptr's own page
+// (0 if it is, as that's known to be mapped; REFEREE_INVALID beyond 48 bits)
+static inline uint64_t
+ref__header_page(void *ptr)
+{
+    uint64_t tag_addr = (uint64_t)((uintptr_t)ptr - REFEREE_HEADER_SIZE + offsetof(RefHeader, tag));
+    uint64_t page     = tag_addr >> Referee_Header_Page_Bits;
+    return (page == (uint64_t)(uintptr_t)ptr >> Referee_Header_Page_Bits ? 0                         :
+            tag_addr >> 48                                             ? (uint64_t)REFEREE_INVALID :
+                                                                         page);
+}
+
+// counts a header as live on its tag's page (delta 1) or no longer (REFEREE_INVALID), if that's not
+// ptr's own page
+// returns 0 if it can't be counted (only possible for 1)
+static int
+ref__header_pages_add(void *ptr, size_t delta)
+{
+    uint64_t page = ref__header_page(ptr);
+    if (! page) {   return 1;   }
+    size_t  *leaf = ~page ? ref__header_pages_leaf(page, delta == 1) : 0;
+    if (! leaf) {   return 0;   }
+    (void)REFEREE_ATOMIC_ADD(&leaf[page & Referee_Header_Level_Mask], delta);
+    return 1;
+}
+#endif//REFEREE_HEADERS
+
+// the header in front of ptr, if it was allocated by ref_new/ref_realloc
+static inline REFEREE_NO_ASAN RefHeader *
+ref__header(RefereeShard *shard, void *ptr)
+{
+#if REFEREE_HEADERS
+    if ((uintptr_t)ptr & (sizeof(uintptr_t) - 1)) {   return 0;   } // (header ptrs keep the allocator's alignment)
+    uint64_t page = ref__header_page(ptr);
+    if (page)
+    { // (may not be mapped)
+        size_t *leaf = ~page ? ref__header_pages_leaf(page, 0) : 0;
+        if (! leaf || ! REFEREE_ATOMIC_LOAD(&leaf[page & Referee_Header_Level_Mask])) {   return 0;   }
+    }
+    RefHeader *header = (RefHeader *)((char *)ptr - REFEREE_HEADER_SIZE);
+    return (header->tag == ref__header_tag(shard, ptr)
+            ? header
+            : 0);
+#else
+    (void)shard, (void)ptr;
+    return 0;
+#endif
+}
+
+// call holding at least the shard's read lock
+static inline RefInfo *
+ref__lookup(RefereeShard *shard, void *ptr)
+{
+    RefHeader *header = ref__header(shard, ptr);
+    return (header
+            ? &header->info
+            : ref__map_ptr(&shard->ptr_infos, ptr));
+}
+
+// NOTE: a zero-initialized list is not valid (0 is a valid index), so lists start out lazily
+// the first time they're pushed to (max == 0)
+#if REFEREE_BUDGET
+static size_t ref__zero_ticks; // (shared by every Referee, as it's only for ordering)
+#endif
+
+static size_t
+ref__zeros_push(RefZeroList *zeros, void *ptr, size_t bytes)
+{
+    if (! zeros->max)
+    {   zeros->head = zeros->tail = zeros->unused = REFEREE_INVALID;   }
+
+    size_t i = zeros->unused;
+    if (~i)
+    {   zeros->unused = zeros->nodes[i].next;   }
+    else
+    { // no free nodes, take one from the end of the pool
+        if (zeros->used == zeros->max)
+        { // (a node that zero_i couldn't hold the index of is as lost as one that couldn't be allocated)
+            size_t       new_max   = (! zeros->max                          ? 64
+                                      : zeros->max < Referee_Zero_Max / 2 ? 2 * zeros->max
+                                      :                                     Referee_Zero_Max);
+            RefZeroNode *new_nodes = (new_max > zeros->max
+                                      ? (RefZeroNode *)realloc(zeros->nodes, new_max * sizeof(*new_nodes))
+                                      : 0);
+            if (! new_nodes) {   zeros->lost = 1; return REFEREE_INVALID;   }
+            zeros->nodes = new_nodes;
+            zeros->max   = new_max;
+        }
+        i = zeros->used++;
+    }
+
+    RefZeroNode *node = &zeros->nodes[i];
+    node->ptr   = ptr;
+    node->prev  = zeros->tail;
+    node->next  = REFEREE_INVALID;
+    node->bytes = bytes;
+#if REFEREE_BUDGET
+    node->tick  = REFEREE_ATOMIC_ADD(&ref__zero_ticks, 1);
+#endif
+    if (~zeros->tail) {   zeros->nodes[zeros->tail].next = i;   }
+    else              {   zeros->head                    = i;   }
+    zeros->tail = i;
+    ++zeros->n;
+    REFEREE_ATOMIC_STORE(&zeros->bytes, zeros->bytes + bytes); // (only ever changed under the write lock)
+    return i;
+}
+
+static void
+ref__zeros_unlink(RefZeroList *zeros, size_t i)
+{
+    RefZeroNode *node = &zeros->nodes[i];
+    if (~node->prev) {   zeros->nodes[node->prev].next = node->next;   }
+    else             {   zeros->head                   = node->next;   }
+    if (~node->next) {   zeros->nodes[node->next].prev = node->prev;   }
+    else             {   zeros->tail                   = node->prev;   }
+
+    node->ptr     = 0;
+    node->next    = zeros->unused;
+    zeros->unused = i;
+    --zeros->n;
+    REFEREE_ATOMIC_STORE(&zeros->bytes, zeros->bytes - node->bytes);
+}
+
+// keep ptr's membership of the zero list in step with its refcount
+// call after every change to a refcount, holding the write lock of the shard that zeros belongs to
+static inline void
+ref__zeros_sync(RefZeroList *zeros, void *ptr, RefInfo *info)
+{
+    int is_zero = REFEREE_ATOMIC_LOAD(&info->refcount) == 0,
+        in_list = !! ~info->zero_i;
+    if      (is_zero && ! in_list) {   info->zero_i = ref__zeros_push(zeros, ptr, ref__info_size(info));   }
+    else if (! is_zero && in_list) {   ref__zeros_unlink(zeros, info->zero_i); info->zero_i = Referee_Zero_None;   }
+}
+
+// as ref__zeros_sync, but for when only the shard's read lock is held
+// releases the read lock
+static inline void
+ref__zeros_sync_read_locked(RefereeShard *shard, void *ptr, RefInfo *info)
+{
+#if REFEREE_THREADS
+    // the list can't be touched under a read lock; retake it as a writer and sync to whatever the
+    // count is by then, as it may have changed again in between
+    REFEREE_READ_UNLOCK(&shard->lock);
+    REFEREE_WRITE_LOCK(&shard->lock);
+    info = ref__lookup(shard, ptr);
+    if (info) {   ref__zeros_sync(&shard->zeros, ptr, info);   }
+    REFEREE_WRITE_UNLOCK(&shard->lock);
+#else
+    ref__zeros_sync(&shard->zeros, ptr, info);
+#endif
+}
+
+// stop tracking ptr, returning its last info (invalid if it wasn't tracked)
+// dropped_n: as ref__dropped
+// call holding the shard's write lock
+static RefInfo
+ref__forget_locked(Referee *ref, RefereeShard *shard, void *ptr, size_t dropped_n)
+{
+#if REFEREE_DEBUG && REFEREE_COMPACT_INFO
+    uint32_t const *cold     = ref__map_cold_ptr(&shard->ptr_infos, ptr);
+    uint32_t        callsite = cold ? *cold : 0; // (removing moves the cold array's last entry over it)
+#endif
+    RefInfo info = ref__map_remove(&shard->ptr_infos, ptr);
+    if (~info.zero_i) {   ref__zeros_unlink(&shard->zeros, info.zero_i);   }
+    if (info.refcount != (RefCount)REFEREE_INVALID)
+    {   ref__dropped(ref, ptr, &info, REFEREE_COLD(&callsite), dropped_n);   }
+    return info;
+}
+
+// as ref__forget_locked, for a ptr allocated with a header (which is left for the caller to free)
+static RefInfo
+ref__forget_header_locked(Referee *ref, RefereeShard *shard, RefHeader *header, size_t dropped_n)
+{
+    RefInfo info = header->info;
+    header->tag  = 0;
+#if REFEREE_HEADERS
+    ref__header_pages_add((char *)header + REFEREE_HEADER_SIZE, REFEREE_INVALID);
+#endif
+    if (header->prev) {   header->prev->next = header->next;   }
+    else              {   shard->headers     = header->next;   }
+    if (header->next) {   header->next->prev = header->prev;   }
+    if (~info.zero_i) {   ref__zeros_unlink(&shard->zeros, info.zero_i);   }
+    ref__dropped(ref, (char *)header + REFEREE_HEADER_SIZE, &info, REFEREE_COLD(&header->callsite), dropped_n);
+    return info;
+}
+
+// the inverse of ref__forget_header_locked: (re)starts tracking the ptr after header with info
+// returns 0 (leaving it untracked) if its page can't be counted
+static int
+ref__header_link_locked(RefereeShard *shard, RefHeader *header, RefInfo info)
+{
+    void *ptr    = (char *)header + REFEREE_HEADER_SIZE;
+#if REFEREE_HEADERS
+    if (! ref__header_pages_add(ptr, 1)) {   return 0;   }
+#endif
+    info.zero_i  = (REFEREE_ATOMIC_LOAD(&info.refcount) ? REFEREE_INVALID
+                                                        : ref__zeros_push(&shard->zeros, ptr, ref__info_size(&info)));
+    header->info = info;
+    header->prev = 0;
+    header->next = shard->headers;
+    if (shard->headers) {   shard->headers->prev = header;   }
+    shard->headers = header;
+    header->tag  = ref__header_tag(shard, ptr);
+    return 1;
+}
+
+// alloc_out: if given, ptrs with a header are forgotten too, and it's set to the start of the
+// allocation to free. Otherwise only the map is checked (e.g. when ptr may already be freed)
+static RefInfo
+ref__forget(Referee *ref, void *ptr, void **alloc_out)
+{
+    RefereeShard *shard = ref__shard(ref, ptr);
+    REFEREE_WRITE_LOCK(&shard->lock);
+    RefHeader *header = alloc_out ? ref__header(shard, ptr) : 0;
+    RefInfo    info   = (header
+                         ? ref__forget_header_locked(ref, shard, header, 1)
+                         : ref__forget_locked(ref, shard, ptr, 1));
+    REFEREE_WRITE_UNLOCK(&shard->lock);
+    if (alloc_out) {   *alloc_out = header ? (void *)header : ptr;   }
+    return info;
+}
+
+static void *ref__inc_c_now(Referee *ref, void *ptr, size_t c);
+static void *ref__defer(Referee *ref, void *ptr, size_t c, int is_inc);
+static void  ref__flush_ptr(Referee *ref, void *ptr);
+
+// NOTE: with REFEREE_THREADS, the info may be moved by any concurrent add/remove/purge on its shard,
+// so prefer the other functions over using this directly
+REFEREE_API RefInfo *
+ref_info(Referee *ref, void *ptr)
+{
+    if (! ref || ! ptr) { return 0; }
+
+    RefereeShard *shard = ref__shard(ref, ptr);
+    REFEREE_READ_LOCK(&shard->lock);
+    RefInfo *result = ref__lookup(shard, ptr);
+    REFEREE_READ_UNLOCK(&shard->lock);
+    return result;
+}
+
+REFEREE_API int
+ref_info_copy(Referee *ref, void *ptr, RefInfo *info_out)
+{
+    if (! ref || ! ptr || ! info_out) { return 0; }
+
+    RefereeShard *shard = ref__shard(ref, ptr);
+    REFEREE_READ_LOCK(&shard->lock);
+    RefInfo *info  = ref__lookup(shard, ptr);
+    int      found = 0;
+    if (info)
+    {
+        RefInfo copy  = {0}; // (field by field, as refcount is changed under the read lock)
+        copy.refcount = REFEREE_ATOMIC_LOAD(&info->refcount);
+        copy.zero_i   = info->zero_i;
+#if REFEREE_COMPACT_INFO
+        copy.size     = info->size;
+        copy.el_size  = info->el_size;
+#else
+        copy.el_n     = info->el_n;
+        copy.el_size  = info->el_size;
+# if REFEREE_DEBUG
+        copy.callsite = info->callsite;
+# endif
+#endif//REFEREE_COMPACT_INFO
+        if (! (copy.refcount & REFEREE_DEAD)) {   *info_out = copy; found = 1;   }
+    }
+    REFEREE_READ_UNLOCK(&shard->lock);
+    return found;
+}
+
+REFEREE_API size_t
+ref_count(Referee *ref, void *ptr)
+{   
+    if (! ref || ! ptr) { return 0; }
+
+    RefereeShard *shard = ref__shard(ref, ptr);
+    REFEREE_READ_LOCK(&shard->lock);
+    RefInfo *info   = ref__lookup(shard, ptr);
+    size_t   result = (info
+                       ? REFEREE_ATOMIC_LOAD(&info->refcount)
+                       : 0);
+    if (result & REFEREE_DEAD) { result = 0; }
+    REFEREE_READ_UNLOCK(&shard->lock);
+    return result;
+}
+
+
+REFEREE_API void *
+REF_DBG(ref_add_n, Referee *ref, void *ptr, size_t el_n, size_t el_size, size_t init_refs)
+{
+	if (! ref || ! ptr) { return 0; }
+
+	RefereeShard *shard = ref__shard(ref, ptr);
+	if (ref__header(shard, ptr)) {   return ref__inc_c_now(ref, ptr, init_refs);   }
+	REFEREE_WRITE_LOCK(&shard->lock);
+
+	RefInfo info  = {0};
+	info.refcount = ref__count_clamp(init_refs);
+	ref__info_set_size(&info, el_n, el_size);
+	// pushed before inserting so that the new entry doesn't need looking up again
+	info.zero_i   = (init_refs ? REFEREE_INVALID
+	                           : ref__zeros_push(&shard->zeros, ptr, ref__info_size(&info)));
+
+#if REFEREE_DEBUG
+	uint32_t callsite = ref__callsite_intern((size_t)line, file, func, call);
+# if ! REFEREE_COMPACT_INFO
+	info.callsite = callsite;
+# endif
+#endif//REFEREE_DEBUG
+
+	int insert_result = ref__map_insert(&shard->ptr_infos, ptr, info);
+	if (insert_result != MAP_absent && ~info.zero_i)
+	{   ref__zeros_unlink(&shard->zeros, info.zero_i);   }
+	if (insert_result == MAP_absent)
+	{
+#if REFEREE_DEBUG && REFEREE_COMPACT_INFO
+		*ref__map_cold_ptr(&shard->ptr_infos, ptr) = callsite;
+#endif
+		ref__tracked(ref, ptr, &info, REFEREE_COLD(&callsite), 1);
+	}
+	REFEREE_WRITE_UNLOCK(&shard->lock);
+#if REFEREE_SAMPLE
+	if (insert_result == MAP_absent && ref__sample_due(el_n * el_size))
+	{   ref__sample_add(ref, ptr, el_n * el_size, line, file, func, call);   }
+#endif
+
+	switch (insert_result)
+	{
+		default:          return 0;
+		case MAP_absent:  return ptr;
+		case MAP_present: return ref__inc_c_now(ref, ptr, init_refs);
+	}
+}
+
+REFEREE_API inline void *
+REF_DBG(ref_add, Referee *ref, void *ptr, size_t alloc_size, size_t init_refs)
+{   return ref_add_n_(ref, ptr, 1, alloc_size, init_refs);   }
+
+REFEREE_API inline void *
+ref_remove(Referee *ref, void *ptr)
+{
+    if (! ref || ! ptr)                         {   return 0;   }
+    if (ref__header(ref__shard(ref, ptr), ptr)) {   return 0;   }
+    ref__flush_ptr(ref, ptr); ref__forget(ref, ptr, 0); ref__finalizer_move(ref, ptr, 0); return ptr;
+}
+
+
+REFEREE_API void *
+ref_default_realloc(void *allocator, void *ptr, size_t el_n, size_t el_size)
+{
+    (void)allocator;
+    return REFEREE_REALLOC(allocator, ptr, el_n, el_size);
+}
+
+REFEREE_API void
+ref_default_free(void *allocator, void *ptr)
+{
+    (void)allocator;
+    REFEREE_FREE(allocator, ptr);
+}
+
+REFEREE_API void
+ref_set_default_allocator(Referee *ref)
+{
+    ref->realloc = ref_default_realloc;
+    ref->free    = ref_default_free;
+}
+
+// starts tracking the memory after the header at base
+// returns 0 (having freed base) if it can't be tracked
+static void *
+REF_DBG(ref__header_add, Referee *ref, void *base, size_t el_n, size_t el_size, size_t init_refs)
+{
+    void         *ptr    = (char *)base + REFEREE_HEADER_SIZE;
+    RefereeShard *shard  = ref__shard(ref, ptr);
+    RefHeader    *header = (RefHeader *)base;
+
+    RefInfo info  = {0};
+    info.refcount = ref__count_clamp(init_refs);
+    ref__info_set_size(&info, el_n, el_size);
+#if REFEREE_DEBUG && ! REFEREE_COMPACT_INFO
+    info.callsite = ref__callsite_intern((size_t)line, file, func, call);
+#elif REFEREE_DEBUG
+    header->callsite = ref__callsite_intern((size_t)line, file, func, call);
+#endif//REFEREE_DEBUG
+
+    REFEREE_WRITE_LOCK(&shard->lock);
+    int linked = ref__header_link_locked(shard, header, info);
+    if (linked) {   ref__tracked(ref, ptr, &info, REFEREE_COLD(&header->callsite), 1);   }
+    REFEREE_WRITE_UNLOCK(&shard->lock);
+    if (! linked) {   ref->free(ref->allocator, base); return 0;   }
+#if REFEREE_SAMPLE
+    if (ref__sample_due(el_n * el_size)) {   ref__sample_add(ref, ptr, el_n * el_size, line, file, func, call);   }
+#endif
+    return ptr;
+}
+
+#if 1 // ARENA
+#ifndef  Referee_Arena_Chunk_Size
+# define Referee_Arena_Chunk_Size (64 * 1024)
+#endif
+
+typedef struct RefArenaChunk RefArenaChunk;
+struct RefArenaChunk {
+    RefArenaChunk *prev, *next;
+    size_t         cap, used; // bytes of data
+    size_t         live_n;    // blocks not yet freed
+    size_t         _pad;      // keeps data 16-byte aligned
+};
+
+// in front of every block, so that freeing and reallocating don't need to search for the chunk
+typedef struct RefArenaBlock {
+    RefArenaChunk *chunk;
+    size_t         size;
+} RefArenaBlock;
+
+struct RefArena {
+    size_t         chunk_size; // defaults to Referee_Arena_Chunk_Size if 0
+    RefArenaChunk *chunks;     // the first is the one currently being bumped
+    RefArenaChunk *spare;      // an empty chunk kept back to avoid a malloc/free each time one empties
+    size_t         chunks_n;
+
+    REFEREE_LOCK (lock)
+};
+
+#define ref__arena_round(size) (((size) + 15) & ~(size_t)15)
+
+static inline void
+ref__arena_unlink(RefArena *arena, RefArenaChunk *chunk)
+{
+    if (chunk->prev) {   chunk->prev->next = chunk->next;   }
+    else             {   arena->chunks     = chunk->next;   }
+    if (chunk->next) {   chunk->next->prev = chunk->prev;   }
+    --arena->chunks_n;
+}
+
+// call holding the arena's lock
+static void *
+ref__arena_alloc_locked(RefArena *arena, size_t size)
+{
+    size_t         need  = sizeof(RefArenaBlock) + ref__arena_round(size);
+    RefArenaChunk *chunk = arena->chunks;
+    if (! chunk || chunk->cap - chunk->used < need)
+    {
+        size_t chunk_size = arena->chunk_size ? arena->chunk_size : Referee_Arena_Chunk_Size;
+        if (need > chunk_size / 4)
+        {   chunk_size = need;   } // too big to share a chunk without wasting most of it
+
+        if (arena->spare && arena->spare->cap >= chunk_size)
+        {   chunk = arena->spare, arena->spare = 0;   }
+        else
+        {
+            chunk = (RefArenaChunk *)malloc(sizeof(RefArenaChunk) + chunk_size);
+            if (! chunk) {   return 0;   }
+            chunk->cap = chunk_size;
+        }
+        chunk->used = chunk->live_n = 0;
+
+        chunk->prev = 0;
+        if (need == chunk_size && arena->chunks)
+        { // oversized: keep bumping the current chunk rather than this one
+            chunk->next = arena->chunks->next;
+            chunk->prev = arena->chunks;
+            if (chunk->next) {   chunk->next->prev = chunk;   }
+            arena->chunks->next = chunk;
+        }
+        else
+        {
+            chunk->next = arena->chunks;
+            if (arena->chunks) {   arena->chunks->prev = chunk;   }
+            arena->chunks = chunk;
+        }
+        ++arena->chunks_n;
+    }
+
+    RefArenaBlock *block = (RefArenaBlock *)((char *)(chunk + 1) + chunk->used);
+    block->chunk = chunk;
+    block->size  = size;
+    chunk->used += need;
+    ++chunk->live_n;
+    return block + 1;
+}
+
+// call holding the arena's lock
+static void
+ref__arena_free_locked(RefArena *arena, void *ptr)
+{
+    RefArenaChunk *chunk = ((RefArenaBlock *)ptr - 1)->chunk;
+    if (--chunk->live_n) {   return;   }
+
+    if (chunk == arena->chunks)
+    {   chunk->used = 0;   } // still the one being bumped, so just rewind it
+    else
+    {
+        ref__arena_unlink(arena, chunk);
+        if (! arena->spare)                   {   arena->spare = chunk;               }
+        else if (arena->spare->cap < chunk->cap) {   free(arena->spare); arena->spare = chunk;   }
+        else                                  {   free(chunk);                        }
+    }
+}
+
+REFEREE_API void *
+ref_arena_realloc(void *allocator, void *ptr, size_t el_n, size_t el_size)
+{
+    RefArena *arena  = (RefArena *)allocator;
+    size_t    size   = el_n * el_size;
+    void     *result = 0;
+    REFEREE_WRITE_LOCK(&arena->lock);
+    if (! ptr)
+    {   result = ref__arena_alloc_locked(arena, size);   }
+    else
+    {
+        RefArenaBlock *block = (RefArenaBlock *)ptr - 1;
+        RefArenaChunk *chunk = block->chunk;
+        size_t         end   = (size_t)((char *)ptr - (char *)(chunk + 1)) + ref__arena_round(block->size);
+        if (end == chunk->used && end - ref__arena_round(block->size) + ref__arena_round(size) <= chunk->cap)
+        { // last block in its chunk: grow/shrink in place
+            chunk->used = end - ref__arena_round(block->size) + ref__arena_round(size);
+            block->size = size;
+            result      = ptr;
+        }
+        else if (size <= block->size)
+        {   block->size = size, result = ptr;   }
+        else if ((result = ref__arena_alloc_locked(arena, size)))
+        {
+            memcpy(result, ptr, block->size);
+            ref__arena_free_locked(arena, ptr);
+        }
+    }
+    REFEREE_WRITE_UNLOCK(&arena->lock);
+    return result;
+}
+
+REFEREE_API void
+ref_arena_free(void *allocator, void *ptr)
+{
+    if (! ptr) {   return;   }
+    RefArena *arena = (RefArena *)allocator;
+    REFEREE_WRITE_LOCK(&arena->lock);
+    ref__arena_free_locked(arena, ptr);
+    REFEREE_WRITE_UNLOCK(&arena->lock);
+}
+
+REFEREE_API void
+ref_arena_reset(RefArena *arena)
+{
+    REFEREE_WRITE_LOCK(&arena->lock);
+    RefArenaChunk *keep = arena->chunks;
+    if (keep)
+    {
+        for (RefArenaChunk *chunk = keep->next, *next; chunk; chunk = next)
+        {   next = chunk->next; free(chunk);   }
+        keep->prev = keep->next = 0;
+        keep->used = keep->live_n = 0;
+        arena->chunks_n = 1;
+    }
+    REFEREE_WRITE_UNLOCK(&arena->lock);
+}
+
+REFEREE_API void
+ref_arena_release(RefArena *arena)
+{
+    ref_arena_reset(arena);
+    free(arena->chunks);
+    free(arena->spare);
+    arena->chunks   = arena->spare = 0;
+    arena->chunks_n = 0;
+}
+#endif // ARENA
+
+#if 1 // SLABS
+// the classes can be tuned with the occupancies reported by ref_slabs_stats
+// (multiples of 16, ascending, ending with Referee_Slab_Max_Size)
+#ifndef  Referee_Slab_Class_Sizes
+# define Referee_Slab_Class_Sizes 16, 32, 48, 64, 96, 128, 192, 256
+# define Referee_Slab_Max_Size    256
+#endif
+#ifndef  Referee_Slab_Max_Size
+# error Referee_Slab_Max_Size must be defined along with Referee_Slab_Class_Sizes
+#endif
+#ifndef  Referee_Slab_Bits
+# define Referee_Slab_Bits 16
+#endif
+#define Referee_Slab_Size ((size_t)1 << Referee_Slab_Bits)
+
+static size_t const Referee_Slab_Sizes[] = { Referee_Slab_Class_Sizes };
+#define Referee_Slab_Classes_N (sizeof(Referee_Slab_Sizes) / sizeof(Referee_Slab_Sizes[0]))
+
+#ifdef _WIN32
+# include <malloc.h>
+# define ref__aligned_alloc(align, size) _aligned_malloc((size), (align))
+# define ref__aligned_free(ptr)          _aligned_free(ptr)
+#else
+static inline void *
+ref__aligned_alloc(size_t align, size_t size)
+{   void *result = 0; return posix_memalign(&result, align, size) ? 0 : result;   }
+# define ref__aligned_free(ptr)          free(ptr)
+#endif
+
+// slab base -> size class, to tell small blocks (and their class) from large ones on free
+#define MAP_INVALID_VAL REFEREE_INVALID
+#define MAP_TYPES (RefSlabMap, ref__slab_map, void *, size_t)
+#include "hash.h"
+
+typedef struct RefSlabClass {
+    void   *free;            // singly-linked through the blocks themselves
+    char   *bump, *bump_end; // untouched blocks in the newest slab
+    size_t  slabs_n, live_n;
+} RefSlabClass;
+
+struct RefSlabs {
+    RefSlabClass classes[Referee_Slab_Classes_N];
+    RefSlabMap   slabs;
+    size_t       large_n;
+    unsigned char size_class[Referee_Slab_Max_Size / 16 + 1]; // (size + 15) / 16 -> class + 1, 0 until first used
+
+    REFEREE_LOCK (lock)
+};
+
+static inline size_t
+ref__slab_class(RefSlabs *slabs, size_t size)
+{
+    if (! slabs->size_class[0])
+    {
+        for (size_t i = 0, class_i = 0; i <= Referee_Slab_Max_Size / 16; ++i)
+        {
+            while (Referee_Slab_Sizes[class_i] < 16 * i) {   ++class_i;   }
+            slabs->size_class[i] = (unsigned char)(class_i + 1);
+        }
+    }
+    return (size_t)slabs->size_class[(size + 15) / 16] - 1;
+}
+
+// call holding the slabs' lock
+static void *
+ref__slab_alloc_locked(RefSlabs *slabs, size_t class_i)
+{
+    RefSlabClass *cls  = &slabs->classes[class_i];
+    size_t        size = Referee_Slab_Sizes[class_i];
+    void         *result;
+    if (cls->free)
+    {
+        result    = cls->free;
+        cls->free = *(void **)result;
+    }
+    else
+    {
+        if (cls->bump + size > cls->bump_end)
+        {
+            char *slab = (char *)ref__aligned_alloc(Referee_Slab_Size, Referee_Slab_Size);
+            if (! slab) {   return 0;   }
+            if (ref__slab_map_insert(&slabs->slabs, slab, class_i) == MAP_error)
+            {   ref__aligned_free(slab); return 0;   }
+            cls->bump     = slab;
+            cls->bump_end = slab + Referee_Slab_Size;
+            ++cls->slabs_n;
+        }
+        result     = cls->bump;
+        cls->bump += size;
+    }
+    ++cls->live_n;
+    return result;
+}
+
+// the class ptr was allocated from, or REFEREE_INVALID if it's a large block
+static inline size_t
+ref__slab_class_of(RefSlabs *slabs, void *ptr)
+{
+    void *slab = (void *)((uintptr_t)ptr & ~(uintptr_t)(Referee_Slab_Size - 1));
+    return ref__slab_map_get(&slabs->slabs, slab);
+}
+
+REFEREE_API void *
+ref_slabs_realloc(void *allocator, void *ptr, size_t el_n, size_t el_size)
+{
+    RefSlabs *slabs  = (RefSlabs *)allocator;
+    size_t    size   = el_n * el_size;
+    void     *result = 0;
+    REFEREE_WRITE_LOCK(&slabs->lock);
+    size_t old_class = ptr ? ref__slab_class_of(slabs, ptr) : REFEREE_INVALID;
+    size_t new_class = (size <= Referee_Slab_Max_Size
+                        ? ref__slab_class(slabs, size)
+                        : REFEREE_INVALID);
+
+    if (ptr && ! ~old_class)
+    { // large blocks stay large, so that their old size doesn't need to be known
+        result = REFEREE_REALLOC(slabs, ptr, 1, size);
+    }
+    else if (ptr && new_class <= old_class)
+    {   result = ptr;   } // fits in its current block
+    else
+    {
+        result = (~new_class
+                  ? ref__slab_alloc_locked(slabs, new_class)
+                  : REFEREE_REALLOC(slabs, 0, 1, size));
+        if (result && ! ~new_class) {   ++slabs->large_n;   }
+        if (result && ptr)
+        {
+            memcpy(result, ptr, Referee_Slab_Sizes[old_class]);
+            RefSlabClass *cls = &slabs->classes[old_class];
+            *(void **)ptr = cls->free;
+            cls->free     = ptr;
+            --cls->live_n;
+        }
+    }
+    REFEREE_WRITE_UNLOCK(&slabs->lock);
+    return result;
+}
+
+REFEREE_API void
+ref_slabs_free(void *allocator, void *ptr)
+{
+    if (! ptr) {   return;   }
+    RefSlabs *slabs = (RefSlabs *)allocator;
+    REFEREE_WRITE_LOCK(&slabs->lock);
+    size_t class_i = ref__slab_class_of(slabs, ptr);
+    if (~class_i)
+    {
+        RefSlabClass *cls = &slabs->classes[class_i];
+        *(void **)ptr = cls->free;
+        cls->free     = ptr;
+        --cls->live_n;
+    }
+    else
+    {
+        REFEREE_FREE(slabs, ptr);
+        --slabs->large_n;
+    }
+    REFEREE_WRITE_UNLOCK(&slabs->lock);
+}
+
+REFEREE_API void
+ref_slabs_release(RefSlabs *slabs)
+{
+    REFEREE_WRITE_LOCK(&slabs->lock);
+    for (size_t i = 0; i < slabs->slabs.n; ++i)
+    {
+        void *slab = 0;
+        if (ref__slab_map_at(&slabs->slabs, i, &slab)) {   ref__aligned_free(slab);   }
+    }
+    ref__slab_map_clear(&slabs->slabs);
+    memset(slabs->classes, 0, sizeof(slabs->classes));
+    REFEREE_WRITE_UNLOCK(&slabs->lock);
+}
+
+REFEREE_API size_t
+ref_slabs_stats(RefSlabs *slabs, RefSlabStats *stats_out, size_t stats_max)
+{
+    REFEREE_WRITE_LOCK(&slabs->lock);
+    for (size_t i = 0; i < Referee_Slab_Classes_N && i < stats_max; ++i)
+    {
+        RefSlabClass *cls   = &slabs->classes[i];
+        RefSlabStats  stats = {0};
+        stats.size       = Referee_Slab_Sizes[i];
+        stats.slabs_n    = cls->slabs_n;
+        stats.live_n     = cls->live_n;
+        stats.capacity_n = cls->slabs_n * (Referee_Slab_Size / stats.size);
+        stats_out[i]     = stats;
+    }
+    if (Referee_Slab_Classes_N < stats_max)
+    {
+        RefSlabStats stats = {0};
+        stats.live_n = slabs->large_n;
+        stats_out[Referee_Slab_Classes_N] = stats;
+    }
+    REFEREE_WRITE_UNLOCK(&slabs->lock);
+    return Referee_Slab_Classes_N + 1;
+}
+
+REFEREE_API void
+ref_slabs_dump(FILE *out, RefSlabs *slabs)
+{
+    RefSlabStats stats[Referee_Slab_Classes_N + 1];
+    size_t       stats_n = ref_slabs_stats(slabs, stats, Referee_Slab_Classes_N + 1);
+    fprintf(out, "%8s %8s %10s %10s %9s\n", "size", "slabs", "live", "capacity", "occupancy");
+    for (size_t i = 0; i + 1 < stats_n; ++i)
+    {
+        fprintf(out, "%8zu %8zu %10zu %10zu %8.1f%%\n", stats[i].size, stats[i].slabs_n,
+                stats[i].live_n, stats[i].capacity_n,
+                stats[i].capacity_n ? 100.0 * stats[i].live_n / stats[i].capacity_n : 0.0);
+    }
+    fprintf(out, "%8s %8s %10zu\n\n", "large", "-", stats[stats_n - 1].live_n);
+}
+#endif // SLABS
+
+#if 1 // RECYCLE
+// a kept block of exactly bytes (as ref_new_n would ask ref->realloc for), or 0
+static void *
+ref__recycle_take(Referee *ref, size_t bytes)
+{
+#if REFEREE_RECYCLE
+	RefRecycle *recycle = &ref->recycle;
+	void       *alloc   = 0;
+	if (REFEREE_ATOMIC_LOAD(&recycle->bytes))
+	{
+		REFEREE_WRITE_LOCK(&recycle->lock);
+		RefRecycleBucket *bucket = ref__recycle_map_ptr(&recycle->buckets, bytes);
+		if (bucket)
+		{
+			alloc        = bucket->head;
+			bucket->head = *(void **)alloc;
+			if (! --bucket->n) {   ref__recycle_map_remove(&recycle->buckets, bytes);   }
+			REFEREE_ATOMIC_STORE(&recycle->bytes, recycle->bytes - bytes);
+		}
+		REFEREE_WRITE_UNLOCK(&recycle->lock);
+	}
+	(void)REFEREE_ATOMIC_ADD(alloc ? &recycle->hits_n : &recycle->misses_n, 1);
+	return alloc;
+#else
+	(void)ref, (void)bytes;
+	return 0;
+#endif
+}
+
+// keeps what fits of a purge's batch of unlinked allocations (sizes: of each)
+// returns the number left for the caller to free, moved to the front of allocs
+static size_t
+ref__recycle_put(Referee *ref, void **allocs, size_t const *sizes, size_t allocs_n)
+{
+#if REFEREE_RECYCLE
+	RefRecycle *recycle = &ref->recycle;
+	size_t      left_n  = 0;
+	REFEREE_WRITE_LOCK(&recycle->lock);
+	for (size_t i = 0; i < allocs_n; ++i)
+	{
+		size_t            size   = sizes[i];
+		RefRecycleBucket *bucket = 0;
+		if (size >= sizeof(void *) && recycle->bytes + size <= Referee_Recycle_Bytes &&
+		    ! (bucket = ref__recycle_map_ptr(&recycle->buckets, size)))
+		{
+			RefRecycleBucket empty = {0};
+			if (ref__recycle_map_insert(&recycle->buckets, size, empty) == MAP_absent)
+			{   bucket = ref__recycle_map_ptr(&recycle->buckets, size);   }
+		}
+		if (! bucket) {   allocs[left_n++] = allocs[i]; continue;   }
+
+		*(void **)allocs[i] = bucket->head;
+		bucket->head        = allocs[i];
+		++bucket->n;
+		REFEREE_ATOMIC_STORE(&recycle->bytes, recycle->bytes + size);
+	}
+	REFEREE_WRITE_UNLOCK(&recycle->lock);
+	return left_n;
+#else
+	(void)ref, (void)allocs, (void)sizes;
+	return allocs_n;
+#endif
+}
+
+REFEREE_API size_t
+ref_recycle_trim(Referee *ref, size_t max_bytes)
+{
+	size_t freed_bytes = 0;
+#if REFEREE_RECYCLE
+	if (! ref) {   return 0;   }
+	RefRecycle *recycle = &ref->recycle;
+	void       *freeing = 0; // relinked through the same bytes, to free once unlocked
+	REFEREE_WRITE_LOCK(&recycle->lock);
+	// backwards so that the end-swap on removal only moves already-visited buckets
+	for (size_t i = recycle->buckets.n; i-- && recycle->bytes > max_bytes;)
+	{
+		size_t            size   = 0;
+		RefRecycleBucket *bucket = ref__recycle_map_at(&recycle->buckets, i, &size);
+		if (! bucket) {   continue;   }
+		while (bucket->n && recycle->bytes > max_bytes)
+		{
+			void *alloc  = bucket->head;
+			bucket->head = *(void **)alloc;
+			--bucket->n;
+			*(void **)alloc = freeing;
+			freeing         = alloc;
+			freed_bytes    += size;
+			REFEREE_ATOMIC_STORE(&recycle->bytes, recycle->bytes - size);
+		}
+		if (! bucket->n) {   ref__recycle_map_remove(&recycle->buckets, size);   }
+	}
+	REFEREE_WRITE_UNLOCK(&recycle->lock);
+
+	for (void *next; freeing; freeing = next)
+	{
+		next = *(void **)freeing;
+		if (ref->free) { ref->free(ref->allocator, freeing); }
+		else           { REFEREE_FREE(ref->allocator, freeing); }
+	}
+#else
+	(void)ref, (void)max_bytes;
+#endif
+	return freed_bytes;
+}
+
+// ref->realloc for a new block, from what's kept first, and trimming that if it fails
+static void *
+ref__recycle_alloc(Referee *ref, size_t el_n, size_t el_size)
+{
+	void *alloc = ref__recycle_take(ref, el_n * el_size);
+	if (! alloc)
+	{
+		alloc = ref->realloc(ref->allocator, 0, el_n, el_size);
+		if (! alloc && ref_recycle_trim(ref, 0)) {   alloc = ref->realloc(ref->allocator, 0, el_n, el_size);   }
+	}
+	return alloc;
+}
+#endif // RECYCLE
+
+#if 1 // SAMPLE
+#if REFEREE_SAMPLE
+// per thread (and shared by every Referee), as it counts down the bytes the thread allocates
+typedef struct RefSampler {
+	uint64_t rng;  // xorshift64* state, 0 until the thread's first allocation
+	size_t   left; // bytes until the next sample
+} RefSampler;
+// (initial-exec: small enough for static TLS even in a dlopen'd library, and saves a __tls_get_addr
+// call per allocation when built as PIC, e.g. referee_preload.so)
+#if REFEREE_THREADS && defined(__GNUC__) && ! defined(_WIN32)
+__attribute__((tls_model("initial-exec")))
+#endif
+static REFEREE_THREAD_LOCAL RefSampler ref__sampler;
+static size_t ref__sample_seeds; // (so that each thread's draws differ)
+
+// a uniform draw from (0, 1]
+static double
+ref__sample_unit(RefSampler *sampler)
+{
+	uint64_t x = sampler->rng;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	sampler->rng = x;
+	return (double)(((x * 0x2545f4914f6cdd1dull) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+// bytes until the next sample, drawn from an exponential distribution with a mean of Referee_Sample_Bytes
+static size_t
+ref__sample_gap(RefSampler *sampler)
+{
+	double gap = -log(ref__sample_unit(sampler)) * (double)Referee_Sample_Bytes;
+	return gap < 1 ? 1 : (size_t)gap;
+}
+
+// whether an allocation of bytes is to be sampled (inline, as it's on every allocation)
+static inline int
+ref__sample_due(size_t bytes)
+{
+	RefSampler *sampler = &ref__sampler;
+	if (bytes < sampler->left) {   sampler->left -= bytes; return 0;   }
+	if (! sampler->rng)
+	{ // the thread's first: start counting down, then check again
+		uint64_t seed = (uint64_t)(uintptr_t)sampler ^ (uint64_t)REFEREE_ATOMIC_ADD(&ref__sample_seeds, 1) << 32;
+		seed = (seed ^ seed >> 30) * 0xbf58476d1ce4e5b9ull;
+		sampler->rng  = (seed ^ seed >> 31) | 1;
+		sampler->left = ref__sample_gap(sampler);
+		if (bytes < sampler->left) {   sampler->left -= bytes; return 0;   }
+	}
+	sampler->left = ref__sample_gap(sampler);
+	return 1;
+}
+
+static inline size_t
+ref__sample_filter_i(void *ptr)
+{   return (size_t)(((uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15ull) >> (64 - Referee_Sample_Filter_Bits));   }
+
+// whether a ptr that hashes to i may have been sampled
+static inline int
+ref__sample_filter_has(RefSampleFilter *filter, size_t i)
+{
+	size_t const bits_w = 8 * sizeof(size_t);
+	return filter && (REFEREE_ATOMIC_LOAD(&filter->bits[i / bits_w]) >> (i % bits_w) & 1);
+}
+
+// call holding the samples' lock
+static void
+ref__sample_filter_add(RefSampleFilter *filter, size_t i, int delta)
+{
+	size_t const bits_w = 8 * sizeof(size_t),
+	             bit    = (size_t)1 << (i % bits_w),
+	             word   = filter->bits[i / bits_w];
+	filter->counts[i] += (uint32_t)delta;
+	REFEREE_ATOMIC_STORE(&filter->bits[i / bits_w], filter->counts[i] ? word | bit : word & ~bit);
+}
+
+// records ptr (just allocated, size bytes, from the callsite given) as a sample
+static void
+ref__sample_add(Referee *ref, void *ptr, size_t size, int line, char const *file, char const *func, char const *call)
+{
+	RefSamples      *samples = &ref->samples;
+	RefSampleFilter *filter  = (RefSampleFilter *)REFEREE_ATOMIC_LOAD(&samples->filter);
+	if (! filter)
+	{
+		RefSampleFilter *made = (RefSampleFilter *)calloc(1, sizeof(*made));
+		if (! made) {   return;   }
+		if (! REFEREE_ATOMIC_CAS(&samples->filter, 0, (size_t)made)) {   free(made);   } // another thread's won
+		filter = (RefSampleFilter *)REFEREE_ATOMIC_LOAD(&samples->filter);
+	}
+
+	double     chance = -expm1(-(double)size / (double)Referee_Sample_Bytes),
+	           per    = 1.0 / chance;
+	RefSampled sample = {0};
+	sample.callsite  = ref__callsite_intern((size_t)line, file, func, call);
+	sample.size      = size;
+	sample.est_n     = (size_t)per; // rounded up by chance, so that it's per ptrs on average (not e.g. 1 for 1.5)
+	sample.est_n    += ref__sample_unit(&ref__sampler) <= per - (double)sample.est_n;
+	sample.est_bytes = (size_t)((double)size / chance + 0.5);
+# if Referee_Sample_Frames_N && defined(_WIN32)
+	sample.frames_n  = CaptureStackBackTrace(1, Referee_Sample_Frames_N, sample.frames, 0);
+# elif Referee_Sample_Frames_N
+	int frames_n     = backtrace(sample.frames, Referee_Sample_Frames_N);
+	sample.frames_n  = frames_n > 0 ? (size_t)frames_n : 0;
+# endif
+
+	REFEREE_WRITE_LOCK(&samples->lock);
+	if (ref__sample_map_insert(&samples->of, ptr, sample) == MAP_absent)
+	{
+		ref__sample_filter_add(filter, ref__sample_filter_i(ptr), 1);
+		ref__callsite_track(sample.callsite, sample.est_n, sample.est_bytes, sample.est_n);
+	}
+	REFEREE_WRITE_UNLOCK(&samples->lock);
+}
+
+// as ptr stops being tracked
+static void
+ref__sample_drop(Referee *ref, void *ptr)
+{
+	RefSamples      *samples = &ref->samples;
+	RefSampleFilter *filter  = (RefSampleFilter *)REFEREE_ATOMIC_LOAD(&samples->filter);
+	size_t           i       = ref__sample_filter_i(ptr);
+	if (! ref__sample_filter_has(filter, i)) {   return;   } // (most ptrs aren't sampled)
+
+	REFEREE_WRITE_LOCK(&samples->lock);
+	RefSampled sample = ref__sample_map_remove(&samples->of, ptr);
+	if (sample.size)
+	{
+		ref__sample_filter_add(filter, i, -1);
+		ref__callsite_untrack(sample.callsite, sample.est_n, sample.est_bytes);
+	}
+	REFEREE_WRITE_UNLOCK(&samples->lock);
+}
+
+// as ref_compact moves ptrs
+static void
+ref__sample_move(Referee *ref, void *old_ptr, void *new_ptr)
+{
+	RefSamples      *samples = &ref->samples;
+	RefSampleFilter *filter  = (RefSampleFilter *)REFEREE_ATOMIC_LOAD(&samples->filter);
+	size_t           old_i   = ref__sample_filter_i(old_ptr);
+	if (! ref__sample_filter_has(filter, old_i)) {   return;   }
+
+	REFEREE_WRITE_LOCK(&samples->lock);
+	RefSampled sample = ref__sample_map_remove(&samples->of, old_ptr);
+	if (sample.size)
+	{
+		ref__sample_filter_add(filter, old_i, -1);
+		if (ref__sample_map_insert(&samples->of, new_ptr, sample) == MAP_absent)
+		{   ref__sample_filter_add(filter, ref__sample_filter_i(new_ptr), 1);   }
+		else {   ref__callsite_untrack(sample.callsite, sample.est_n, sample.est_bytes);   } // (lost)
+	}
+	REFEREE_WRITE_UNLOCK(&samples->lock);
+}
+
+typedef struct RefSampleRow {
+	void      *ptr;
+	RefSampled sample;
+} RefSampleRow;
+
+// biggest estimate first
+static int
+ref__sample_cmp_qsort(void const *a, void const *b)
+{
+	size_t A = ((RefSampleRow const *)a)->sample.est_bytes, B = ((RefSampleRow const *)b)->sample.est_bytes;
+	return (A < B) - (B < A);
+}
+#else
+static void ref__sample_drop(Referee *ref, void *ptr)                  {   (void)ref, (void)ptr;                    }
+static void ref__sample_move(Referee *ref, void *old_ptr, void *new_ptr) {   (void)ref, (void)old_ptr, (void)new_ptr; }
+#endif//REFEREE_SAMPLE
+
+REFEREE_API size_t
+ref_samples_dump(FILE *out, Referee *ref)
+{
+#if REFEREE_SAMPLE
+	if (! out || ! ref) {   return REFEREE_INVALID;   }
+	RefSamples   *samples = &ref->samples;
+	RefSampleRow *rows    = 0;
+	size_t        rows_n  = 0;
+	REFEREE_WRITE_LOCK(&samples->lock);
+	if (samples->of.n) {   rows = (RefSampleRow *)malloc(samples->of.n * sizeof(*rows));   }
+	for (size_t i = 0; rows && i < samples->of.n; ++i)
+	{
+		void             *ptr    = 0;
+		RefSampled const *sample = ref__sample_map_at(&samples->of, i, &ptr);
+		if (sample) {   rows[rows_n].ptr = ptr; rows[rows_n++].sample = *sample;   }
+	}
+	int ok = rows || ! samples->of.n;
+	REFEREE_WRITE_UNLOCK(&samples->lock);
+	if (! ok) {   return REFEREE_INVALID;   }
+
+	qsort(rows, rows_n, sizeof(*rows), ref__sample_cmp_qsort);
+	fprintf(out, "%zu samples (1 per %zu bytes allocated, on average)\n", rows_n, (size_t)Referee_Sample_Bytes);
+	for (size_t i = 0; i < rows_n; ++i)
+	{
+		RefSampled const  *sample = &rows[i].sample;
+		RefCallsite const *site   = ref__callsite(sample->callsite);
+		fprintf(out, "~%zu bytes in ~%zu ptrs, from %zu bytes at %p. ", sample->est_bytes, sample->est_n, sample->size, rows[i].ptr);
+		if (site) {   fprintf(out, "%s - %s(%zu) - \t %s\n", site->func, site->file, site->line, site->call);   }
+		else      {   fprintf(out, "?\n");   }
+# if Referee_Sample_Frames_N && defined(_WIN32)
+		for (size_t frame_i = 0; frame_i < sample->frames_n; ++frame_i)
+		{   fprintf(out, "    %p\n", sample->frames[frame_i]);   }
+# elif Referee_Sample_Frames_N
+		char **symbols = backtrace_symbols(sample->frames, (int)sample->frames_n);
+		for (size_t frame_i = 0; frame_i < sample->frames_n; ++frame_i)
+		{
+			if (symbols) {   fprintf(out, "    %s\n", symbols[frame_i]);   }
+			else         {   fprintf(out, "    %p\n", sample->frames[frame_i]);   }
+		}
+		free(symbols);
+# endif
+	}
+	fputc('\n', out);
+	free(rows);
+	return rows_n;
+#else
+	(void)out, (void)ref;
+	return 0;
+#endif
+}
+#endif // SAMPLE
+
+REFEREE_API inline void *
+REF_DBG(ref_new_n, Referee *ref, size_t el_n, size_t el_size, size_t init_refs)
+{
+	if (! ref->realloc || ! ref->free) { ref_set_default_allocator(ref); }
+	ref__budget_make_room(ref, 0, el_n * el_size);
+#if REFEREE_HEADERS
+	void *base = ref__recycle_alloc(ref, 1, REFEREE_HEADER_SIZE + el_n * el_size);
+	return (base
+	        ? ref__header_add_(ref, base, el_n, el_size, init_refs)
+	        : base);
+#else
+    /* __itt_heap_allocate_begin(0, el_n * el_size, 0); */
+	void *ptr = ref__recycle_alloc(ref, el_n, el_size);
+    /* __itt_heap_allocate_end(0, ptr, el_n * el_size, 0); */
+
+    return (ptr
+            ? ref_add_n_(ref, ptr, el_n, el_size, init_refs)
+            : ptr);
+#endif//REFEREE_HEADERS
+}
+
+// i.e. 1 block of the full size
+REFEREE_API inline void *
+REF_DBG(ref_new, Referee *ref, size_t size, size_t init_refs)
+{   return ref_new_n_(ref, 1, size, init_refs);   }
+
+
+// TODO(api): this is to realloc as add is to new - make naming scheme consistent
+// doesn't perform the reallocation, just tracks that it has happened
+REFEREE_API inline void *
+REF_DBG(ref_register_realloc_n, Referee *ref, void *ptr, void *ptr_p, size_t el_n, size_t el_size, size_t init_refs)
+{
+    REFEREE_register_realloc(ptr, ptr_p, el_n, el_size, line, file, func, call);
+    if (ptr)
+    {
+        ref__flush_ptr(ref, ptr_p);
+        // TODO: incorporate init_refs for existing ptrs?
+        RefInfo info = ref__forget(ref, ptr_p, 0); // ptr_p may have been freed by now
+        ref_add_n_(ref, ptr, el_n, el_size, (~ info.refcount
+                                             ? info.refcount
+                                             : init_refs));
+        ref__finalizer_move(ref, ptr_p, ptr);
+    }
+    return ptr;
+}
+
+REFEREE_API inline void *
+REF_DBG(ref_realloc_n, Referee *ref, void *ptr, size_t el_n, size_t el_size, size_t init_refs)
+{
+	if (! ref->realloc || ! ref->free) { ref_set_default_allocator(ref); }
+	ref__budget_make_room(ref, ptr, el_n * el_size);
+#if REFEREE_HEADERS
+	if (! ptr) {   return ref_new_n_(ref, el_n, el_size, init_refs);   }
+
+	RefereeShard *shard  = ref__shard(ref, ptr);
+	RefHeader    *header = ref__header(shard, ptr);
+	if (header)
+	{ // the header moves with the memory, so take it out of the shard's list while it's realloc'd
+		ref__flush_ptr(ref, ptr);
+		REFEREE_WRITE_LOCK(&shard->lock);
+		RefInfo info = ref__forget_header_locked(ref, shard, header, 1);
+		REFEREE_WRITE_UNLOCK(&shard->lock);
+
+		void *base = ref->realloc(ref->allocator, header, 1, REFEREE_HEADER_SIZE + el_n * el_size);
+		if (! base) {   ref__header_add_(ref, header, ref_info_el_n(&info), ref_info_el_size(&info), info.refcount); return 0;   }
+		// (if the moved block's page can't be counted, it's lost along with the old ptr)
+		void *result = ref__header_add_(ref, base, el_n, el_size, info.refcount);
+		ref__finalizer_move(ref, ptr, result);
+		return result;
+	}
+#endif//REFEREE_HEADERS
+    /* __itt_heap_reallocate_begin(0, ptr, el_n * el_size, 0); */
+    void *result = ref->realloc   (ref->allocator, ptr, el_n, el_size);
+    /* __itt_heap_reallocate_end(0, ptr, result, el_n * el_size, 0); */
+
+    ref_register_realloc_n_(ref, result, ptr, el_n, el_size, init_refs);
+    return result;
+}
+
+REFEREE_API inline void *
+REF_DBG(ref_realloc, Referee *ref, void *ptr, size_t size, size_t init_refs)
+{   return ref_realloc_n_(ref, ptr, 1, size, init_refs);   }
+
+REFEREE_API void *
+REF_DBG(ref_dup, Referee *ref, void *ptr, size_t init_refs)
+{
+	void *result = 0;
+	if (! ref || ! ptr) { return result; }
+
+	RefereeShard *shard = ref__shard(ref, ptr);
+	REFEREE_READ_LOCK(&shard->lock);
+	RefInfo *info = ref__lookup(shard, ptr),
+	         copy = {0};
+	if (info) {   copy = *info;   }
+	REFEREE_READ_UNLOCK(&shard->lock);
+
+	if (info)
+	{
+		result = ref_new_n_(ref, ref_info_el_n(&copy), ref_info_el_size(&copy), init_refs);
+		if (result) {   memcpy(result, ptr, ref__info_size(&copy));   }
+	}
+	return result;
+}
+
+
+static void *
+ref__inc_c_now(Referee *ref, void *ptr, size_t c)
+{
+	if (! ref || ! ptr) { return 0; }
+
+	RefereeShard *shard = ref__shard(ref, ptr);
+	REFEREE_READ_LOCK(&shard->lock);
+	RefInfo *info = ref__lookup(shard, ptr);
+	if (! info) {   REFEREE_READ_UNLOCK(&shard->lock); return 0;   }
+
+	size_t old_count = ref__count_add(info, c);
+	if (old_count & REFEREE_DEAD) {   REFEREE_READ_UNLOCK(&shard->lock); return 0;   } // lost the race with purge (only with REFEREE_LOCKFREE)
+	if (old_count == 0 && c) {   ref__zeros_sync_read_locked(shard, ptr, info);   }
+	else                     {   REFEREE_READ_UNLOCK(&shard->lock);               }
+	return ptr;
+}
+REFEREE_API inline void *
+ref_inc_c(Referee *ref, void *ptr, size_t c)
+{
+#if REFEREE_DEFERRED
+	return ref__defer(ref, ptr, c, 1);
+#else
+	return ref__inc_c_now(ref, ptr, c);
+#endif
+}
+REFEREE_API inline void *
+ref_inc(Referee *ref, void *ptr)
+{   return ref_inc_c(ref, ptr, 1);   }
+
+static void *
+ref__dec_c_now(Referee *ref, void *ptr, size_t c)
+{
+	if (! ref || ! ptr) { return 0; }
+
+	RefereeShard *shard = ref__shard(ref, ptr);
+	REFEREE_READ_LOCK(&shard->lock);
+	RefInfo *info = ref__lookup(shard, ptr);
+	if (! info) {   REFEREE_READ_UNLOCK(&shard->lock); return 0;   }
+
+	size_t new_count,
+	       old_count = ref__count_sub(info, c, 0, &new_count);
+	if (old_count & REFEREE_DEAD) {   REFEREE_READ_UNLOCK(&shard->lock); return 0;   }
+
+	if (old_count && ! new_count) {   ref__zeros_sync_read_locked(shard, ptr, info);   }
+	else                          {   REFEREE_READ_UNLOCK(&shard->lock);               }
+	ref__cycles_suspect(ref, ptr, new_count);
+	return ptr;
+}
+REFEREE_API void *
+ref_dec_c(Referee *ref, void *ptr, size_t c)
+{
+#if REFEREE_DEFERRED
+	return ref__defer(ref, ptr, c, 0);
+#else
+	return ref__dec_c_now(ref, ptr, c);
+#endif
+}
+REFEREE_API void *
+ref_dec(Referee *ref, void *ptr)
+{   return ref_dec_c(ref, ptr, 1);   }
+
+// start of the block that addr is in, or 0
+static void *
+ref__base(Referee *ref, void *addr)
+{
+#if REFEREE_INTERIOR
+    return (void *)ref__interior_find(&ref->interior, (uintptr_t)addr);
+#else
+    RefInfo info;
+    return ref_info_copy(ref, addr, &info) ? addr : 0;
+#endif
+}
+
+REFEREE_API RefInfo *
+ref_info_containing(Referee *ref, void *addr, void **base_out)
+{
+    void    *base = (ref && addr) ? ref__base(ref, addr) : 0;
+    RefInfo *info = base ? ref_info(ref, base) : 0;
+    if (base_out) {   *base_out = info ? base : 0;   }
+    return info;
+}
+
+REFEREE_API void *
+ref_inc_interior(Referee *ref, void *addr)
+{
+    void *base = (ref && addr) ? ref__base(ref, addr) : 0;
+    return (base && ref_inc(ref, base)) ? addr : 0;
+}
+
+REFEREE_API void *
+ref_dec_interior(Referee *ref, void *addr)
+{
+    void *base = (ref && addr) ? ref__base(ref, addr) : 0;
+    return (base && ref_dec(ref, base)) ? addr : 0;
+}
+
+#if 1 // MANY
+// ptrs handled per lock taken: enough for each shard to get a few when sharded
+#ifndef  Referee_Many_Batch
+# define Referee_Many_Batch (REFEREE_SHARD_BITS ? 256 : 64)
+#endif
+
+// REF_MANY_DEC_WHOLE: decs that would take a count below 0 are left out, with their deltas put in
+// counts_out (and 0 for the rest, so counts_out can be deltas)
+typedef enum RefManyOp { REF_MANY_INC, REF_MANY_DEC, REF_MANY_DEC_WHOLE, REF_MANY_COUNT } RefManyOp;
+
+// applies op to the ptrs (indices into ptrs) that all belong to shard
+// returns the number found
+static size_t
+ref__many_shard(Referee *ref, RefereeShard *shard, void *const *ptrs, size_t const *ptr_is, size_t ptr_is_n,
+                RefManyOp op, size_t const *deltas, size_t *counts_out)
+{
+    void    *keys [Referee_Many_Batch];
+    RefInfo *infos[Referee_Many_Batch];
+    size_t   syncs[Referee_Many_Batch], syncs_n = 0, found_n = 0;
+    size_t   suspects[REFEREE_CYCLES ? Referee_Many_Batch : 1], suspects_n = 0;
+    for (size_t i = 0; i < ptr_is_n; ++i)
+    {   keys[i] = ptrs[ptr_is[i]];   }
+
+    REFEREE_READ_LOCK(&shard->lock);
+#if REFEREE_HEADERS
+    for (size_t i = 0; i < ptr_is_n; ++i)
+    {   MAP_PREFETCH((char *)keys[i] - REFEREE_HEADER_SIZE);   }
+    for (size_t i = 0; i < ptr_is_n; ++i)
+    {   infos[i] = ref__lookup(shard, keys[i]);   }
+#else
+    ref__map_ptr_many(&shard->ptr_infos, keys, ptr_is_n, infos);
+#endif
+
+    for (size_t i = 0; i < ptr_is_n; ++i)
+    {
+        RefInfo *info = infos[i];
+        size_t   c    = deltas ? deltas[ptr_is[i]] : 1;
+        if (! info)
+        {
+            if (op == REF_MANY_COUNT || op == REF_MANY_DEC_WHOLE) {   counts_out[ptr_is[i]] = 0;   }
+            continue;
+        }
+        ++found_n;
+
+        switch (op)
+        {
+            case REF_MANY_INC: {
+                size_t old_count = ref__count_add(info, c);
+                if (old_count & REFEREE_DEAD) {   --found_n; break;   } // lost the race with purge
+                if (old_count == 0 && c)      {   syncs[syncs_n++] = i;   }
+            } break;
+
+            case REF_MANY_DEC:
+            case REF_MANY_DEC_WHOLE: {
+                size_t new_count,
+                       old_count = ref__count_sub(info, c, op == REF_MANY_DEC_WHOLE, &new_count);
+                if (op == REF_MANY_DEC_WHOLE)  {   counts_out[ptr_is[i]] = (old_count & REFEREE_DEAD) || old_count >= c ? 0 : c;   }
+                if (old_count & REFEREE_DEAD)  {   --found_n; break;   }
+                if (old_count && ! new_count)  {   syncs[syncs_n++] = i;   }
+                if (REFEREE_CYCLES && new_count && ! (new_count & REFEREE_DEAD)) {   suspects[suspects_n++] = i;   }
+            } break;
+
+            case REF_MANY_COUNT: {
+                size_t count = REFEREE_ATOMIC_LOAD(&info->refcount);
+                counts_out[ptr_is[i]] = (count & REFEREE_DEAD) ? 0 : count;
+            } break;
+        }
+    }
+    REFEREE_READ_UNLOCK(&shard->lock);
+
+    if (syncs_n)
+    { // as ref__zeros_sync_read_locked, but once for the whole batch
+        REFEREE_WRITE_LOCK(&shard->lock);
+        for (size_t i = 0; i < syncs_n; ++i)
+        {
+            void    *ptr  = keys[syncs[i]];
+            RefInfo *info = ref__lookup(shard, ptr);
+            if (info) {   ref__zeros_sync(&shard->zeros, ptr, info);   }
+        }
+        REFEREE_WRITE_UNLOCK(&shard->lock);
+    }
+    for (size_t i = 0; i < suspects_n; ++i)
+    {   ref__cycles_suspect(ref, keys[suspects[i]], 1);   }
+    return found_n;
+}
+
+static size_t
+ref__many(Referee *ref, void *const *ptrs, size_t ptrs_n, RefManyOp op, size_t const *deltas, size_t *counts_out)
+{
+    if (! ref || ! ptrs) {   return 0;   }
+
+    size_t found_n = 0;
+    for (size_t start = 0; start < ptrs_n; start += Referee_Many_Batch)
+    {
+        size_t end = (ptrs_n - start < Referee_Many_Batch
+                      ? ptrs_n
+                      : start + Referee_Many_Batch);
+
+        // group the batch's ptrs by shard (counting sort)
+        size_t shard_starts[REFEREE_SHARD_N + 1] = {0},
+               ptr_is[Referee_Many_Batch];
+        unsigned short shard_is[Referee_Many_Batch];
+        for (size_t i = start; i < end; ++i)
+        {
+            if (! ptrs[i])
+            {
+                if (op == REF_MANY_COUNT || op == REF_MANY_DEC_WHOLE) {   counts_out[i] = 0;   }
+                shard_is[i - start] = REFEREE_SHARD_N; // (skipped)
+                continue;
+            }
+            shard_is[i - start] = (unsigned short)(ref__shard(ref, ptrs[i]) - ref->shards);
+            ++shard_starts[shard_is[i - start]];
+        }
+        for (size_t shard_i = 0, total = 0; shard_i <= REFEREE_SHARD_N; ++shard_i)
+        {   size_t n = shard_starts[shard_i]; shard_starts[shard_i] = total; total += n;   }
+        size_t shard_ends[REFEREE_SHARD_N];
+        for (size_t shard_i = 0; shard_i < REFEREE_SHARD_N; ++shard_i)
+        {   shard_ends[shard_i] = shard_starts[shard_i];   }
+        for (size_t i = start; i < end; ++i)
+        {
+            if (shard_is[i - start] < REFEREE_SHARD_N)
+            {   ptr_is[shard_ends[shard_is[i - start]]++] = i;   }
+        }
+
+        for (size_t shard_i = 0; shard_i < REFEREE_SHARD_N; ++shard_i)
+        {
+            size_t n = shard_ends[shard_i] - shard_starts[shard_i];
+            if (n) {   found_n += ref__many_shard(ref, &ref->shards[shard_i], ptrs, &ptr_is[shard_starts[shard_i]], n, op, deltas, counts_out);   }
+        }
+    }
+    return found_n;
+}
+
+REFEREE_API size_t
+ref_inc_many(Referee *ref, void *const *ptrs, size_t ptrs_n, size_t const *deltas)
+{   return ref__many(ref, ptrs, ptrs_n, REF_MANY_INC, deltas, 0);   }
+
+REFEREE_API size_t
+ref_dec_many(Referee *ref, void *const *ptrs, size_t ptrs_n, size_t const *deltas)
+{   return ref__many(ref, ptrs, ptrs_n, REF_MANY_DEC, deltas, 0);   }
+
+REFEREE_API size_t
+ref_count_many(Referee *ref, void *const *ptrs, size_t ptrs_n, size_t *counts_out)
+{   return ref__many(ref, ptrs, ptrs_n, REF_MANY_COUNT, 0, counts_out);   }
+#endif // MANY
+
+#if 1 // DEFERRED
+// a log is a small hash table (keyed on ref and ptr) so that repeated changes to the same ptr are
+// summed as they're made, and only distinct ptrs use up space
+#define Referee_Log_Slots (2 * Referee_Log_N)
+
+typedef struct RefLogEntry {
+    Referee *ref;
+    void    *ptr;
+    size_t   inc, dec;
+} RefLogEntry;
+
+typedef struct RefLog RefLog;
+struct RefLog {
+    RefLog      *next;                   // in ref__logs
+    size_t       n;
+    size_t       used  [Referee_Log_N];  // slots in use, in the order they were taken
+    RefLogEntry  slots [Referee_Log_Slots];
+    void        *ptrs  [Referee_Log_N];  // scratch for applying the summed entries
+    size_t       counts[Referee_Log_N];
+    RefLogEntry  held  [Referee_Log_N / 4]; // scratch for the decs that REF_LOG_WHOLE keeps
+
+    REFEREE_LOCK (lock) // only contended by a flush from another thread
+};
+
+static RefLog                      *ref__logs;   // every thread's log
+static REFEREE_THREAD_LOCAL RefLog *ref__my_log;
+#if REFEREE_THREADS
+static size_t                       ref__logs_lock;
+#endif
+
+#if REFEREE_DEFERRED && REFEREE_THREADS
+// each log is also kept in thread-specific storage, whose destructor hands it back at thread exit
+static void ref__log_exit(void *arg);
+# ifdef _WIN32
+#  include <windows.h>
+static DWORD     ref__log_key;
+static INIT_ONCE ref__log_key_once = INIT_ONCE_STATIC_INIT;
+static VOID WINAPI ref__log_exit_fls(PVOID arg) {   if (arg) {   ref__log_exit(arg);   }   }
+static BOOL CALLBACK
+ref__log_key_init(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+    (void)once, (void)param, (void)context;
+    ref__log_key = FlsAlloc(ref__log_exit_fls);
+    return ref__log_key != FLS_OUT_OF_INDEXES;
+}
+#  define ref__log_key_set(log) (InitOnceExecuteOnce(&ref__log_key_once, ref__log_key_init, 0, 0) && \
+                                 FlsSetValue(ref__log_key, (log)))
+# else
+#  include <pthread.h>
+static pthread_key_t  ref__log_key;
+static pthread_once_t ref__log_key_once = PTHREAD_ONCE_INIT;
+static int            ref__log_key_ok;
+static void ref__log_key_init(void) {   ref__log_key_ok = ! pthread_key_create(&ref__log_key, ref__log_exit);   }
+#  define ref__log_key_set(log) (pthread_once(&ref__log_key_once, ref__log_key_init), \
+                                 ref__log_key_ok && ! pthread_setspecific(ref__log_key, (log)))
+# endif
+#else
+# define ref__log_key_set(log) ((void)(log), 0) // (the one thread's log lasts as long as the process)
+#endif
+
+// A dec in one thread's log can be of a ref that an inc in another thread's (not yet applied) log
+// made, so decs are only taken past 0 once every log's incs are in.
+typedef enum RefLogApply {
+    REF_LOG_INCS,  // only the net incs (the entries stay, netting to nothing)
+    REF_LOG_ALL,   // every net change, emptying the log
+    REF_LOG_WHOLE, // as REF_LOG_ALL, but keeping the net decs that would take a count below 0 logged
+                   // (unless there are too many to keep, when the log is left full)
+} RefLogApply;
+
+// finds ptr's entry for ref in log, or takes an empty slot for it (if the log isn't full)
+// returns 0 if the log is full
+// call holding the log's lock
+static RefLogEntry *
+ref__log_entry(RefLog *log, Referee *ref, void *ptr)
+{
+    uint64_t hash = ((uint64_t)(uintptr_t)ptr ^ (uint64_t)(uintptr_t)ref) * 0x9e3779b97f4a7c15;
+    for (size_t i = (size_t)(hash >> 32);; ++i)
+    { // (there are always empty slots, as the log is applied once half of them are used)
+        RefLogEntry *entry = &log->slots[i & (Referee_Log_Slots - 1)];
+        if (entry->ptr == ptr && entry->ref == ref) {   return entry;   }
+        if (! entry->ptr)
+        {
+            if (log->n == Referee_Log_N) {   return 0;   }
+            log->used[log->n++] = (size_t)(entry - log->slots);
+            entry->ref = ref, entry->ptr = ptr;
+            entry->inc = entry->dec = 0;
+            return entry;
+        }
+    }
+}
+
+// applies the net change for each ptr with one batched inc and one batched dec per run of
+// entries for the same Referee
+// call holding the log's lock
+static void
+ref__log_apply_locked(RefLog *log, RefLogApply what)
+{
+    size_t held_n = 0, unheld_n = 0;
+    for (size_t start = 0, end; start < log->n; start = end)
+    {
+        Referee *ref   = log->slots[log->used[start]].ref;
+        size_t   inc_n = 0, dec_n = 0;
+        for (end = start; end < log->n && log->slots[log->used[end]].ref == ref; ++end)
+        {
+            RefLogEntry *entry = &log->slots[log->used[end]];
+            if (what == REF_LOG_INCS && entry->inc <= entry->dec) {   continue;   }
+            // incs are written from the front of the scratch arrays, decs from the back
+            if      (entry->inc > entry->dec) {   log->ptrs[inc_n] = entry->ptr; log->counts[inc_n++] = entry->inc - entry->dec;   }
+            else if (entry->dec > entry->inc) {   ++dec_n; log->ptrs[Referee_Log_N - dec_n] = entry->ptr; log->counts[Referee_Log_N - dec_n] = entry->dec - entry->inc;   }
+            if (entry->dec && entry->inc >= entry->dec)
+            {   ref__cycles_suspect(ref, entry->ptr, 1);   } // (a dec that coalescing hid can still have made a cycle garbage)
+            entry->inc = entry->dec = 0;
+        }
+        ref__many(ref, log->ptrs, inc_n, REF_MANY_INC, log->counts, 0);
+
+        void  **dec_ptrs = &log->ptrs  [Referee_Log_N - dec_n];
+        size_t *decs     = &log->counts[Referee_Log_N - dec_n];
+        if (what != REF_LOG_WHOLE) {   ref__many(ref, dec_ptrs, dec_n, REF_MANY_DEC, decs, 0); continue;   }
+        ref__many(ref, dec_ptrs, dec_n, REF_MANY_DEC_WHOLE, decs, decs);
+        for (size_t i = 0; i < dec_n; ++i)
+        {
+            if (! decs[i]) {   continue;   }
+            if (held_n < Referee_Log_N / 4)
+            {   RefLogEntry entry = { ref, dec_ptrs[i], 0, decs[i] }; log->held[held_n++] = entry;   }
+            else
+            {   ref__log_entry(log, ref, dec_ptrs[i])->dec = decs[i]; ++unheld_n;   } // (still in the log)
+        }
+    }
+    if (what == REF_LOG_INCS) {   return;   }
+
+    if (unheld_n)
+    { // too many to start the log again with: put them all back where they were instead
+        for (size_t i = 0; i < held_n; ++i)
+        {   ref__log_entry(log, log->held[i].ref, log->held[i].ptr)->dec = log->held[i].dec;   }
+        return;
+    }
+    for (size_t i = 0; i < log->n; ++i)
+    {   log->slots[log->used[i]].ref = 0, log->slots[log->used[i]].ptr = 0;   }
+    log->n = 0;
+    for (size_t i = 0; i < held_n; ++i)
+    {   *ref__log_entry(log, log->held[i].ref, log->held[i].ptr) = log->held[i];   }
+}
+
+// ptr's entry for ref in log, or 0 if it has none
+// call holding the log's lock
+static RefLogEntry *
+ref__log_find(RefLog *log, Referee *ref, void *ptr)
+{
+    uint64_t hash = ((uint64_t)(uintptr_t)ptr ^ (uint64_t)(uintptr_t)ref) * 0x9e3779b97f4a7c15;
+    for (size_t i = (size_t)(hash >> 32);; ++i)
+    { // (there are always empty slots, as the log is applied once half of them are used)
+        RefLogEntry *entry = &log->slots[i & (Referee_Log_Slots - 1)];
+        if (entry->ptr == ptr && entry->ref == ref) {   return entry;   }
+        if (! entry->ptr)                           {   return 0;       }
+    }
+}
+
+#if REFEREE_DEFERRED && REFEREE_THREADS
+static void ref__flush_locked(void);
+
+// at thread exit: applies what's left in the thread's log (along with every other log, as its decs
+// may need their incs), takes it out of ref__logs and frees it
+static void
+ref__log_exit(void *arg)
+{
+    RefLog *log = (RefLog *)arg;
+    REFEREE_WRITE_LOCK(&ref__logs_lock);
+    ref__flush_locked();
+    for (RefLog **link = &ref__logs; *link; link = &(*link)->next)
+    {   if (*link == log) {   *link = log->next; break;   }   }
+    REFEREE_WRITE_UNLOCK(&ref__logs_lock);
+    ref__my_log = 0;
+    free(log);
+}
+#endif
+
+static void *
+ref__defer(Referee *ref, void *ptr, size_t c, int is_inc)
+{
+    if (! ref || ! ptr) {   return 0;   }
+
+    RefLog *log = ref__my_log;
+    if (! log)
+    {
+        log = (RefLog *)calloc(1, sizeof(*log));
+        if (! log)
+        {   return is_inc ? ref__inc_c_now(ref, ptr, c) : ref__dec_c_now(ref, ptr, c);   }
+        REFEREE_WRITE_LOCK(&ref__logs_lock);
+        log->next = ref__logs;
+        ref__logs = log;
+        REFEREE_WRITE_UNLOCK(&ref__logs_lock);
+        ref__my_log = log;
+        (void)ref__log_key_set(log); // (if that fails, the log just isn't freed at thread exit)
+    }
+
+    REFEREE_WRITE_LOCK(&log->lock);
+    RefLogEntry *entry;
+    while (! (entry = ref__log_entry(log, ref, ptr)))
+    { // full: apply it, but only taking counts past 0 once every log's incs are in
+        ref__log_apply_locked(log, REF_LOG_WHOLE);
+        if (log->n == Referee_Log_N)
+        {
+            REFEREE_WRITE_UNLOCK(&log->lock);
+            ref_flush();
+            REFEREE_WRITE_LOCK(&log->lock);
+        }
+    }
+    if (is_inc) {   entry->inc += c;   }
+    else        {   entry->dec += c;   }
+    REFEREE_WRITE_UNLOCK(&log->lock);
+    return ptr;
+}
+
+// applies what every thread has logged for ptr (leaving the rest of their logs as they are) before it
+// stops being tracked, so that none of it is left to be applied to a later block at the same address
+static void
+ref__flush_ptr(Referee *ref, void *ptr)
+{
+#if REFEREE_DEFERRED
+    if (! ref || ! ptr) {   return;   }
+    size_t inc = 0, dec = 0; // (summed over every log first, so that their incs are in before their decs)
+    REFEREE_HANDLES_READ_LOCK(&ref__logs_lock);
+    for (RefLog *log = ref__logs; log; log = log->next)
+    {
+        REFEREE_WRITE_LOCK(&log->lock);
+        RefLogEntry *entry = log->n ? ref__log_find(log, ref, ptr) : 0;
+        if (entry)
+        { // (the entry stays, so that the rest of the log doesn't need rehashing, and nets to nothing)
+            inc += entry->inc, dec += entry->dec;
+            entry->inc = entry->dec = 0;
+        }
+        REFEREE_WRITE_UNLOCK(&log->lock);
+    }
+    REFEREE_HANDLES_READ_UNLOCK(&ref__logs_lock);
+    if      (inc > dec) {   ref__inc_c_now(ref, ptr, inc - dec);   }
+    else if (dec > inc) {   ref__dec_c_now(ref, ptr, dec - inc);   }
+#else
+    (void)ref, (void)ptr;
+#endif
+}
+
+// applies every log: first all of their incs, then all of their decs
+// (with every log locked throughout, so that nothing is logged in between)
+// call holding ref__logs_lock as a writer
+static void
+ref__flush_locked(void)
+{
+    for (RefLog *log = ref__logs; log; log = log->next)
+    {
+        REFEREE_WRITE_LOCK(&log->lock);
+        if (log->n) {   ref__log_apply_locked(log, REF_LOG_INCS);   }
+    }
+    for (RefLog *log = ref__logs; log; log = log->next)
+    {
+        if (log->n) {   ref__log_apply_locked(log, REF_LOG_ALL);   }
+        REFEREE_WRITE_UNLOCK(&log->lock);
+    }
+}
+
+REFEREE_API void
+ref_flush(void)
+{
+    REFEREE_WRITE_LOCK(&ref__logs_lock);
+    ref__flush_locked();
+    REFEREE_WRITE_UNLOCK(&ref__logs_lock);
+}
+#endif // DEFERRED
+
+#if 1 // RECLAIM
+#if REFEREE_RECLAIM
+typedef struct RefReclaimBatch RefReclaimBatch;
+struct RefReclaimBatch {
+	RefReclaimBatch *next;
+	size_t           n;
+	void            *ptrs[Referee_Purge_Batch];
+};
+
+enum { Ref_Reclaim_Idle, Ref_Reclaim_Starting, Ref_Reclaim_Running };
+
+// frees every batch on ref's queue, oldest first
+// returns whether there were any
+static int
+ref__reclaim_drain(Referee *ref)
+{
+	size_t taken;
+	do {   taken = REFEREE_ATOMIC_LOAD(&ref->reclaim.queue);   } // (only ever pushed to or taken whole, so no ABA)
+	while (taken && ! REFEREE_ATOMIC_CAS(&ref->reclaim.queue, taken, 0));
+
+	RefReclaimBatch *oldest = 0;
+	for (RefReclaimBatch *batch = (RefReclaimBatch *)taken, *next; batch; batch = next)
+	{   next = batch->next, batch->next = oldest, oldest = batch;   }
+	for (RefReclaimBatch *batch = oldest, *next; batch; batch = next)
+	{
+		next = batch->next;
+		for (size_t i = 0; i < batch->n; ++i)
+		{
+			if (ref->free) { ref->free(ref->allocator, batch->ptrs[i]); }
+			else           { REFEREE_FREE(ref->allocator, batch->ptrs[i]); }
+		}
+		free(batch);
+	}
+	return !! taken;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+#else
+static void *
+#endif
+ref__reclaim_thread(void *arg)
+{
+	Referee    *ref     = (Referee *)arg;
+	RefReclaim *reclaim = &ref->reclaim;
+	for (;;)
+	{
+		if (ref__reclaim_drain(ref))               {   continue;   }
+		if (REFEREE_ATOMIC_LOAD(&reclaim->stop)) {   break;      }
+#ifdef _WIN32
+		WaitForSingleObject(reclaim->wake, INFINITE);
+#else
+		// (pushes/stop are signalled holding wake_lock, so nothing's missed between the check and the wait)
+		pthread_mutex_lock(&reclaim->wake_lock);
+		while (! REFEREE_ATOMIC_LOAD(&reclaim->queue) && ! REFEREE_ATOMIC_LOAD(&reclaim->stop))
+		{   pthread_cond_wait(&reclaim->wake, &reclaim->wake_lock);   }
+		pthread_mutex_unlock(&reclaim->wake_lock);
+#endif
+	}
+	return 0;
+}
+
+// wakes ref's reclaimer thread up if it's blocked
+// call with reclaim->flush_lock held, and reclaim->state Running
+static void
+ref__reclaim_signal(RefReclaim *reclaim)
+{
+#ifdef _WIN32
+	SetEvent(reclaim->wake);
+#else
+	pthread_mutex_lock(&reclaim->wake_lock);
+	pthread_cond_signal(&reclaim->wake);
+	pthread_mutex_unlock(&reclaim->wake_lock);
+#endif
+}
+
+// makes/releases what ref's reclaimer thread blocks on
+// returns whether that could be made
+static int
+ref__reclaim_wake_init(RefReclaim *reclaim)
+{
+#ifdef _WIN32
+	return !! (reclaim->wake = CreateEvent(0, FALSE, FALSE, 0));
+#else
+	if (pthread_mutex_init(&reclaim->wake_lock, 0)) {   return 0;   }
+	if (pthread_cond_init(&reclaim->wake, 0))       {   pthread_mutex_destroy(&reclaim->wake_lock); return 0;   }
+	return 1;
+#endif
+}
+static void
+ref__reclaim_wake_release(RefReclaim *reclaim)
+{
+#ifdef _WIN32
+	CloseHandle(reclaim->wake);
+#else
+	pthread_cond_destroy(&reclaim->wake);
+	pthread_mutex_destroy(&reclaim->wake_lock);
+#endif
+}
+
+// hands a purge's batch of unlinked ptrs over to ref's reclaimer thread, starting it if need be
+// (frees them here if that can't be done)
+static void
+ref__reclaim_push(Referee *ref, void *const *ptrs, size_t ptrs_n)
+{
+	RefReclaim      *reclaim = &ref->reclaim;
+	RefReclaimBatch *batch   = (RefReclaimBatch *)malloc(sizeof(*batch));
+	if (! batch)
+	{
+		for (size_t i = 0; i < ptrs_n; ++i)
+		{
+			if (ref->free) { ref->free(ref->allocator, ptrs[i]); }
+			else           { REFEREE_FREE(ref->allocator, ptrs[i]); }
+		}
+		return;
+	}
+	batch->n = ptrs_n;
+	memcpy(batch->ptrs, ptrs, ptrs_n * sizeof(*ptrs));
+	size_t head;
+	do {
+		head        = REFEREE_ATOMIC_LOAD(&reclaim->queue);
+		batch->next = (RefReclaimBatch *)head;
+	} while (! REFEREE_ATOMIC_CAS(&reclaim->queue, head, (size_t)batch));
+
+	if (REFEREE_ATOMIC_LOAD(&reclaim->state) == Ref_Reclaim_Idle &&
+	    REFEREE_ATOMIC_CAS(&reclaim->state, Ref_Reclaim_Idle, Ref_Reclaim_Starting))
+	{ // (the new thread drains the queue before it first blocks, so needs no signal)
+		int has_wake = ref__reclaim_wake_init(reclaim);
+#ifdef _WIN32
+		int started  = has_wake && !! (reclaim->thread = CreateThread(0, 0, ref__reclaim_thread, ref, 0, 0));
+#else
+		int started  = has_wake && ! pthread_create(&reclaim->thread, 0, ref__reclaim_thread, ref);
+#endif
+		if (has_wake && ! started) {   ref__reclaim_wake_release(reclaim);   }
+		REFEREE_ATOMIC_STORE(&reclaim->state, started ? Ref_Reclaim_Running : Ref_Reclaim_Idle);
+		if (! started) {   ref__reclaim_drain(ref);   }
+		return;
+	}
+
+	REFEREE_HANDLES_READ_LOCK(&reclaim->flush_lock); // (so that the thread isn't joined/released meanwhile)
+	size_t state;
+	while ((state = REFEREE_ATOMIC_LOAD(&reclaim->state)) == Ref_Reclaim_Starting) {   REFEREE_YIELD();   }
+	if (state == Ref_Reclaim_Running) {   ref__reclaim_signal(reclaim);   }
+	REFEREE_HANDLES_READ_UNLOCK(&reclaim->flush_lock);
+	// (if it's Idle, the thread was stopped after this batch was pushed, and ref_reclaim_flush's own
+	// drain frees it)
+}
+#endif//REFEREE_RECLAIM
+
+// frees a purge's batch of unlinked ptrs (or with REFEREE_RECLAIM, has them freed)
+static void
+ref__purge_free(Referee *ref, void *const *ptrs, size_t ptrs_n)
+{
+	if (! ptrs_n) {   return;   }
+#if REFEREE_RECLAIM
+	ref__reclaim_push(ref, ptrs, ptrs_n);
+#else
+	for (size_t i = 0; i < ptrs_n; ++i)
+	{
+		if (ref->free) { ref->free(ref->allocator, ptrs[i]); }
+		else           { REFEREE_FREE(ref->allocator, ptrs[i]); }
+	}
+#endif
+}
+
+REFEREE_API void
+ref_reclaim_flush(Referee *ref)
+{
+#if REFEREE_RECLAIM
+	if (! ref) {   return;   }
+	RefReclaim *reclaim = &ref->reclaim;
+	REFEREE_WRITE_LOCK(&reclaim->flush_lock);
+	size_t state;
+	while ((state = REFEREE_ATOMIC_LOAD(&reclaim->state)) == Ref_Reclaim_Starting) {   REFEREE_YIELD();   }
+	if (state == Ref_Reclaim_Running)
+	{
+		REFEREE_ATOMIC_STORE(&reclaim->stop, 1);
+		ref__reclaim_signal(reclaim);
+# ifdef _WIN32
+		WaitForSingleObject(reclaim->thread, INFINITE);
+		CloseHandle(reclaim->thread);
+# else
+		pthread_join(reclaim->thread, 0);
+# endif
+		ref__reclaim_wake_release(reclaim);
+		REFEREE_ATOMIC_STORE(&reclaim->stop,  0);
+		REFEREE_ATOMIC_STORE(&reclaim->state, Ref_Reclaim_Idle);
+	}
+	ref__reclaim_drain(ref); // anything pushed after the thread's last look
+	REFEREE_WRITE_UNLOCK(&reclaim->flush_lock);
+#else
+	(void)ref;
+#endif
+}
+#endif // RECLAIM
+
+#if 1 // HANDLES
+// the live slot that handle refers to, or 0 if it's stale
+// call holding at least the table's read lock
+static inline RefHandleSlot *
+ref__handle_slot(RefHandles *handles, RefHandle handle)
+{
+    uint32_t       slot_i = handle & Referee_Handle_Index_Mask;
+    RefHandleSlot *slot   = slot_i < handles->used ? &handles->slots[slot_i] : 0;
+    return (slot && slot->ptr && slot->gen == handle >> Referee_Handle_Index_Bits
+            ? slot
+            : 0);
+}
+
+// frees up the slot, returning the ptr that was in it (for the caller to free)
+// call holding the table's write lock
+static void *
+ref__handle_release_locked(Referee *ref, uint32_t slot_i)
+{
+    RefHandles    *handles = &ref->handles;
+    RefHandleSlot *slot    = &handles->slots[slot_i];
+    void          *ptr     = slot->ptr;
+    if (~slot->info.zero_i) {   ref__zeros_unlink(&handles->zeros, slot->info.zero_i);   }
+    ref__dropped(ref, 0, &slot->info, REFEREE_COLD(&handles->callsites[slot_i]), 1);
+    slot->ptr         = 0;
+    slot->gen         = (slot->gen + 1) & Referee_Handle_Gen_Mask;
+    if (! slot->gen) {   return ptr;   } // retired: wrapping around would let its stale handles back in
+    slot->next_free   = 0;
+    if (handles->free_tail) {   handles->slots[handles->free_tail - 1].next_free = slot_i + 1;   }
+    else                    {   handles->free_head                             = slot_i + 1;   }
+    handles->free_tail = slot_i + 1;
+    return ptr;
+}
+
+// as ref__zeros_sync_read_locked, for a handle
+static void
+ref__handle_sync_read_locked(RefHandles *handles, RefHandle handle, RefHandleSlot *slot)
+{
+#if REFEREE_THREADS
+    REFEREE_HANDLES_READ_UNLOCK(&handles->lock);
+    REFEREE_WRITE_LOCK(&handles->lock);
+    slot = ref__handle_slot(handles, handle);
+    if (slot) {   ref__zeros_sync(&handles->zeros, (void *)(uintptr_t)(handle & Referee_Handle_Index_Mask), &slot->info);   }
+    REFEREE_WRITE_UNLOCK(&handles->lock);
+#else
+    ref__zeros_sync(&handles->zeros, (void *)(uintptr_t)(handle & Referee_Handle_Index_Mask), &slot->info);
+#endif
+}
+
+REFEREE_API RefHandle
+REF_DBG(ref_new_h, Referee *ref, size_t alloc_size, size_t init_refs)
+{
+    if (! ref) { return 0; }
+    if (! ref->realloc || ! ref->free) { ref_set_default_allocator(ref); }
+
+    void *ptr = ref->realloc(ref->allocator, 0, 1, alloc_size);
+    if (! ptr) { return 0; }
+
+    RefHandles *handles = &ref->handles;
+    RefHandle   result  = 0;
+    REFEREE_WRITE_LOCK(&handles->lock);
+
+    uint32_t slot_i = handles->free_head - 1;
+    if (handles->free_head)
+    {
+        handles->free_head = handles->slots[slot_i].next_free;
+        if (! handles->free_head) {   handles->free_tail = 0;   }
+    }
+    else if (handles->used <= Referee_Handle_Index_Mask)
+    { // no free slots, take one from the end of the table
+        if (handles->used == handles->max)
+        {
+            uint32_t       new_max   = handles->max ? 2 * handles->max : 64;
+            RefHandleSlot *new_slots = (RefHandleSlot *)realloc(handles->slots, new_max * sizeof(*new_slots));
+            if (! new_slots) {   goto done;   }
+            handles->slots = new_slots;
+#if REFEREE_DEBUG && REFEREE_COMPACT_INFO
+            uint32_t *new_callsites = (uint32_t *)realloc(handles->callsites, new_max * sizeof(*new_callsites));
+            if (! new_callsites) {   goto done;   }
+            handles->callsites = new_callsites;
+#endif
+            handles->max   = new_max;
+        }
+        slot_i = handles->used++;
+        handles->slots[slot_i].gen = 1; // (so that no live handle is ever 0)
+    }
+    else {   goto done;   } // every index is in use
+
+    RefHandleSlot *slot = &handles->slots[slot_i];
+    RefInfo        info = {0};
+    info.refcount = ref__count_clamp(init_refs);
+    ref__info_set_size(&info, 1, alloc_size);
+    info.zero_i   = (init_refs ? REFEREE_INVALID
+                               : ref__zeros_push(&handles->zeros, (void *)(uintptr_t)slot_i, ref__info_size(&info)));
+#if REFEREE_DEBUG
+    uint32_t callsite = ref__callsite_intern((size_t)line, file, func, call);
+# if REFEREE_COMPACT_INFO
+    handles->callsites[slot_i] = callsite;
+# else
+    info.callsite = callsite;
+# endif
+#endif//REFEREE_DEBUG
+    ref__tracked(ref, 0, &info, REFEREE_COLD(&callsite), 1);
+    slot->ptr  = ptr;
+    slot->info = info;
+    result     = (RefHandle)slot->gen << Referee_Handle_Index_Bits | slot_i;
+
+done:
+    REFEREE_WRITE_UNLOCK(&handles->lock);
+    if (! result) {   ref->free(ref->allocator, ptr);   }
+    return result;
+}
+
+REFEREE_API void *
+ref_inc_h(Referee *ref, RefHandle handle)
+{
+    if (! ref) { return 0; }
+
+    RefHandles *handles = &ref->handles;
+    REFEREE_HANDLES_READ_LOCK(&handles->lock);
+    RefHandleSlot *slot = ref__handle_slot(handles, handle);
+    if (! slot) {   REFEREE_HANDLES_READ_UNLOCK(&handles->lock); return 0;   }
+
+    void *ptr = slot->ptr;
+    if (ref__count_add(&slot->info, 1) == 0) {   ref__handle_sync_read_locked(handles, handle, slot);   }
+    else                                     {   REFEREE_HANDLES_READ_UNLOCK(&handles->lock);         }
+    return ptr;
+}
+
+REFEREE_API void *
+ref_dec_h(Referee *ref, RefHandle handle)
+{
+    if (! ref) { return 0; }
+
+    RefHandles *handles = &ref->handles;
+    REFEREE_HANDLES_READ_LOCK(&handles->lock);
+    RefHandleSlot *slot = ref__handle_slot(handles, handle);
+    if (! slot) {   REFEREE_HANDLES_READ_UNLOCK(&handles->lock); return 0;   }
+
+    void  *ptr = slot->ptr;
+    size_t new_count,
+           old_count = ref__count_sub(&slot->info, 1, 0, &new_count);
+
+    if (old_count && ! new_count) {   ref__handle_sync_read_locked(handles, handle, slot);   }
+    else                          {   REFEREE_HANDLES_READ_UNLOCK(&handles->lock);         }
+    return ptr;
+}
+
+// NOTE: like ref_info, the block may be purged as soon as its count drops to 0
+REFEREE_API void *
+ref_get_h(Referee *ref, RefHandle handle)
+{
+    if (! ref) { return 0; }
+
+    RefHandles *handles = &ref->handles;
+    REFEREE_HANDLES_READ_LOCK(&handles->lock);
+    RefHandleSlot *slot   = ref__handle_slot(handles, handle);
+    void          *result = slot ? slot->ptr : 0;
+    REFEREE_HANDLES_READ_UNLOCK(&handles->lock);
+    return result;
+}
+
+REFEREE_API size_t
+ref_count_h(Referee *ref, RefHandle handle)
+{
+    if (! ref) { return 0; }
+
+    RefHandles *handles = &ref->handles;
+    REFEREE_HANDLES_READ_LOCK(&handles->lock);
+    RefHandleSlot *slot   = ref__handle_slot(handles, handle);
+    size_t         result = slot ? REFEREE_ATOMIC_LOAD(&slot->info.refcount) : 0;
+    REFEREE_HANDLES_READ_UNLOCK(&handles->lock);
+    return result;
+}
+
+REFEREE_API int
+ref_free_h(Referee *ref, RefHandle handle)
+{
+    if (! ref) { return 0; }
+
+    RefHandles *handles = &ref->handles;
+    REFEREE_WRITE_LOCK(&handles->lock);
+    RefHandleSlot *slot = ref__handle_slot(handles, handle);
+    void          *ptr  = slot ? ref__handle_release_locked(ref, handle & Referee_Handle_Index_Mask) : 0;
+    REFEREE_WRITE_UNLOCK(&handles->lock);
+    if (! slot) {   return 0;   }
+    ref->free(ref->allocator, ptr);
+    return 1;
+}
+
+// ref__purge_shard for the handle table
+static size_t
+ref__handles_purge(Referee *ref, size_t max_n)
+{
+    RefHandles *handles   = &ref->handles;
+    size_t      deleted_n = 0;
+    void   *batch[Referee_Purge_Batch];
+    size_t  batch_n, batch_max;
+    do {
+        batch_n   = 0;
+        batch_max = max_n - deleted_n < Referee_Purge_Batch ? max_n - deleted_n : Referee_Purge_Batch;
+        REFEREE_WRITE_LOCK(&handles->lock);
+
+        if (handles->zeros.lost)
+        { // the zero list is incomplete, fall back to checking everything
+            for (uint32_t slot_i = 0; slot_i < handles->used && batch_n < batch_max; ++slot_i)
+            {
+                RefHandleSlot *slot = &handles->slots[slot_i];
+                if (slot->ptr && REFEREE_ATOMIC_LOAD(&slot->info.refcount) == 0)
+                {   batch[batch_n++] = ref__handle_release_locked(ref, slot_i);   }
+            }
+            if (batch_n < batch_max) {   handles->zeros.lost = 0;   }
+        }
+
+        while (handles->zeros.n && batch_n < batch_max)
+        {
+            void          *node_ptr = handles->zeros.nodes[handles->zeros.head].ptr;
+            uint32_t       slot_i   = (uint32_t)(uintptr_t)node_ptr;
+            RefHandleSlot *slot     = &handles->slots[slot_i];
+            if (REFEREE_ATOMIC_LOAD(&slot->info.refcount))
+            { // revived by an inc that hasn't synced the list yet
+                ref__zeros_sync(&handles->zeros, node_ptr, &slot->info);
+                continue;
+            }
+            batch[batch_n++] = ref__handle_release_locked(ref, slot_i);
+        }
+
+        REFEREE_WRITE_UNLOCK(&handles->lock);
+
+        ref__purge_free(ref, batch, batch_n);
+        deleted_n += batch_n;
+    } while (batch_n == batch_max && deleted_n < max_n);
+    return deleted_n;
+}
+#endif // HANDLES
+
+REFEREE_API void *
+ref_free(Referee *ref, void *ptr)
+{
+    ref__flush_ptr(ref, ptr);
+    void   *alloc = ptr;
+    RefInfo info  = ref__forget(ref, ptr, &alloc);
+    if (~ info.refcount)
+    {
+        assert(ref->free && "this should be set on initial allocation");
+        ref__finalize(ref, &ptr, 1);
+        /* __itt_heap_free_begin(0, ptr); */
+        ref->free(ref->allocator, alloc);
+        /* __itt_heap_free_end(0, ptr); */
+    }
+    return 0;
+}
+
+#if REFEREE_FINALIZERS
+REFEREE_API uint32_t
+ref_finalizer_type(Referee *ref, RefFinalizeFn *fn, void *user)
+{
+	if (! ref || ! fn) {   return 0;   }
+	RefFinalizers *finals = &ref->finals;
+	uint32_t       type   = 0;
+	REFEREE_WRITE_LOCK(&finals->lock);
+	for (size_t i = 1; i <= finals->types_n && ! type; ++i)
+	{   if (finals->types[i].fn == fn && finals->types[i].user == user) {   type = (uint32_t)i;   }   }
+	if (! type && finals->types_n < Referee_Finalizer_Types_N)
+	{
+		type = (uint32_t)++finals->types_n;
+		finals->types[type].fn   = fn;
+		finals->types[type].user = user;
+	}
+	REFEREE_WRITE_UNLOCK(&finals->lock);
+	return type;
+}
+
+REFEREE_API size_t
+ref_set_finalizer(Referee *ref, void *ptr, uint32_t type)
+{
+	if (! ref || ! ptr) {   return REFEREE_INVALID;   }
+	RefereeShard *shard = ref__shard(ref, ptr);
+	REFEREE_READ_LOCK(&shard->lock);
+	int is_tracked = !! ref__lookup(shard, ptr);
+	REFEREE_READ_UNLOCK(&shard->lock);
+
+	RefFinalizers *finals   = &ref->finals;
+	size_t         old_type = REFEREE_INVALID;
+	REFEREE_WRITE_LOCK(&finals->lock);
+	if (is_tracked && type <= finals->types_n)
+	{
+		old_type = ref__final_map_remove(&finals->blocks, ptr); // (0 if it had none)
+		if (type && ref__final_map_insert(&finals->blocks, ptr, (uint16_t)type) != MAP_absent)
+		{   old_type = REFEREE_INVALID;   } // out of memory
+	}
+	REFEREE_WRITE_UNLOCK(&finals->lock);
+	return old_type;
+}
+#else
+REFEREE_API uint32_t
+ref_finalizer_type(Referee *ref, RefFinalizeFn *fn, void *user)
+{   (void)ref, (void)fn, (void)user; return 0;   }
+
+REFEREE_API size_t
+ref_set_finalizer(Referee *ref, void *ptr, uint32_t type)
+{   (void)ref, (void)ptr, (void)type; return REFEREE_INVALID;   }
+#endif//REFEREE_FINALIZERS
+
+#if 1 // WEAK
+#if REFEREE_WEAK
+// frees ptr's weak slot (if it has one), so that its weak refs go stale
+// call holding ptr's shard's write lock, so that ref_upgrade can't see it half-gone
+static void
+ref__weak_drop(Referee *ref, void *ptr)
+{
+	RefWeaks *weaks = &ref->weaks;
+	REFEREE_WRITE_LOCK(&weaks->lock);
+	uint32_t slot_n = weaks->of.n ? ref__weak_map_remove(&weaks->of, ptr) : 0; // (index + 1, 0 if none)
+	if (slot_n)
+	{
+		RefWeakSlot *slot = &weaks->slots[slot_n - 1];
+		slot->ptr         = 0;
+		slot->gen        += 1;
+		if (! slot->gen) {   slot->gen = 1;   } // so that no weak ref is ever 0
+		slot->next_free   = weaks->free_head;
+		weaks->free_head  = slot_n;
+	}
+	REFEREE_WRITE_UNLOCK(&weaks->lock);
+}
+
+// keeps ptr's weak refs pointing at it as it moves
+static void
+ref__weak_move(Referee *ref, void *old_ptr, void *new_ptr)
+{
+	RefWeaks *weaks = &ref->weaks;
+	REFEREE_WRITE_LOCK(&weaks->lock);
+	uint32_t slot_n = weaks->of.n ? ref__weak_map_remove(&weaks->of, old_ptr) : 0;
+	if (slot_n)
+	{
+		weaks->slots[slot_n - 1].ptr = new_ptr;
+		ref__weak_map_insert(&weaks->of, new_ptr, slot_n); // (just freed up a place, so can't fail)
+	}
+	REFEREE_WRITE_UNLOCK(&weaks->lock);
+}
+
+REFEREE_API RefWeak
+ref_weak(Referee *ref, void *ptr)
+{
+	if (! ref || ! ptr) {   return 0;   }
+	RefereeShard *shard  = ref__shard(ref, ptr);
+	RefWeaks     *weaks  = &ref->weaks;
+	RefWeak       result = 0;
+	REFEREE_WRITE_LOCK(&shard->lock); // (so that ptr can't be dropped before its slot is found)
+	if (ref__lookup(shard, ptr))
+	{
+		REFEREE_WRITE_LOCK(&weaks->lock);
+		uint32_t *existing = ref__weak_map_ptr(&weaks->of, ptr),
+		          slot_n   = existing ? *existing : weaks->free_head;
+		if (! slot_n)
+		{ // no free slots, take one from the end of the table
+			if (weaks->used == weaks->max && weaks->max <= UINT32_MAX / 2)
+			{
+				uint32_t     new_max   = weaks->max ? 2 * weaks->max : 64;
+				RefWeakSlot *new_slots = (RefWeakSlot *)realloc(weaks->slots, new_max * sizeof(*new_slots));
+				if (new_slots) {   weaks->slots = new_slots, weaks->max = new_max;   }
+			}
+			if (weaks->used < weaks->max)
+			{
+				slot_n = ++weaks->used;
+				weaks->slots[slot_n - 1].gen = 1;
+				weaks->slots[slot_n - 1].ptr = 0;
+			}
+		}
+		else if (! existing) {   weaks->free_head = weaks->slots[slot_n - 1].next_free;   }
+
+		if (! existing && slot_n && ref__weak_map_insert(&weaks->of, ptr, slot_n) != MAP_absent)
+		{ // out of memory, put the slot back
+			weaks->slots[slot_n - 1].next_free = weaks->free_head;
+			weaks->free_head                   = slot_n;
+			slot_n                             = 0;
+		}
+		if (slot_n)
+		{
+			weaks->slots[slot_n - 1].ptr = ptr;
+			result = (RefWeak)weaks->slots[slot_n - 1].gen << 32 | slot_n;
+		}
+		REFEREE_WRITE_UNLOCK(&weaks->lock);
+	}
+	REFEREE_WRITE_UNLOCK(&shard->lock);
+	return result;
+}
+
+// the ptr in weak's slot, or 0 if it's stale
+// call holding the table's lock
+static void *
+ref__weak_ptr_locked(RefWeaks *weaks, RefWeak weak)
+{
+	uint32_t slot_n = (uint32_t)weak;
+	return (slot_n && slot_n <= weaks->used && weaks->slots[slot_n - 1].gen == (uint32_t)(weak >> 32)
+	        ? weaks->slots[slot_n - 1].ptr
+	        : 0);
+}
+
+REFEREE_API void *
+ref_upgrade(Referee *ref, RefWeak weak)
+{
+	if (! ref) {   return 0;   }
+	RefWeaks *weaks = &ref->weaks;
+	REFEREE_WRITE_LOCK(&weaks->lock);
+	void *ptr = ref__weak_ptr_locked(weaks, weak);
+	REFEREE_WRITE_UNLOCK(&weaks->lock);
+	if (! ptr) {   return 0;   }
+
+	// ptr can only be dropped under its shard's lock, so once that's held, if weak is still live
+	// then ptr is still the same block
+	RefereeShard *shard = ref__shard(ref, ptr);
+	RefInfo      *info  = 0;
+	REFEREE_WRITE_LOCK(&shard->lock);
+	REFEREE_WRITE_LOCK(&weaks->lock);
+	int is_live = ref__weak_ptr_locked(weaks, weak) == ptr;
+	REFEREE_WRITE_UNLOCK(&weaks->lock);
+	if (is_live && (info = ref__lookup(shard, ptr)))
+	{
+		ref__count_add(info, 1);
+		ref__zeros_sync(&shard->zeros, ptr, info);
+	}
+	REFEREE_WRITE_UNLOCK(&shard->lock);
+	return info ? ptr : 0;
+}
+#else
+static void ref__weak_drop(Referee *ref, void *ptr)                  {   (void)ref, (void)ptr;                  }
+static void ref__weak_move(Referee *ref, void *old_ptr, void *new_ptr) {   (void)ref, (void)old_ptr, (void)new_ptr; }
+
+REFEREE_API RefWeak
+ref_weak(Referee *ref, void *ptr)
+{   (void)ref, (void)ptr; return 0;   }
+
+REFEREE_API void *
+ref_upgrade(Referee *ref, RefWeak weak)
+{   (void)ref, (void)weak; return 0;   }
+#endif//REFEREE_WEAK
+#endif // WEAK
+
+REFEREE_API size_t
+ref_recount(Referee *ref, void *ptr, size_t new_count)
+{
+    if (! ref || ! ptr) { return REFEREE_INVALID; }
+
+    ref__flush_ptr(ref, ptr); // so that earlier changes aren't applied on top of the new count
+    RefereeShard *shard     = ref__shard(ref, ptr);
+    size_t        old_count = REFEREE_INVALID;
+    REFEREE_WRITE_LOCK(&shard->lock);
+    RefInfo *info = ref__lookup(shard, ptr);
+    if (info)
+    {
+        old_count      = info->refcount;
+        info->refcount = ref__count_clamp(new_count);
+        ref__zeros_sync(&shard->zeros, ptr, info);
+    }
+    REFEREE_WRITE_UNLOCK(&shard->lock);
+    return old_count;
+}
+
+// how far ref__budget_make_room has ref__purge_shard go
+typedef struct RefPurgeLimit {
+	size_t max_bytes;   // stop once at least this much has been freed
+	size_t before_tick; // only ptrs whose count reached 0 before this (see RefZeroNode)
+} RefPurgeLimit;
+
+// frees up to max_n of shard's zero-count ptrs, oldest first, a batch at a time (so that the lock
+// isn't held while they're actually freed)
+// limit: for eviction, or 0 for a purge (only a purge's ptrs are recycled)
+// returns the number freed
+static size_t
+ref__purge_shard(Referee *ref, RefereeShard *shard, size_t max_n, RefPurgeLimit const *limit)
+{
+	size_t  deleted_n   = 0,
+	        freed_bytes = 0, // (as counted by live_bytes)
+	        max_bytes   = limit ? limit->max_bytes : REFEREE_INVALID;
+	int     limited     = 0;
+	void   *batch[Referee_Purge_Batch],
+	       *users[Referee_Purge_Batch]; // the ptrs as given out, for finalizers (batch has headers)
+	size_t  sizes[Referee_Purge_Batch], // of each allocation in batch, for REFEREE_RECYCLE
+	        batch_n, batch_max;
+	do {
+		batch_n   = 0;
+		batch_max = max_n - deleted_n < Referee_Purge_Batch ? max_n - deleted_n : Referee_Purge_Batch;
+		REFEREE_WRITE_LOCK(&shard->lock);
+
+		if (shard->zeros.lost)
+		{ // the zero list is incomplete, fall back to checking everything
+			// backwards so that the end-swap on removal only moves already-checked entries
+			for(size_t i = shard->ptr_infos.n; i-- && batch_n < batch_max && freed_bytes < max_bytes;)
+			{
+				void    *ptr  = 0;
+				RefInfo *info = ref__map_at(&shard->ptr_infos, i, &ptr);
+				if (info && REFEREE_ATOMIC_LOAD(&info->refcount) == 0 && ref__claim_for_purge(info))
+				{
+					sizes[batch_n]   = ref__info_size(info);
+					freed_bytes     += sizes[batch_n];
+					ref__forget_locked(ref, shard, ptr, 1);
+					users[batch_n]   = ptr;
+					batch[batch_n++] = ptr;
+				}
+			}
+			for(RefHeader *header = shard->headers, *next; header && batch_n < batch_max && freed_bytes < max_bytes; header = next)
+			{
+				next = header->next;
+				if (REFEREE_ATOMIC_LOAD(&header->info.refcount) == 0 && ref__claim_for_purge(&header->info))
+				{
+					sizes[batch_n]   = REFEREE_HEADER_SIZE + ref__info_size(&header->info);
+					freed_bytes     += ref__info_size(&header->info);
+					ref__forget_header_locked(ref, shard, header, 1);
+					users[batch_n]   = (char *)header + REFEREE_HEADER_SIZE;
+					batch[batch_n++] = header;
+				}
+			}
+			if (batch_n < batch_max && freed_bytes < max_bytes) {   shard->zeros.lost = 0;   }
+		}
+
+		while (shard->zeros.n && batch_n < batch_max)
+		{ // only the zero-count ptrs are touched, oldest first
+			size_t     zero_i = shard->zeros.head;
+#if REFEREE_BUDGET
+			if (limit && shard->zeros.nodes[zero_i].tick >= limit->before_tick) {   limited = 1;   }
+#endif
+			if (freed_bytes >= max_bytes) {   limited = 1;   }
+			if (limited) {   break;   }
+			void      *ptr    = shard->zeros.nodes[zero_i].ptr;
+			RefHeader *header = ref__header(shard, ptr);
+#if REFEREE_THREADS
+			RefInfo *live = header ? &header->info : ref__map_ptr(&shard->ptr_infos, ptr);
+			if (live && ! ref__claim_for_purge(live))
+			{ // revived by an inc that hasn't synced the list yet
+				ref__zeros_sync(&shard->zeros, ptr, live);
+				continue;
+			}
+#endif//REFEREE_THREADS
+			RefInfo info = (header
+			                ? ref__forget_header_locked(ref, shard, header, 1)
+			                : ref__forget_locked(ref, shard, ptr, 1));
+			if (info.zero_i != zero_i)
+			{ // shouldn't happen, but don't spin on a node that isn't attached to ptr's info
+				assert(! "zero list out of sync with ptr_infos");
+				ref__zeros_unlink(&shard->zeros, zero_i);
+				continue;
+			}
+			sizes[batch_n]   = (header ? REFEREE_HEADER_SIZE : 0) + ref__info_size(&info);
+			freed_bytes     += ref__info_size(&info);
+			users[batch_n]   = ptr;
+			batch[batch_n++] = header ? (void *)header : ptr;
+		}
+
+		REFEREE_WRITE_UNLOCK(&shard->lock);
+
+		ref__finalize(ref, users, batch_n);
+		ref__purge_free(ref, batch, limit ? batch_n : ref__recycle_put(ref, batch, sizes, batch_n));
+		deleted_n += batch_n;
+	} while (batch_n == batch_max && deleted_n < max_n && ! limited);
+	return deleted_n;
+}
+
+#if defined(_WIN32)
+# include <windows.h>
+static uint64_t
+ref__now_ns(void)
+{
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+}
+#else
+# include <time.h>
+static uint64_t
+ref__now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+#endif
+
+// frees between checks of the time in ref_purge_step (a clock read costs about as much as a free)
+#define Referee_Purge_Step_Batch 16
+
+REFEREE_API size_t
+ref_purge_step(Referee *ref, size_t max_blocks, uint64_t max_ns, size_t *garbage_left_out)
+{
+	size_t deleted_n = 0;
+	if(! ref) { return REFEREE_INVALID; }
+#if REFEREE_DEFERRED
+	ref_flush();
+#endif
+
+	uint64_t deadline = max_ns ? ref__now_ns() + max_ns : 0;
+	size_t   left     = max_blocks ? max_blocks : REFEREE_INVALID,
+	         at       = REFEREE_ATOMIC_LOAD(&ref->purge_at) % (REFEREE_SHARD_N + 1);
+	for (size_t visited = 0; visited <= REFEREE_SHARD_N && left; )
+	{ // round the shards (then the handles) from wherever the last call stopped
+		size_t chunk = deadline && left > Referee_Purge_Step_Batch ? Referee_Purge_Step_Batch : left,
+		       n     = (at < REFEREE_SHARD_N
+		                ? ref__purge_shard(ref, &ref->shards[at], chunk, 0)
+		                : ref__handles_purge(ref, chunk));
+		deleted_n += n;
+		left      -= n;
+		if (n < chunk) {   at = (at + 1) % (REFEREE_SHARD_N + 1); ++visited;   } // nothing left in this one
+		if (n && deadline && ref__now_ns() >= deadline) {   break;   } // (empty shards are cheap to skip)
+	}
+	REFEREE_ATOMIC_STORE(&ref->purge_at, at);
+
+	if (garbage_left_out)
+	{
+		size_t garbage_n = 0; // (the zero lists are only safe to read under the write lock)
+		for (size_t shard_i = 0; shard_i < REFEREE_SHARD_N; ++shard_i)
+		{
+			REFEREE_WRITE_LOCK(&ref->shards[shard_i].lock);
+			garbage_n += ref->shards[shard_i].zeros.n;
+			REFEREE_WRITE_UNLOCK(&ref->shards[shard_i].lock);
+		}
+		REFEREE_WRITE_LOCK(&ref->handles.lock);
+		garbage_n += ref->handles.zeros.n;
+		REFEREE_WRITE_UNLOCK(&ref->handles.lock);
+		*garbage_left_out = garbage_n;
+	}
+	return deleted_n;
+}
+
+// clear all that have a refcount of 0
+REFEREE_API size_t 
+ref_purge(Referee *ref)
+{
+	size_t deleted_n = 0, finalized_n;
+	if(! ref) { return REFEREE_INVALID; }
+	do { // again if finalizers ran, as they may have dec'd blocks (in shards already done) to 0
+#if REFEREE_DEFERRED
+		ref_flush();
+#endif
+		finalized_n = ref__finalized_n(ref);
+		for (size_t shard_i = 0; shard_i < REFEREE_SHARD_N; ++shard_i)
+		{   deleted_n += ref__purge_shard(ref, &ref->shards[shard_i], REFEREE_INVALID, 0);   }
+		deleted_n += ref__handles_purge(ref, REFEREE_INVALID);
+	} while (ref__finalized_n(ref) != finalized_n);
+	return deleted_n;
+}
+
+#if 1 // BUDGET
+#if REFEREE_BUDGET
+// REFEREE_INVALID if there's nothing in zeros
+static size_t
+ref__zeros_oldest_tick(RefZeroList const *zeros)
+{
+	return (zeros->lost ? 0 // (the order is unknown, so it goes first)
+	        : zeros->n  ? zeros->nodes[zeros->head].tick
+	        :             REFEREE_INVALID);
+}
+#endif
+
+// frees zero-count ptrs, least recently zeroed first, until new_bytes fit in ref's budget
+// old_ptr: the ptr that new_bytes will replace (so isn't evicted, and its size is made room for already)
+static void
+ref__budget_make_room(Referee *ref, void *old_ptr, size_t new_bytes)
+{
+#if REFEREE_BUDGET
+	size_t budget = REFEREE_ATOMIC_LOAD(&ref->budget);
+	if (! budget) {   return;   }
+
+	int pinned = old_ptr && ref__inc_c_now(ref, old_ptr, 1);
+	if (pinned)
+	{
+		RefereeShard *shard = ref__shard(ref, old_ptr);
+		REFEREE_READ_LOCK(&shard->lock);
+		RefInfo *info      = ref__lookup(shard, old_ptr);
+		size_t   old_bytes = info ? ref__info_size(info) : 0;
+		REFEREE_READ_UNLOCK(&shard->lock);
+		new_bytes = new_bytes > old_bytes ? new_bytes - old_bytes : 0;
+	}
+# if REFEREE_DEFERRED
+	int flushed = 0;
+# endif
+	for (;;)
+	{
+		size_t used = REFEREE_ATOMIC_LOAD(&ref->stats.live_bytes);
+# if REFEREE_RECYCLE
+		size_t recycled = REFEREE_ATOMIC_LOAD(&ref->recycle.bytes);
+		used += recycled;
+# endif
+		if (used + new_bytes <= budget) {   break;   }
+		size_t over = used + new_bytes - budget;
+# if REFEREE_DEFERRED
+		if (! flushed++) {   ref_flush(); continue;   } // (as ref_purge does, for both logged incs and decs)
+# endif
+# if REFEREE_RECYCLE
+		if (recycled && ref_recycle_trim(ref, recycled > over ? recycled - over : 0)) {   continue;   } // (already garbage)
+# endif
+
+		// the zero list with the oldest head is evicted from, until it gets to the next oldest's head
+		size_t oldest = REFEREE_INVALID, next = REFEREE_INVALID, oldest_i = REFEREE_INVALID;
+		for (size_t list_i = 0; list_i <= REFEREE_SHARD_N; ++list_i)
+		{ // (REFEREE_SHARD_N for the handles)
+			size_t tick;
+			if (list_i < REFEREE_SHARD_N)
+			{
+				RefereeShard *shard = &ref->shards[list_i];
+				REFEREE_WRITE_LOCK(&shard->lock);
+				tick = ref__zeros_oldest_tick(&shard->zeros);
+				REFEREE_WRITE_UNLOCK(&shard->lock);
+			}
+			else
+			{
+				REFEREE_WRITE_LOCK(&ref->handles.lock);
+				tick = ref__zeros_oldest_tick(&ref->handles.zeros);
+				REFEREE_WRITE_UNLOCK(&ref->handles.lock);
+			}
+			if      (tick < oldest) {   next = oldest; oldest = tick; oldest_i = list_i;   }
+			else if (tick < next)   {   next = tick;   }
+		}
+		if (oldest_i == REFEREE_INVALID) {   break;   } // nothing left to evict
+
+		RefPurgeLimit limit = { over, next };
+		if (! (oldest_i < REFEREE_SHARD_N
+		       ? ref__purge_shard(ref, &ref->shards[oldest_i], REFEREE_INVALID, &limit)
+		       : ref__handles_purge(ref, 1)))
+		{   break;   } // lost a race for it (with threads)
+	}
+	if (pinned) {   ref__dec_c_now(ref, old_ptr, 1);   }
+#else
+	(void)ref, (void)old_ptr, (void)new_bytes;
+#endif
+}
+
+REFEREE_API size_t
+ref_set_budget(Referee *ref, size_t bytes)
+{
+#if REFEREE_BUDGET
+	if (! ref) {   return REFEREE_INVALID;   }
+	size_t old_bytes = REFEREE_ATOMIC_LOAD(&ref->budget);
+	REFEREE_ATOMIC_STORE(&ref->budget, bytes);
+	return old_bytes;
+#else
+	(void)ref, (void)bytes;
+	return REFEREE_INVALID;
+#endif
+}
+#endif // BUDGET
+
+REFEREE_API size_t
+ref_reset(Referee *ref)
+{
+	if (! ref) { return REFEREE_INVALID; }
+
+#if REFEREE_DEFERRED
+	ref_flush(); // (so that nothing is applied to a later ptr at the same address)
+#endif
+	ref_reclaim_flush(ref); // (so that nothing's freed after e.g. an arena is reset)
+#if REFEREE_FINALIZERS
+	REFEREE_WRITE_LOCK(&ref->finals.lock);
+	ref__final_map_clear(&ref->finals.blocks); // (finalizers aren't run)
+	REFEREE_WRITE_UNLOCK(&ref->finals.lock);
+#endif
+	size_t dropped_n = 0;
+	int    is_arena  = ref->free == ref_arena_free;
+#if REFEREE_RECYCLE
+	if (is_arena)
+	{ // (freed with the rest of the arena)
+		REFEREE_WRITE_LOCK(&ref->recycle.lock);
+		ref__recycle_map_clear(&ref->recycle.buckets);
+		REFEREE_ATOMIC_STORE(&ref->recycle.bytes, 0);
+		REFEREE_WRITE_UNLOCK(&ref->recycle.lock);
+	}
+	else {   ref_recycle_trim(ref, 0);   }
+#endif
+	for (size_t shard_i = 0; shard_i < REFEREE_SHARD_N; ++shard_i)
+	{
+		RefereeShard *shard = &ref->shards[shard_i];
+		REFEREE_WRITE_LOCK(&shard->lock);
+		for(size_t i = 0,
+				   n = shard->ptr_infos.n;
+			i < n; ++i)
+		{
+			void    *ptr  = 0;
+			RefInfo *info = ref__map_at(&shard->ptr_infos, i, &ptr);
+			if (! info) {   continue;   }
+			ref__dropped(ref, ptr, info, REFEREE_COLD(ref__map_cold_at(&shard->ptr_infos, i)), 1);
+			if (! is_arena)
+			{
+				if (ref->free) { ref->free(ref->allocator, ptr); }
+				else           { REFEREE_FREE(ref->allocator, ptr); }
+			}
+			++dropped_n;
+		}
+		for(RefHeader *header = shard->headers, *next; header; header = next)
+		{
+			next        = header->next;
+			header->tag = 0;
+#if REFEREE_HEADERS
+			ref__header_pages_add((char *)header + REFEREE_HEADER_SIZE, REFEREE_INVALID);
+#endif
+			ref__dropped(ref, (char *)header + REFEREE_HEADER_SIZE, &header->info, REFEREE_COLD(&header->callsite), 1);
+			if (! is_arena) {   ref->free(ref->allocator, header);   } // (only made by ref_new, so free is set)
+			++dropped_n;
+		}
+		shard->headers = 0;
+		ref__map_clear(&shard->ptr_infos);
+
+		RefZeroList *zeros = &shard->zeros;
+		if (zeros->max)
+		{
+			zeros->head = zeros->tail = zeros->unused = REFEREE_INVALID;
+			zeros->used = zeros->n = 0;
+		}
+		REFEREE_ATOMIC_STORE(&zeros->bytes, 0);
+		zeros->lost = 0;
+		REFEREE_WRITE_UNLOCK(&shard->lock);
+	}
+
+	RefHandles *handles = &ref->handles;
+	REFEREE_WRITE_LOCK(&handles->lock);
+	for (uint32_t slot_i = 0; slot_i < handles->used; ++slot_i)
+	{
+		if (! handles->slots[slot_i].ptr) {   continue;   }
+		void *ptr = ref__handle_release_locked(ref, slot_i); // (so that its handles go stale)
+		if (! is_arena) {   ref->free(ref->allocator, ptr);   }
+		++dropped_n;
+	}
+	handles->zeros.lost = 0;
+	REFEREE_WRITE_UNLOCK(&handles->lock);
+
+#if REFEREE_CYCLES
+	REFEREE_WRITE_LOCK(&ref->cycles.lock);
+	ref__cycle_roots_clear(&ref->cycles.roots);
+	REFEREE_WRITE_UNLOCK(&ref->cycles.lock);
+#endif
+
+	if (is_arena) {   ref_arena_reset((RefArena *)ref->allocator);   }
+	return dropped_n;
+}
+
+#if 1 // CYCLES
+// Trial deletion (after Bacon & Rajan), on scratch counts so that the real ones are left alone:
+// - mark gray: from each root, every reachable block is marked gray and has 1 taken off its scratch
+//   count (which starts as its real count) for each reference to it from a gray block
+// - scan: a gray block whose count is still above 0 is held from outside the graph, so it and
+//   everything reachable from it is marked black again, restoring the counts taken off
+// - collect: what's still gray is only held by garbage
+#if REFEREE_CYCLES
+// passed to the visit functions
+typedef struct RefCycleStep {
+	Referee   *ref;
+	RefCycles *cycles;
+	int        failed; // ran out of memory
+} RefCycleStep;
+
+static void
+ref__cycle_push(RefCycleStep *step, void *ptr)
+{
+	RefCycles *cycles = step->cycles;
+	if (cycles->stack_n == cycles->stack_max)
+	{
+		size_t new_max   = cycles->stack_max ? 2 * cycles->stack_max : 256;
+		void **new_stack = (void **)realloc(cycles->stack, new_max * sizeof(*new_stack));
+		if (! new_stack) {   step->failed = 1; return;   }
+		cycles->stack     = new_stack;
+		cycles->stack_max = new_max;
+	}
+	cycles->stack[cycles->stack_n++] = ptr;
+}
+
+// the node for ptr, added (black, with ptr's real count) the first time it's reached
+// returns NULL if ptr isn't tracked, or has a count of 0
+static RefCycleNode *
+ref__cycle_node(RefCycleStep *step, void *ptr)
+{
+	RefCycleNode *node = ref__cycle_nodes_ptr(&step->cycles->nodes, ptr);
+	if (node || ! ptr) {   return node;   }
+
+	RefereeShard *shard = ref__shard(step->ref, ptr);
+	REFEREE_READ_LOCK(&shard->lock);
+	RefInfo *info  = ref__lookup(shard, ptr);
+	size_t   count = info ? REFEREE_ATOMIC_LOAD(&info->refcount) : 0;
+	REFEREE_READ_UNLOCK(&shard->lock);
+	if (! info || ! count || (count & REFEREE_DEAD)) {   return 0;   } // (0s are already garbage, left to ref_purge)
+
+	RefCycleNode new_node = { (int64_t)count, Ref_Cycle_Black };
+	if (ref__cycle_nodes_insert(&step->cycles->nodes, ptr, new_node) != MAP_absent) {   step->failed = 1; return 0;   }
+	return ref__cycle_nodes_ptr(&step->cycles->nodes, ptr);
+}
+
+static void
+ref__cycle_visit_gray(void *ctx, void *child)
+{
+	RefCycleStep *step = (RefCycleStep *)ctx;
+	RefCycleNode *node = ref__cycle_node(step, child);
+	if (! node) {   return;   }
+	--node->count;
+	if (node->color != Ref_Cycle_Gray) {   node->color = Ref_Cycle_Gray; ref__cycle_push(step, child);   }
+}
+
+static void
+ref__cycle_visit_black(void *ctx, void *child)
+{
+	RefCycleStep *step = (RefCycleStep *)ctx;
+	RefCycleNode *node = ref__cycle_nodes_ptr(&step->cycles->nodes, child); // (every child of a gray block has one)
+	if (! node) {   return;   }
+	++node->count;
+	if (node->color != Ref_Cycle_Black) {   node->color = Ref_Cycle_Black; ref__cycle_push(step, child);   }
+}
+
+// drops the references that a garbage block holds to blocks that aren't garbage
+static void
+ref__cycle_visit_white(void *ctx, void *child)
+{
+	RefCycleStep *step = (RefCycleStep *)ctx;
+	RefCycleNode *node = ref__cycle_nodes_ptr(&step->cycles->nodes, child);
+	if (! node || node->color != Ref_Cycle_White) {   ref_dec(step->ref, child);   }
+}
+
+// calls children on each ptr in the stack (and anything visit pushes) until it's empty
+static void
+ref__cycle_drain(RefCycleStep *step, RefChildrenFn *children, void *user, RefVisitFn *visit)
+{
+	RefCycles *cycles = step->cycles;
+	while (cycles->stack_n && ! step->failed)
+	{
+		void *ptr = cycles->stack[--cycles->stack_n];
+		children(user, ptr, visit, step);
+	}
+}
+
+REFEREE_API size_t
+ref_collect_cycles_step(Referee *ref, RefChildrenFn *children, void *user, size_t budget, size_t *roots_left_out)
+{
+	if (! ref || ! children) {   return 0;   }
+#if REFEREE_DEFERRED
+	ref_flush(); // (so that the counts read are current)
+#endif
+
+	RefCycles   *cycles = &ref->cycles;
+	RefCycleStep step   = { ref, cycles, 0 };
+	REFEREE_WRITE_LOCK(&cycles->step_lock);
+	ref__cycle_nodes_clear(&cycles->nodes);
+	cycles->stack_n = 0;
+
+	while (cycles->nodes.n < budget && ! step.failed)
+	{ // mark gray, a root at a time
+		void *root = 0;
+		REFEREE_WRITE_LOCK(&cycles->lock);
+		size_t roots_n = cycles->roots.n;
+		if (roots_n)
+		{
+			ref__cycle_roots_at(&cycles->roots, roots_n - 1, &root);
+			ref__cycle_roots_remove(&cycles->roots, root);
+		}
+		REFEREE_WRITE_UNLOCK(&cycles->lock);
+		if (! roots_n) {   break;   }
+
+		RefCycleNode *node = ref__cycle_node(&step, root);
+		if (! node || node->color == Ref_Cycle_Gray) {   continue;   } // freed since, or already reached
+		node->color = Ref_Cycle_Gray;
+		ref__cycle_push(&step, root);
+		ref__cycle_drain(&step, children, user, ref__cycle_visit_gray);
+	}
+
+	for (size_t i = 0; i < cycles->nodes.n && ! step.failed; ++i)
+	{ // scan (nothing's added to nodes from here on, so indices are stable)
+		void         *ptr  = 0;
+		RefCycleNode *node = ref__cycle_nodes_at(&cycles->nodes, i, &ptr);
+		if (node->color == Ref_Cycle_Gray && node->count > 0)
+		{
+			node->color = Ref_Cycle_Black;
+			ref__cycle_push(&step, ptr);
+			ref__cycle_drain(&step, children, user, ref__cycle_visit_black);
+		}
+	}
+
+	size_t garbage_n = 0;
+	if (! step.failed)
+	{
+		for (size_t i = 0; i < cycles->nodes.n; ++i)
+		{
+			RefCycleNode *node = ref__cycle_nodes_at(&cycles->nodes, i, 0);
+			if (node->color == Ref_Cycle_Gray) {   node->color = Ref_Cycle_White; ++garbage_n;   }
+		}
+		for (size_t i = 0; i < cycles->nodes.n; ++i)
+		{ // collect: let go of everything outside the garbage first, then the garbage itself
+			void         *ptr  = 0;
+			RefCycleNode *node = ref__cycle_nodes_at(&cycles->nodes, i, &ptr);
+			if (node->color == Ref_Cycle_White) {   children(user, ptr, ref__cycle_visit_white, &step);   }
+		}
+		for (size_t i = 0; i < cycles->nodes.n; ++i)
+		{
+			void         *ptr  = 0;
+			RefCycleNode *node = ref__cycle_nodes_at(&cycles->nodes, i, &ptr);
+			if (node->color == Ref_Cycle_White) {   ref_recount(ref, ptr, 0);   }
+		}
+	}
+	REFEREE_WRITE_UNLOCK(&cycles->step_lock);
+
+	if (roots_left_out)
+	{
+		REFEREE_HANDLES_READ_LOCK(&cycles->lock); // (a real lock even with REFEREE_LOCKFREE)
+		*roots_left_out = cycles->roots.n;
+		REFEREE_HANDLES_READ_UNLOCK(&cycles->lock);
+	}
+	return step.failed ? REFEREE_INVALID : garbage_n;
+}
+
+REFEREE_API size_t
+ref_collect_cycles(Referee *ref, RefChildrenFn *children, void *user)
+{   return ref_collect_cycles_step(ref, children, user, REFEREE_INVALID, 0);   }
+#else
+REFEREE_API size_t
+ref_collect_cycles_step(Referee *ref, RefChildrenFn *children, void *user, size_t budget, size_t *roots_left_out)
+{   (void)ref, (void)children, (void)user, (void)budget; if (roots_left_out) {   *roots_left_out = 0;   } return 0;   }
+
+REFEREE_API size_t
+ref_collect_cycles(Referee *ref, RefChildrenFn *children, void *user)
+{   (void)ref, (void)children, (void)user; return 0;   }
+#endif//REFEREE_CYCLES
+#endif // CYCLES
+
+#if 1 // COMPACT
+// chunks that less than this % of is still live (by bytes) are evacuated by ref_compact
+#ifndef  Referee_Compact_Occupancy
+# define Referee_Compact_Occupancy 50
+#endif
+
+typedef struct RefCompactBlock {
+    char   *alloc;   // start of the allocation (the header, if it has one)
+    void   *ptr;
+    size_t  chunk_i; // REFEREE_INVALID if not from the arena
+    size_t  slot_i;  // in the handle table, REFEREE_INVALID if tracked by ptr
+} RefCompactBlock;
+
+typedef struct RefCompactChunk {
+    RefArenaChunk *chunk;
+    size_t         live_bytes, tracked_n;
+    int            sparse; // being emptied
+} RefCompactChunk;
+
+static int
+ref__compact_cmp_chunk(void const *a, void const *b)
+{
+    uintptr_t A = (uintptr_t)((RefCompactChunk const *)a)->chunk,
+              B = (uintptr_t)((RefCompactChunk const *)b)->chunk;
+    return (B < A) - (A < B);
+}
+
+static int
+ref__compact_cmp_block(void const *a, void const *b)
+{
+    uintptr_t A = (uintptr_t)((RefCompactBlock const *)a)->alloc,
+              B = (uintptr_t)((RefCompactBlock const *)b)->alloc;
+    return (B < A) - (A < B);
+}
+
+// binary search for the chunk containing alloc (searches by address, so never reads alloc itself)
+static size_t
+ref__compact_find(RefCompactChunk const *chunks, size_t chunks_n, char *alloc)
+{
+    size_t lo = 0, hi = chunks_n;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((char *)chunks[mid].chunk <= alloc) {   lo = mid + 1;   }
+        else                                     {   hi = mid;       }
+    }
+    if (! lo) {   return REFEREE_INVALID;   }
+    RefArenaChunk *chunk = chunks[lo - 1].chunk;
+    char          *data  = (char *)(chunk + 1);
+    return (alloc >= data && alloc < data + chunk->used
+            ? lo - 1
+            : REFEREE_INVALID);
+}
+
+REFEREE_API size_t
+ref_compact(Referee *ref, RefRelocateFn *relocate, void *user)
+{
+    if (! ref || ref->free != ref_arena_free) {   return REFEREE_INVALID;   }
+#if REFEREE_DEFERRED
+    ref_flush(); // logged changes are to the old ptrs
+#endif
+    ref_reclaim_flush(ref); // (a purged block still waiting to be freed would keep its chunk from being released)
+    ref_recycle_trim(ref, 0); // (as would a kept one)
+    RefArena *arena = (RefArena *)ref->allocator;
+    REFEREE_WRITE_LOCK(&arena->lock); // (the shards aren't locked, as nothing else should be using them)
+
+    // count what there is, to size the working arrays
+    size_t blocks_n = 0, chunks_n = 0;
+    for (size_t shard_i = 0; shard_i < REFEREE_SHARD_N; ++shard_i)
+    {
+        RefereeShard *shard = &ref->shards[shard_i];
+        blocks_n += shard->ptr_infos.n;
+        for (RefHeader *header = shard->headers; header; header = header->next) {   ++blocks_n;   }
+    }
+    blocks_n += ref->handles.used;
+    for (RefArenaChunk *chunk = arena->chunks; chunk; chunk = chunk->next) {   ++chunks_n;   }
+
+    RefCompactBlock *blocks = (RefCompactBlock *)malloc((blocks_n + 1) * sizeof(*blocks));
+    RefCompactChunk *chunks = (RefCompactChunk *)malloc((chunks_n + 1) * sizeof(*chunks));
+    size_t           moved_n = REFEREE_INVALID;
+    if (! blocks || ! chunks) {   goto done;   }
+
+    chunks_n = 0;
+    for (RefArenaChunk *chunk = arena->chunks; chunk; chunk = chunk->next)
+    {
+        RefCompactChunk c = { chunk, 0, 0, 0 };
+        chunks[chunks_n++] = c;
+    }
+    qsort(chunks, chunks_n, sizeof(*chunks), ref__compact_cmp_chunk);
+
+    // find which chunk each tracked ptr is in, and so how much of each chunk is live
+    blocks_n = 0;
+    for (size_t shard_i = 0; shard_i < REFEREE_SHARD_N; ++shard_i)
+    {
+        RefereeShard *shard = &ref->shards[shard_i];
+        for (size_t i = 0; i < shard->ptr_infos.n; ++i)
+        {
+            RefCompactBlock block = { 0, 0, REFEREE_INVALID, REFEREE_INVALID };
+            if (! ref__map_at(&shard->ptr_infos, i, &block.ptr)) {   continue;   }
+            block.alloc = (char *)block.ptr;
+            blocks[blocks_n++] = block;
+        }
+        for (RefHeader *header = shard->headers; header; header = header->next)
+        {
+            RefCompactBlock block = { (char *)header, (char *)header + REFEREE_HEADER_SIZE, REFEREE_INVALID, REFEREE_INVALID };
+            blocks[blocks_n++] = block;
+        }
+    }
+    for (uint32_t slot_i = 0; slot_i < ref->handles.used; ++slot_i)
+    {
+        RefCompactBlock block = { (char *)ref->handles.slots[slot_i].ptr, ref->handles.slots[slot_i].ptr, REFEREE_INVALID, slot_i };
+        if (block.ptr) {   blocks[blocks_n++] = block;   }
+    }
+    for (size_t i = 0; i < blocks_n; ++i)
+    {
+        size_t chunk_i = ref__compact_find(chunks, chunks_n, blocks[i].alloc);
+        if (! ~chunk_i) {   continue;   } // not from the arena
+        RefCompactChunk *c = &chunks[chunk_i];
+        blocks[i].chunk_i  = chunk_i;
+        c->live_bytes     += sizeof(RefArenaBlock) + ref__arena_round(((RefArenaBlock *)blocks[i].alloc - 1)->size);
+        ++c->tracked_n;
+    }
+
+    // pull the sparse chunks out of the arena, so that nothing is allocated into them while they're emptied
+    // (a chunk with live blocks that ref doesn't know about can't be emptied, so is left alone)
+    for (size_t i = 0; i < chunks_n; ++i)
+    {
+        RefArenaChunk *chunk = chunks[i].chunk;
+        chunks[i].sparse = (chunks[i].tracked_n == chunk->live_n &&
+                            100 * chunks[i].live_bytes < Referee_Compact_Occupancy * chunk->used);
+        if (chunks[i].sparse) {   ref__arena_unlink(arena, chunk);   }
+    }
+
+    // move the blocks in address order, so that neighbours stay neighbours
+    qsort(blocks, blocks_n, sizeof(*blocks), ref__compact_cmp_block);
+    moved_n = 0;
+    for (size_t i = 0; i < blocks_n; ++i)
+    {
+        RefCompactBlock *block = &blocks[i];
+        if (! ~block->chunk_i || ! chunks[block->chunk_i].sparse) {   continue;   }
+
+        RefArenaChunk *old_chunk = chunks[block->chunk_i].chunk;
+        size_t         size      = ((RefArenaBlock *)block->alloc - 1)->size;
+        char          *alloc     = (char *)ref__arena_alloc_locked(arena, size);
+        if (! alloc) {   moved_n = REFEREE_INVALID; break;   } // (what's left stays where it is)
+        memcpy(alloc, block->alloc, size);
+
+        if (~block->slot_i)
+        { // nothing outside the table has the ptr, so there's nothing to relocate
+            ref->handles.slots[block->slot_i].ptr = alloc;
+            --old_chunk->live_n;
+            ++moved_n;
+            continue;
+        }
+
+        void         *old_ptr   = block->ptr,
+                     *new_ptr   = alloc + (block->ptr != block->alloc ? REFEREE_HEADER_SIZE : 0);
+        RefereeShard *old_shard = ref__shard(ref, old_ptr),
+                     *new_shard = ref__shard(ref, new_ptr);
+        if (block->ptr != block->alloc)
+        { // (linked before the old one is forgotten, so that if it can't be, nothing has changed)
+            RefInfo info = ((RefHeader *)block->alloc)->info;
+            if (! ref__header_link_locked(new_shard, (RefHeader *)alloc, info))
+            {
+                ref__arena_free_locked(arena, alloc);
+                moved_n = REFEREE_INVALID;
+                break;
+            }
+            ref__forget_header_locked(ref, old_shard, (RefHeader *)block->alloc, 0);
+            ref__tracked(ref, new_ptr, &info, REFEREE_COLD(&((RefHeader *)alloc)->callsite), 0);
+        }
+        else
+        {
+#if REFEREE_DEBUG && REFEREE_COMPACT_INFO
+            uint32_t callsite = *ref__map_cold_ptr(&old_shard->ptr_infos, old_ptr);
+#endif
+            // (the new entry goes in before the old one comes out, so that if it can't, nothing has changed)
+            RefInfo info = *ref__map_ptr(&old_shard->ptr_infos, old_ptr);
+            if (ref__map_insert(&new_shard->ptr_infos, new_ptr, info) != MAP_absent)
+            {
+                ref__arena_free_locked(arena, alloc);
+                moved_n = REFEREE_INVALID;
+                break;
+            }
+            info        = ref__forget_locked(ref, old_shard, old_ptr, 0);
+            info.zero_i = (info.refcount ? REFEREE_INVALID
+                                         : ref__zeros_push(&new_shard->zeros, new_ptr, ref__info_size(&info)));
+            *ref__map_ptr(&new_shard->ptr_infos, new_ptr) = info;
+#if REFEREE_DEBUG && REFEREE_COMPACT_INFO
+            *ref__map_cold_ptr(&new_shard->ptr_infos, new_ptr) = callsite;
+#endif
+            ref__tracked(ref, new_ptr, &info, REFEREE_COLD(&callsite), 0);
+        }
+
+        ref__finalizer_move(ref, old_ptr, new_ptr);
+        ref__weak_move(ref, old_ptr, new_ptr);
+        ref__sample_move(ref, old_ptr, new_ptr);
+        if (relocate) {   relocate(user, old_ptr, new_ptr, size - (size_t)((char *)new_ptr - alloc));   }
+        --old_chunk->live_n;
+        ++moved_n;
+    }
+
+    // free the emptied chunks, and put back any that couldn't be emptied (having run out of memory),
+    // so that nothing tracked is freed
+    for (size_t i = 0; i < chunks_n; ++i)
+    {
+        RefArenaChunk *chunk = chunks[i].chunk;
+        if (! chunks[i].sparse) {   continue;   }
+        if (! chunk->live_n)    {   free(chunk); continue;   }
+        chunk->prev = 0;
+        chunk->next = arena->chunks;
+        if (arena->chunks) {   arena->chunks->prev = chunk;   }
+        arena->chunks = chunk;
+        ++arena->chunks_n;
+    }
+
+done:
+    REFEREE_WRITE_UNLOCK(&arena->lock);
+    free(blocks);
+    free(chunks);
+    return moved_n;
+}
+#endif // COMPACT
+
+REFEREE_API RefStats
+ref_stats(Referee *ref)
+{
+	RefStats stats = {0};
+	if (! ref) {   return stats;   }
+
+	stats.live_bytes = REFEREE_ATOMIC_LOAD(&ref->stats.live_bytes);
+	stats.live_n     = REFEREE_ATOMIC_LOAD(&ref->stats.live_n);
+	stats.peak_bytes = REFEREE_ATOMIC_LOAD(&ref->stats.peak_bytes);
+	stats.allocs_n   = REFEREE_ATOMIC_LOAD(&ref->stats.allocs_n);
+	stats.frees_n    = REFEREE_ATOMIC_LOAD(&ref->stats.frees_n);
+	for (size_t shard_i = 0; shard_i < REFEREE_SHARD_N; ++shard_i)
+	{   stats.zero_bytes += REFEREE_ATOMIC_LOAD(&ref->shards[shard_i].zeros.bytes);   }
+	stats.zero_bytes += REFEREE_ATOMIC_LOAD(&ref->handles.zeros.bytes);
+#if REFEREE_RECYCLE
+	stats.recycled_bytes   = REFEREE_ATOMIC_LOAD(&ref->recycle.bytes);
+	stats.recycle_hits_n   = REFEREE_ATOMIC_LOAD(&ref->recycle.hits_n);
+	stats.recycle_misses_n = REFEREE_ATOMIC_LOAD(&ref->recycle.misses_n);
+#endif
+	return stats;
+}
+
+REFEREE_API size_t
+ref_total_size(Referee *ref)
+{   return ref ? REFEREE_ATOMIC_LOAD(&ref->stats.live_bytes) : 0;   }
+
+
+#if 1 // REPORT
+// a ptr, or a group of them. The rows are summed into a scratch array rather than sorting the maps in place
+typedef struct RefReportRow {
+    void    *ptr;      // (REF_REPORT_PTR only)
+    uint32_t callsite; // (the first one seen, for REF_REPORT_FILE)
+    size_t   key;      // the row's index when it was gathered, which breaks ties in the order
+    size_t   bytes, n, min_size, max_size;
+} RefReportRow;
+
+typedef struct RefReport {
+    RefReportBy   by;
+    RefReportRow *rows;
+    size_t        rows_n, rows_max;
+    size_t        total_bytes;
+} RefReport;
+
+// 0 for empty ptrs, otherwise the bit width of size (i.e. the bucket of sizes from 2^(bucket-1) to 2^bucket - 1)
+static inline size_t
+ref__report_bucket(size_t size)
+{
+    size_t bucket = 0;
+    for (; size; size >>= 1) {   ++bucket;   }
+    return bucket;
+}
+
+// the biggest size in bucket
+static inline size_t
+ref__report_bucket_max(size_t bucket)
+{   return bucket ? REFEREE_INVALID >> (8 * sizeof(size_t) - bucket) : 0;   }
+
+// size: of ptr, which counts for n ptrs and bytes bytes (more than 1 and size for a sample)
+// returns 0 if the rows couldn't grow
+static int
+ref__report_add_n(RefReport *report, void *ptr, uint32_t callsite, size_t size, size_t n, size_t bytes)
+{
+    size_t row_i;
+    switch (report->by)
+    {
+        case REF_REPORT_PTR:  row_i = report->rows_n;            break;
+        case REF_REPORT_SIZE: row_i = ref__report_bucket(size); break;
+        default:              row_i = callsite;                  break; // (files are merged from callsites afterwards)
+    }
+
+    if (row_i >= report->rows_max)
+    {
+        size_t new_max = report->rows_max ? report->rows_max * 2 : 64;
+        if (new_max <= row_i) {   new_max = row_i + 1;   }
+        RefReportRow *new_rows = (RefReportRow *)realloc(report->rows, new_max * sizeof(*new_rows));
+        if (! new_rows) {   return 0;   }
+        memset(new_rows + report->rows_max, 0, (new_max - report->rows_max) * sizeof(*new_rows));
+        report->rows     = new_rows;
+        report->rows_max = new_max;
+    }
+
+    RefReportRow *row = &report->rows[row_i];
+    if (! row->n)
+    {
+        row->ptr      = ptr;
+        row->callsite = callsite;
+        row->key      = row_i;
+        row->min_size = size;
+    }
+    row->bytes += bytes;
+    row->n     += n;
+    if (size < row->min_size) {   row->min_size = size;   }
+    if (size > row->max_size) {   row->max_size = size;   }
+    if (row_i >= report->rows_n) {   report->rows_n = row_i + 1;   }
+    report->total_bytes += bytes;
+    return 1;
+}
+
+// cold: as given by REFEREE_COLD
+static int
+ref__report_add(RefReport *report, void *ptr, RefInfo const *info, uint32_t const *cold)
+{
+    size_t size = ref__info_size(info);
+    return ref__report_add_n(report, ptr, ref__info_callsite(info, cold), size, 1, size);
+}
+
+// biggest first
+static int
+ref__report_cmp(RefReportRow const *a, RefReportRow const *b)
+{
+    if (a->bytes != b->bytes) {   return (a->bytes < b->bytes) - (b->bytes < a->bytes);   }
+    return (a->key > b->key) - (a->key < b->key);
+}
+static int
+ref__report_cmp_qsort(void const *a, void const *b)
+{   return ref__report_cmp(*(RefReportRow *const *)a, *(RefReportRow *const *)b);   }
+
+static char const *
+ref__report_file(RefReportRow const *row)
+{
+    RefCallsite const *site = ref__callsite(row->callsite);
+    return site ? site->file : "";
+}
+static int
+ref__report_cmp_file_qsort(void const *a, void const *b)
+{   return strcmp(ref__report_file(*(RefReportRow *const *)a), ref__report_file(*(RefReportRow *const *)b));   }
+
+// quickselect: afterwards rows[0..k) are the k biggest, in no particular order
+static void
+ref__report_select(RefReportRow **rows, size_t n, size_t k)
+{
+    size_t lo = 0, hi = n;
+    while (hi - lo > 1)
+    { // 3-way partition of [lo, hi) into bigger than, the same as, and smaller than the pivot
+        RefReportRow *pivot = rows[lo + (hi - lo) / 2], *swap;
+        size_t        lt    = lo, i = lo, gt = hi;
+        while (i < gt)
+        {
+            int cmp = ref__report_cmp(rows[i], pivot);
+            if      (cmp < 0) {   swap = rows[lt]; rows[lt++] = rows[i]; rows[i++] = swap;   }
+            else if (cmp > 0) {   swap = rows[--gt]; rows[gt] = rows[i]; rows[i] = swap;     }
+            else              {   ++i;   }
+        }
+        if      (k < lt) {   hi = lt;   }
+        else if (k > gt) {   lo = gt;   }
+        else             {   break;     }
+    }
+}
+
+// quoted and escaped for CSV or JSON
+static void
+ref__report_str(FILE *out, char const *str, RefReportFormat format)
+{
+    fputc('"', out);
+    for (; str && *str; ++str)
+    {
+        unsigned char c = (unsigned char)*str;
+        if      (format == REF_REPORT_CSV)  {   if (c == '"') {   fputc('"', out);   } fputc(c, out);   }
+        else if (c == '"' || c == '\\')     {   fputc('\\', out); fputc(c, out);   }
+        else if (c < 0x20)                  {   fprintf(out, "\\u%04x", c);   }
+        else                                {   fputc(c, out);   }
+    }
+    fputc('"', out);
+}
+
+static void
+ref__report_row(FILE *out, RefReportRow const *row, RefReportBy by, RefReportFormat format, size_t row_i)
+{
+    RefCallsite const *site = ref__callsite(row->callsite);
+    if (by == REF_REPORT_SIZE) {   site = 0;   }
+
+    if (format == REF_REPORT_TEXT)
+    {
+        if (by == REF_REPORT_PTR && site)
+        {   fprintf(out, "%zu bytes. %s - %s(%zu) - \t %s\n", row->bytes, site->func, site->file, site->line, site->call);   }
+        else if (by == REF_REPORT_PTR)
+        {   fprintf(out, "%zu bytes. %p\n", row->bytes, row->ptr);   }
+        else
+        {
+            fprintf(out, "%zu bytes in %zu ptrs (%zu-%zu each). ", row->bytes, row->n, row->min_size, row->max_size);
+            if      (by == REF_REPORT_SIZE) {   fprintf(out, "sizes up to %zu\n", ref__report_bucket_max(row->key));   }
+            else if (! site)                {   fprintf(out, "?\n");   }
+            else if (by == REF_REPORT_FILE) {   fprintf(out, "%s\n", site->file);   }
+            else                            {   fprintf(out, "%s - %s(%zu) - \t %s\n", site->func, site->file, site->line, site->call);   }
+        }
+        return;
+    }
+
+    int  is_csv = format == REF_REPORT_CSV;
+    char ptr_str[32] = "";
+    if (by == REF_REPORT_PTR) {   snprintf(ptr_str, sizeof(ptr_str), "%p", row->ptr);   }
+
+    if (is_csv) {   fprintf(out, "%zu,%zu,%zu,%zu,%s,", row->bytes, row->n, row->min_size, row->max_size, ptr_str);   }
+    else
+    {
+        fprintf(out, "%s\n    {\"bytes\": %zu, \"n\": %zu, \"min_size\": %zu, \"max_size\": %zu",
+                row_i ? "," : "", row->bytes, row->n, row->min_size, row->max_size);
+        if (*ptr_str) {   fprintf(out, ", \"ptr\": \"%s\"", ptr_str);   }
+    }
+
+    if (site)
+    {
+        if (! is_csv) {   fputs(", \"file\": ", out);   }
+        ref__report_str(out, site->file, format);
+        if (by == REF_REPORT_FILE) {   fputs(is_csv ? ",,," : "", out);   }
+        else
+        {
+            fprintf(out, is_csv ? ",%zu," : ", \"line\": %zu, \"func\": ", site->line);
+            ref__report_str(out, site->func, format);
+            fputs(is_csv ? "," : ", \"call\": ", out);
+            ref__report_str(out, site->call, format);
+        }
+    }
+    else if (is_csv) {   fputs(",,,", out);   }
+
+    if (by == REF_REPORT_SIZE) {   fprintf(out, is_csv ? ",%zu\n" : ", \"sizes_up_to\": %zu}", ref__report_bucket_max(row->key));   }
+    else                       {   fputs(is_csv ? ",\n" : "}", out);   }
+}
+
+// adds ref's samples to report, each counting for what it stands for
+// returns the number added, or REFEREE_INVALID if the rows couldn't grow
+static size_t
+ref__report_add_samples(RefReport *report, Referee *ref)
+{
+#if REFEREE_SAMPLE
+    RefSamples *samples   = &ref->samples;
+    size_t      samples_n = 0;
+    int         ok        = 1;
+    REFEREE_WRITE_LOCK(&samples->lock);
+    for (size_t i = 0; ok && i < samples->of.n; ++i)
+    {
+        void             *ptr    = 0;
+        RefSampled const *sample = ref__sample_map_at(&samples->of, i, &ptr);
+        if (! sample) {   continue;   }
+        ok = ref__report_add_n(report, ptr, sample->callsite, sample->size, sample->est_n, sample->est_bytes);
+        ++samples_n;
+    }
+    REFEREE_WRITE_UNLOCK(&samples->lock);
+    return ok ? samples_n : REFEREE_INVALID;
+#else
+    (void)report, (void)ref;
+    return 0;
+#endif
+}
+
+// is_sorted: 0 to write the rows in the order they're found (i.e. as ref_dump_mem_usage always did)
+static size_t
+ref__report(FILE *out, Referee *ref, RefReportBy by, RefReportFormat format, size_t top_n, int is_sorted)
+{
+    if (! ref || ! out) {   return REFEREE_INVALID;   }
+
+    RefReport      report = {0};
+    RefReportRow **index  = 0;
+    size_t         rows_n = 0, result = REFEREE_INVALID;
+    int            ok     = 1,
+                   sampled = REFEREE_SAMPLE && (by == REF_REPORT_CALLSITE || by == REF_REPORT_FILE);
+    size_t         samples_n = 0;
+    report.by = by;
+
+    if (sampled)
+    {
+        samples_n = ref__report_add_samples(&report, ref);
+        ok        = samples_n != REFEREE_INVALID;
+        report.total_bytes = REFEREE_ATOMIC_LOAD(&ref->stats.live_bytes); // (known exactly)
+    }
+    for (size_t shard_i = 0; ! sampled && shard_i < REFEREE_SHARD_N; ++shard_i)
+    {
+        RefereeShard *shard = &ref->shards[shard_i];
+        // (the write lock is needed for the header list, which lock-free reads wouldn't protect)
+        REFEREE_WRITE_LOCK(&shard->lock);
+        for(size_t i = 0,
+                   n = shard->ptr_infos.n;
+            ok && i < n; ++i)
+        {
+            void          *ptr  = 0;
+            RefInfo const *info = ref__map_at(&shard->ptr_infos, i, &ptr);
+            if (info) {   ok = ref__report_add(&report, ptr, info, REFEREE_COLD(ref__map_cold_at(&shard->ptr_infos, i)));   }
+        }
+        for(RefHeader *header = shard->headers; ok && header; header = header->next)
+        {   ok = ref__report_add(&report, (char *)header + REFEREE_HEADER_SIZE, &header->info, REFEREE_COLD(&header->callsite));   }
+        REFEREE_WRITE_UNLOCK(&shard->lock);
+    }
+
+    if (! sampled)
+    {
+        RefHandles *handles = &ref->handles;
+        REFEREE_HANDLES_READ_LOCK(&handles->lock);
+        for (uint32_t slot_i = 0; ok && slot_i < handles->used; ++slot_i)
+        {
+            RefHandleSlot const *slot = &handles->slots[slot_i];
+            if (slot->ptr) {   ok = ref__report_add(&report, slot->ptr, &slot->info, REFEREE_COLD(&handles->callsites[slot_i]));   }
+        }
+        REFEREE_HANDLES_READ_UNLOCK(&handles->lock);
+    }
+
+    index = (RefReportRow **)malloc((report.rows_n + 1) * sizeof(*index));
+    if (! ok || ! index) {   goto done;   }
+    for (size_t i = 0; i < report.rows_n; ++i)
+    {   if (report.rows[i].n) {   index[rows_n++] = &report.rows[i];   }   }
+
+    if (by == REF_REPORT_FILE && rows_n)
+    { // merge the callsites that share a file into the first of them
+        qsort(index, rows_n, sizeof(*index), ref__report_cmp_file_qsort);
+        size_t files_n = 1;
+        for (size_t i = 1; i < rows_n; ++i)
+        {
+            RefReportRow *file = index[files_n - 1], *row = index[i];
+            if (strcmp(ref__report_file(file), ref__report_file(row)))
+            {   index[files_n++] = row; continue;   }
+            file->bytes += row->bytes;
+            file->n     += row->n;
+            if (row->min_size < file->min_size) {   file->min_size = row->min_size;   }
+            if (row->max_size > file->max_size) {   file->max_size = row->max_size;   }
+        }
+        rows_n = files_n;
+    }
+
+    size_t shown_n = (top_n && top_n < rows_n) ? top_n : rows_n;
+    if (is_sorted)
+    {
+        if (shown_n < rows_n) {   ref__report_select(index, rows_n, shown_n);   }
+        qsort(index, shown_n, sizeof(*index), ref__report_cmp_qsort);
+    }
+
+    switch (format)
+    {
+        case REF_REPORT_TEXT:
+            fprintf(out, "Total memory tracked: %zu\n", report.total_bytes);
+            if (sampled) {   fprintf(out, "(rows estimated from %zu samples)\n", samples_n);   }
+            break;
+        case REF_REPORT_CSV:  fprintf(out, "bytes,n,min_size,max_size,ptr,file,line,func,call,sizes_up_to\n");      break;
+        case REF_REPORT_JSON: fprintf(out, "{\"total_bytes\": %zu, \"rows_n\": %zu, \"rows\": [", report.total_bytes, rows_n); break;
+    }
+    for (size_t i = 0; i < shown_n; ++i)
+    {   ref__report_row(out, index[i], by, format, i);   }
+    switch (format)
+    {
+        case REF_REPORT_TEXT:
+            if (shown_n < rows_n) {   fprintf(out, "(and %zu more)\n", rows_n - shown_n);   }
+            fputc('\n', out);
+            break;
+        case REF_REPORT_CSV:  break;
+        case REF_REPORT_JSON: fputs(shown_n ? "\n]}\n" : "]}\n", out); break;
+    }
+    result = shown_n;
+
+done:
+    free(index);
+    free(report.rows);
+    return result;
+}
+
+REFEREE_API size_t
+ref_report(FILE *out, Referee *ref, RefReportBy by, RefReportFormat format, size_t top_n)
+{   return ref__report(out, ref, by, format, top_n, 1);   }
+
+REFEREE_API void
+ref_dump_mem_usage(FILE *out, Referee *ref, int should_sort)
+{   ref__report(out, ref, REF_REPORT_PTR, REF_REPORT_TEXT, 0, should_sort);   }
+#endif // REPORT
+
+#if 1 // SNAPSHOT
+#ifndef  Referee_Snapshot_Buffer_Size
+# define Referee_Snapshot_Buffer_Size (16 * 1024)
+#endif
+
+// what's written for a ptr, copied out under its shard's lock so that the lock isn't held while writing
+typedef struct RefSnapshotEntry {
+    void    *ptr;
+    size_t   el_n, el_size, refcount;
+    uint32_t callsite;
+} RefSnapshotEntry;
+
+typedef struct RefSnapshotWriter {
+    FILE             *out;
+    int               ok;
+    size_t            used;
+    uintptr_t         prev_ptr; // ptrs are written as deltas from the one before
+    RefSnapshotEntry *entries;  // a shard's (or the handles') worth at a time
+    size_t            entries_n, entries_max;
+    unsigned char     buf[Referee_Snapshot_Buffer_Size];
+} RefSnapshotWriter;
+
+static void
+ref__snapshot_flush(RefSnapshotWriter *w)
+{
+    if (w->used && fwrite(w->buf, 1, w->used, w->out) != w->used) {   w->ok = 0;   }
+    w->used = 0;
+}
+
+static void
+ref__snapshot_varint(RefSnapshotWriter *w, uint64_t v)
+{
+    if (w->used + 10 > sizeof(w->buf)) {   ref__snapshot_flush(w);   }
+    for (; v >= 0x80; v >>= 7) {   w->buf[w->used++] = (unsigned char)(v | 0x80);   }
+    w->buf[w->used++] = (unsigned char)v;
+}
+
+static void
+ref__snapshot_str(RefSnapshotWriter *w, char const *str)
+{
+    size_t len = str ? strlen(str) : 0;
+    ref__snapshot_varint(w, len);
+    if (w->used + len > sizeof(w->buf)) {   ref__snapshot_flush(w);   }
+    if (len > sizeof(w->buf))
+    {   if (fwrite(str, 1, len, w->out) != len) {   w->ok = 0;   }   }
+    else if (len)
+    {   memcpy(w->buf + w->used, str, len); w->used += len;   }
+}
+
+// call holding the lock that protects info
+// cold: as given by REFEREE_COLD
+static void
+ref__snapshot_copy(RefSnapshotWriter *w, void *ptr, RefInfo const *info, uint32_t const *cold)
+{
+    if (w->entries_n == w->entries_max)
+    {
+        size_t            new_max     = w->entries_max ? 2 * w->entries_max : 256;
+        RefSnapshotEntry *new_entries = (RefSnapshotEntry *)realloc(w->entries, new_max * sizeof(*new_entries));
+        if (! new_entries) {   w->ok = 0; return;   }
+        w->entries     = new_entries;
+        w->entries_max = new_max;
+    }
+    RefSnapshotEntry *entry = &w->entries[w->entries_n++];
+    entry->ptr      = ptr;
+    entry->el_n     = ref_info_el_n(info);
+    entry->el_size  = ref_info_el_size(info);
+    entry->refcount = REFEREE_ATOMIC_LOAD(&info->refcount);
+#if REFEREE_DEBUG
+    entry->callsite = ref__info_callsite(info, cold);
+#else
+    entry->callsite = 0;
+    (void)cold;
+#endif
+}
+
+// writes (and empties) what's been copied
+// returns the number of ptrs written
+static size_t
+ref__snapshot_entries(RefSnapshotWriter *w)
+{
+    for (size_t i = 0; i < w->entries_n; ++i)
+    {
+        RefSnapshotEntry const *entry = &w->entries[i];
+        uintptr_t addr  = (uintptr_t)entry->ptr;
+        uintptr_t delta = addr - w->prev_ptr;
+        w->prev_ptr     = addr;
+        ref__snapshot_varint(w, REF_SNAPSHOT_PTR);
+        ref__snapshot_varint(w, (uint64_t)(delta << 1) ^ (uint64_t)((intptr_t)delta >> (8 * sizeof(delta) - 1))); // zigzag
+        ref__snapshot_varint(w, entry->el_n);
+        ref__snapshot_varint(w, entry->el_size);
+        ref__snapshot_varint(w, entry->refcount);
+#if REFEREE_DEBUG
+        ref__snapshot_varint(w, entry->callsite);
+#endif
+    }
+    size_t written_n = w->entries_n;
+    w->entries_n = 0;
+    return written_n;
+}
+
+REFEREE_API size_t
+ref_snapshot_write(FILE *out, Referee *ref)
+{
+    if (! ref || ! out) {   return REFEREE_INVALID;   }
+
+    RefSnapshotWriter *w = (RefSnapshotWriter *)malloc(sizeof(*w));
+    if (! w) {   return REFEREE_INVALID;   }
+    w->out = out, w->ok = 1, w->used = 0, w->prev_ptr = 0;
+    w->entries = 0, w->entries_n = w->entries_max = 0;
+    size_t ptrs_n = 0;
+
+    memcpy(w->buf, Referee_Snapshot_Magic, 8);
+    w->used = 8;
+#if REFEREE_DEBUG
+    ref__snapshot_varint(w, Referee_Snapshot_Has_Callsites);
+#else
+    ref__snapshot_varint(w, 0);
+#endif
+
+    for (size_t shard_i = 0; shard_i < REFEREE_SHARD_N; ++shard_i)
+    {
+        RefereeShard *shard = &ref->shards[shard_i];
+        // (a real read lock even with REFEREE_LOCKFREE, for the header list, which lock-free reads
+        // wouldn't protect)
+        REFEREE_HANDLES_READ_LOCK(&shard->lock);
+        for(size_t i = 0,
+                   n = shard->ptr_infos.n;
+            i < n; ++i)
+        {
+            void          *ptr  = 0;
+            RefInfo const *info = ref__map_at(&shard->ptr_infos, i, &ptr);
+            if (info) {   ref__snapshot_copy(w, ptr, info, REFEREE_COLD(ref__map_cold_at(&shard->ptr_infos, i)));   }
+        }
+        for(RefHeader *header = shard->headers; header; header = header->next)
+        {   ref__snapshot_copy(w, (char *)header + REFEREE_HEADER_SIZE, &header->info, REFEREE_COLD(&header->callsite));   }
+        REFEREE_HANDLES_READ_UNLOCK(&shard->lock);
+        ptrs_n += ref__snapshot_entries(w);
+    }
+
+    RefHandles *handles = &ref->handles;
+    REFEREE_HANDLES_READ_LOCK(&handles->lock);
+    for (uint32_t slot_i = 0; slot_i < handles->used; ++slot_i)
+    {
+        RefHandleSlot const *slot = &handles->slots[slot_i];
+        if (slot->ptr) {   ref__snapshot_copy(w, slot->ptr, &slot->info, REFEREE_COLD(&handles->callsites[slot_i]));   }
+    }
+    REFEREE_HANDLES_READ_UNLOCK(&handles->lock);
+    ptrs_n += ref__snapshot_entries(w);
+
+#if REFEREE_DEBUG
+    // every callsite rather than only the ones used, so that a reader needn't have seen every ptr first
+    uint32_t callsites_n = REFEREE_ATOMIC_LOAD(&ref__callsites.n);
+    for (uint32_t id = 1; id <= callsites_n; ++id)
     {
-        Addr    ptr  = ref->ptr_infos.keys[i];
-        RefInfo info = ref->ptr_infos.vals[i];
-        fprintf(out, //"0x%08llx:"
-            "%zu bytes. %s - %s(%zu) - \t %s\n",
-            //(unsigned long long)ptr,
-            info.el_n * info.el_size,
-            info.func, info.file, info.line, info.call);
+        RefCallsite const *site = ref__callsite(id);
+        ref__snapshot_varint(w, REF_SNAPSHOT_CALLSITE);
+        ref__snapshot_varint(w, id);
+        ref__snapshot_varint(w, site->line);
+        ref__snapshot_str(w, site->file);
+        ref__snapshot_str(w, site->func);
+        ref__snapshot_str(w, site->call);
     }
-    fputc('\n', out);
+#endif
+    ref__snapshot_varint(w, REF_SNAPSHOT_END);
+    ref__snapshot_flush(w);
+
+    size_t result = w->ok ? ptrs_n : REFEREE_INVALID;
+    free(w->entries);
+    free(w);
+    return result;
 }
+#endif // SNAPSHOT
 
 #endif
+#endif//REFEREE_H
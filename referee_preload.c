@@ -0,0 +1,391 @@
+// Tracks the malloc/calloc/realloc/free/posix_memalign calls of a program that it's preloaded into
+// (so it needs no rebuilding) and writes reports of what's live on a signal and at exit
+// e.g. clang -O2 -Wall -Wno-unused-function -shared -fPIC -ftls-model=initial-exec referee_preload.c
+//            -o libreferee_preload.so -ldl -lpthread
+//   LD_PRELOAD=./libreferee_preload.so some_service
+//   kill -USR2 <pid>                                  - write a report while it runs
+// Set in the environment:
+//   REFEREE_PRELOAD_OUT    - file to append reports to ("%p" becomes the pid). If unset, or if it can't
+//                            be written, reports go to the stderr the program started with (a copy of
+//                            fd 2 is kept, so they still arrive if the program closes or redirects it)
+//   REFEREE_PRELOAD_SIGNAL - the signal that writes a report (SIGUSR2 by default, 0 for none)
+//   REFEREE_PRELOAD_TOP    - how many of the biggest ptrs each report lists (20 by default)
+// (add -DREFEREE_SAMPLE=1 -DReferee_Sample_Frames_N=16 -lm to also list sampled ptrs' backtraces)
+//
+// Referee's own memory (e.g. its maps grow by plain realloc) comes straight from the next allocator:
+// each thread is flagged while it's inside Referee, and nothing it allocates while flagged is tracked,
+// so tracking never recurses. Only what's allocated after the library is loaded is tracked.
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REFEREE_THREADS 1
+#define REFEREE_IMPLEMENTATION
+#include "referee.h"
+
+// every ptr is tracked with a refcount of 1 until it's freed, so nothing is ever purged
+static Referee preload_ref;
+
+// set while this thread is inside Referee (or writing a report), so its allocations go untracked
+// (initial-exec, as the first access of other TLS models can allocate)
+static __thread int preload_busy __attribute__((tls_model("initial-exec")));
+
+#if 1 // NEXT: the allocator that would have been used without this library
+typedef struct PreloadNext {
+	void *(*malloc)        (size_t size);
+	void *(*calloc)        (size_t n, size_t size);
+	void *(*realloc)       (void *ptr, size_t size);
+	void  (*free)          (void *ptr);
+	int   (*posix_memalign)(void **ptr_out, size_t alignment, size_t size);
+	void *(*aligned_alloc) (size_t alignment, size_t size);
+	void *(*memalign)      (size_t alignment, size_t size);
+} PreloadNext;
+static PreloadNext preload_next;
+static int         preload_resolving; // (the first lookup is made before there are other threads)
+
+// for whatever dlsym allocates while the next allocator is being looked up. Never freed
+static char   preload_boot[16 * 1024] __attribute__((aligned(16)));
+static size_t preload_boot_used;
+#define preload_is_boot(ptr) ((char *)(ptr) >= preload_boot && (char *)(ptr) < preload_boot + sizeof(preload_boot))
+
+static void *
+preload_boot_alloc(size_t size)
+{
+	if (size > sizeof(preload_boot)) {   return 0;   }
+	size_t at = REFEREE_ATOMIC_ADD(&preload_boot_used, (size + 15) & ~(size_t)15);
+	return at + size <= sizeof(preload_boot) ? preload_boot + at : 0;
+}
+
+static void
+preload_resolve(void)
+{
+	preload_resolving = 1;
+	preload_next.calloc         = (void *(*)(size_t, size_t))         dlsym(RTLD_NEXT, "calloc");
+	preload_next.realloc        = (void *(*)(void *, size_t))         dlsym(RTLD_NEXT, "realloc");
+	preload_next.free           = (void  (*)(void *))                 dlsym(RTLD_NEXT, "free");
+	preload_next.posix_memalign = (int   (*)(void **, size_t, size_t))dlsym(RTLD_NEXT, "posix_memalign");
+	preload_next.aligned_alloc  = (void *(*)(size_t, size_t))         dlsym(RTLD_NEXT, "aligned_alloc");
+	preload_next.memalign       = (void *(*)(size_t, size_t))         dlsym(RTLD_NEXT, "memalign");
+	// (last, as it's what's checked to see whether they've been looked up)
+	preload_next.malloc         = (void *(*)(size_t))                 dlsym(RTLD_NEXT, "malloc");
+	preload_resolving = 0;
+	if (! preload_next.malloc || ! preload_next.free)
+	{
+		static char const msg[] = "referee_preload: can't find the next malloc/free\n";
+		(void)! write(2, msg, sizeof(msg) - 1);
+		abort();
+	}
+}
+#endif // NEXT
+
+#if 1 // TRACKING
+static inline void
+preload_track(void *ptr, size_t el_n, size_t el_size)
+{
+	if (! ptr || preload_busy) {   return;   }
+	preload_busy = 1;
+	ref_add_n(&preload_ref, ptr, el_n, el_size, 1);
+	preload_busy = 0;
+}
+
+void *
+malloc(size_t size)
+{
+	if (! preload_next.malloc)
+	{
+		if (preload_resolving) {   return preload_boot_alloc(size);   }
+		preload_resolve();
+	}
+	void *ptr = preload_next.malloc(size);
+	preload_track(ptr, 1, size);
+	return ptr;
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	if (! preload_next.malloc)
+	{
+		size_t bytes;
+		if (preload_resolving) {   return __builtin_mul_overflow(n, size, &bytes) ? 0 : preload_boot_alloc(bytes);   }
+		preload_resolve();
+	}
+	void *ptr = preload_next.calloc(n, size);
+	preload_track(ptr, n, size);
+	return ptr;
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (preload_is_boot(ptr))
+	{ // moves out of the boot buffer, copying as much as could have been ptr's
+		void  *result = malloc(size);
+		size_t left   = (size_t)(preload_boot + sizeof(preload_boot) - (char *)ptr);
+		if (result) {   memcpy(result, ptr, size < left ? size : left);   }
+		return result;
+	}
+	if (! preload_next.malloc) {   preload_resolve();   }
+	if (preload_busy)          {   return preload_next.realloc(ptr, size);   }
+
+	// ptr is forgotten before the next allocator can hand its address out again (to another thread),
+	// rather than after, as ref_register_realloc_n would
+	preload_busy = 1;
+	RefInfo info   = {0};
+	if (ptr) {   info = ref__forget(&preload_ref, ptr, 0);   }
+	void   *result = preload_next.realloc(ptr, size);
+	if (result)
+	{   ref_add_n(&preload_ref, result, 1, size, 1);   }
+	else if (ptr && size && ~info.refcount) // failed, so ptr is still the program's
+	{   ref_add_n(&preload_ref, ptr, ref_info_el_n(&info), ref_info_el_size(&info), 1);   }
+	preload_busy = 0;
+	return result;
+}
+
+void
+free(void *ptr)
+{
+	if (! ptr || preload_is_boot(ptr)) {   return;   }
+	if (! preload_next.malloc)         {   preload_resolve();   }
+	if (! preload_busy)
+	{
+		preload_busy = 1;
+		ref_remove(&preload_ref, ptr);
+		preload_busy = 0;
+	}
+	preload_next.free(ptr);
+}
+
+int
+posix_memalign(void **ptr_out, size_t alignment, size_t size)
+{
+	if (! preload_next.malloc)
+	{
+		if (preload_resolving) {   return ENOMEM;   }
+		preload_resolve();
+	}
+	int result = preload_next.posix_memalign(ptr_out, alignment, size);
+	if (! result) {   preload_track(*ptr_out, 1, size);   }
+	return result;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	if (! preload_next.malloc)
+	{
+		if (preload_resolving) {   return 0;   }
+		preload_resolve();
+	}
+	if (! preload_next.aligned_alloc) {   errno = ENOMEM; return 0;   }
+	void *ptr = preload_next.aligned_alloc(alignment, size);
+	preload_track(ptr, 1, size);
+	return ptr;
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+	if (! preload_next.malloc)
+	{
+		if (preload_resolving) {   return 0;   }
+		preload_resolve();
+	}
+	if (! preload_next.memalign) {   errno = ENOMEM; return 0;   }
+	void *ptr = preload_next.memalign(alignment, size);
+	preload_track(ptr, 1, size);
+	return ptr;
+}
+#endif // TRACKING
+
+#if 1 // REPORTS
+static char            preload_out_pattern[1024]; // as REFEREE_PRELOAD_OUT
+static char            preload_out[1024 + 64];    // ... with the pid filled in, "" for stderr
+static int             preload_err_fd = -1;        // a copy of the stderr the program started with
+static size_t          preload_lost_n;             // reports that couldn't be written anywhere
+static int             preload_signal = SIGUSR2;
+static size_t          preload_top_n  = 20;
+static sem_t           preload_dump_sem;           // posted by the signal handler
+static pthread_mutex_t preload_dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+preload_set_out(void)
+{
+	size_t n = 0;
+	for (char const *c = preload_out_pattern; *c && n + 32 < sizeof(preload_out); ++c)
+	{
+		if (c[0] == '%' && c[1] == 'p') {   n += (size_t)snprintf(preload_out + n, 32, "%d", (int)getpid()); ++c;   }
+		else                            {   preload_out[n++] = *c;   }
+	}
+	preload_out[n] = '\0';
+}
+
+// a stream on its own copy of preload_err_fd (so closing it leaves that open), or 0
+static FILE *
+preload_open_err(void)
+{
+	int   fd  = preload_err_fd >= 0 ? fcntl(preload_err_fd, F_DUPFD_CLOEXEC, 3) : -1;
+	FILE *out = fd >= 0 ? fdopen(fd, "a") : 0;
+	if (! out && fd >= 0) {   close(fd);   }
+	return out;
+}
+
+// writes a report to out and closes it
+// returns 0 if any of it failed to be written
+static int
+preload_write(FILE *out, char const *why)
+{
+	RefStats stats = ref_stats(&preload_ref);
+	fprintf(out, "referee_preload: pid %d, at %s: %zu bytes live in %zu ptrs (peak %zu bytes), "
+	             "%zu allocated, %zu freed\n",
+	        (int)getpid(), why, stats.live_bytes, stats.live_n, stats.peak_bytes, stats.allocs_n, stats.frees_n);
+	if (preload_lost_n) {   fprintf(out, "referee_preload: %zu earlier report(s) couldn't be written\n", preload_lost_n);   }
+	ref_report(out, &preload_ref, REF_REPORT_SIZE, REF_REPORT_TEXT, 0);
+	if (preload_top_n) {   ref_report(out, &preload_ref, REF_REPORT_PTR, REF_REPORT_TEXT, preload_top_n);   }
+#if REFEREE_SAMPLE
+	ref_samples_dump(out, &preload_ref);
+#endif
+	fputc('\n', out);
+	int ok = ! ferror(out);
+	return ! fclose(out) && ok; // (fclose flushes, so it's where most write errors show up)
+}
+
+static void
+preload_dump(char const *why)
+{
+	int was_busy = preload_busy;
+	preload_busy = 1;
+	pthread_mutex_lock(&preload_dump_lock);
+	FILE *out = preload_out[0] ? fopen(preload_out, "ae") : preload_open_err();
+	int   ok  = out && preload_write(out, why);
+	if (! ok && preload_out[0])
+	{ // fall back to the original stderr, saying why
+		int error = errno;
+		if ((out = preload_open_err()))
+		{
+			fprintf(out, "referee_preload: couldn't write the report to %s (%s), so it's here instead\n",
+			        preload_out, strerror(error));
+			ok = preload_write(out, why);
+		}
+	}
+	if (ok) {   preload_lost_n = 0;   }
+	else    {   ++preload_lost_n;     }
+	pthread_mutex_unlock(&preload_dump_lock);
+	preload_busy = was_busy;
+}
+
+// (sem_post is async-signal-safe, whereas reporting locks and allocates)
+static void
+preload_on_signal(int sig)
+{
+	int saved_errno = errno;
+	(void)sig;
+	sem_post(&preload_dump_sem);
+	errno = saved_errno;
+}
+
+static void *
+preload_dumper(void *arg)
+{
+	(void)arg;
+	preload_busy = 1;
+	for (;;)
+	{   if (! sem_wait(&preload_dump_sem)) {   preload_dump("signal");   }   }
+	return 0;
+}
+
+static void
+preload_start_dumper(void)
+{
+	if (preload_signal <= 0) {   return;   }
+	sem_init(&preload_dump_sem, 0, 0);
+
+	// with every signal blocked, so that the program's signals are never delivered to it
+	sigset_t all, old;
+	pthread_t thread;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (! pthread_create(&thread, 0, preload_dumper, 0)) {   pthread_detach(thread);   }
+	pthread_sigmask(SIG_SETMASK, &old, 0);
+}
+
+// the child of a fork mustn't inherit a lock held by a thread that isn't there any more
+static void
+preload_fork_prepare(void)
+{
+	for (size_t shard_i = 0; shard_i < REFEREE_SHARD_N; ++shard_i)
+	{   REFEREE_WRITE_LOCK(&preload_ref.shards[shard_i].lock);   }
+#if REFEREE_SAMPLE
+	REFEREE_WRITE_LOCK(&preload_ref.samples.lock);
+	REFEREE_WRITE_LOCK(&ref__callsites.lock);
+#endif
+}
+
+static void
+preload_fork_parent(void)
+{
+#if REFEREE_SAMPLE
+	REFEREE_WRITE_UNLOCK(&ref__callsites.lock);
+	REFEREE_WRITE_UNLOCK(&preload_ref.samples.lock);
+#endif
+	for (size_t shard_i = 0; shard_i < REFEREE_SHARD_N; ++shard_i)
+	{   REFEREE_WRITE_UNLOCK(&preload_ref.shards[shard_i].lock);   }
+}
+
+static void
+preload_fork_child(void)
+{
+	preload_fork_parent();
+	pthread_mutex_t unlocked = PTHREAD_MUTEX_INITIALIZER;
+	preload_dump_lock = unlocked;
+	preload_set_out();
+	int was_busy = preload_busy;
+	preload_busy = 1;
+	preload_start_dumper();
+	preload_busy = was_busy;
+}
+
+__attribute__((constructor)) static void
+preload_init(void)
+{
+	if (! preload_next.malloc) {   preload_resolve();   }
+	preload_busy = 1;
+
+	char const *out = getenv("REFEREE_PRELOAD_OUT"),
+	           *sig = getenv("REFEREE_PRELOAD_SIGNAL"),
+	           *top = getenv("REFEREE_PRELOAD_TOP");
+	if (out) {   snprintf(preload_out_pattern, sizeof(preload_out_pattern), "%s", out);   }
+	if (sig) {   preload_signal = atoi(sig);   }
+	if (top) {   preload_top_n  = (size_t)strtoull(top, 0, 10);   }
+	preload_set_out();
+	preload_err_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3); // (-1 if the program started without one)
+
+#if REFEREE_SAMPLE && Referee_Sample_Frames_N
+	void *frame;
+	backtrace(&frame, 1); // loads the unwinder now, rather than from inside the program's first sampled malloc
+#endif
+	if (preload_signal > 0)
+	{
+		struct sigaction action = {0};
+		action.sa_handler = preload_on_signal;
+		action.sa_flags   = SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		sigaction(preload_signal, &action, 0);
+	}
+	preload_start_dumper();
+	pthread_atfork(preload_fork_prepare, preload_fork_parent, preload_fork_child);
+	preload_busy = 0;
+}
+
+__attribute__((destructor)) static void
+preload_fini(void)
+{   preload_dump("exit");   }
+#endif // REPORTS
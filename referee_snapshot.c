@@ -0,0 +1,221 @@
+// Reads snapshots written by ref_snapshot_write
+// e.g. clang -O2 -Wall -Wno-unused-function referee_snapshot.c -o referee_snapshot
+//   referee_snapshot diff before.snap after.snap  - growth per callsite, biggest first
+//   referee_snapshot folded snap                  - bytes per callsite as folded stacks
+//                                                   (for flamegraph.pl, speedscope, inferno etc.)
+// Callsites are matched by file, line and call rather than id, so snapshots from different runs
+// can be compared. Without REFEREE_DEBUG every ptr is under one unknown callsite.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "referee.h" // (just the format)
+
+typedef struct SnapSite {
+	uint32_t id;
+	size_t   line;
+	char    *file, *func, *call; // "?" if unknown
+	size_t   bytes, n;
+} SnapSite;
+
+typedef struct Snapshot {
+	SnapSite *sites; // indexed by id, [0] is unknown
+	size_t    sites_n;
+	size_t    ptrs_n, bytes;
+} Snapshot;
+
+static int
+snap_varint(FILE *in, uint64_t *v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		int c = fgetc(in);
+		if (c == EOF) {   return 0;   }
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		if (! (c & 0x80)) {   return 1;   }
+	}
+	return 0;
+}
+
+static char *
+snap_str(FILE *in)
+{
+	uint64_t len;
+	if (! snap_varint(in, &len) || len > (1 << 24)) {   return 0;   }
+	char *str = (char *)malloc(len + 1);
+	if (! str || fread(str, 1, len, in) != len) {   free(str); return 0;   }
+	str[len] = '\0';
+	return str;
+}
+
+// makes room for site id
+static SnapSite *
+snap_site(Snapshot *snap, uint64_t id)
+{
+	if (id > UINT32_MAX) {   return 0;   }
+	if (id >= snap->sites_n)
+	{
+		size_t    new_n     = id + 1 > 2 * snap->sites_n ? id + 1 : 2 * snap->sites_n;
+		SnapSite *new_sites = (SnapSite *)realloc(snap->sites, new_n * sizeof(*new_sites));
+		if (! new_sites) {   return 0;   }
+		memset(new_sites + snap->sites_n, 0, (new_n - snap->sites_n) * sizeof(*new_sites));
+		snap->sites   = new_sites;
+		snap->sites_n = new_n;
+	}
+	snap->sites[id].id = (uint32_t)id;
+	return &snap->sites[id];
+}
+
+static int
+snap_load(char const *path, Snapshot *snap)
+{
+	FILE *in = fopen(path, "rb");
+	if (! in) {   fprintf(stderr, "can't open %s\n", path); return 0;   }
+
+	char     magic[8];
+	uint64_t flags = 0, tag = 0;
+	int      ok    = (fread(magic, 1, 8, in) == 8 && ! memcmp(magic, Referee_Snapshot_Magic, 8) &&
+	                  snap_varint(in, &flags) && snap_site(snap, 0));
+	while (ok && (ok = snap_varint(in, &tag)) && tag != REF_SNAPSHOT_END)
+	{
+		uint64_t delta, el_n, el_size, refcount, id = 0, line;
+		SnapSite *site;
+		switch (tag)
+		{
+			case REF_SNAPSHOT_PTR:
+				ok = (snap_varint(in, &delta) && snap_varint(in, &el_n) && snap_varint(in, &el_size) &&
+				      snap_varint(in, &refcount) &&
+				      (! (flags & Referee_Snapshot_Has_Callsites) || snap_varint(in, &id)) &&
+				      (site = snap_site(snap, id)));
+				if (ok) {   site->bytes += el_n * el_size; ++site->n; snap->bytes += el_n * el_size; ++snap->ptrs_n;   }
+				break;
+
+			case REF_SNAPSHOT_CALLSITE:
+				ok = (snap_varint(in, &id) && snap_varint(in, &line) && (site = snap_site(snap, id)));
+				if (ok)
+				{
+					site->line = line;
+					ok = ((site->file = snap_str(in)) && (site->func = snap_str(in)) && (site->call = snap_str(in)));
+				}
+				break;
+
+			default: ok = 0; break;
+		}
+	}
+	fclose(in);
+	if (! ok) {   fprintf(stderr, "%s isn't a complete snapshot\n", path);   }
+	return ok;
+}
+
+static char const *snap_or(char const *str) {   return str ? str : "?";   }
+
+static int
+snap_cmp_sites(SnapSite const *a, SnapSite const *b)
+{
+	int cmp = strcmp(snap_or(a->file), snap_or(b->file));
+	if (! cmp) {   cmp = (a->line > b->line) - (a->line < b->line);   }
+	if (! cmp) {   cmp = strcmp(snap_or(a->call), snap_or(b->call));   }
+	return cmp;
+}
+
+typedef struct SnapDiff {
+	SnapSite const *before, *after;
+	int64_t         bytes, n;
+} SnapDiff;
+
+static int
+snap_cmp_diff_sites(void const *a, void const *b)
+{
+	SnapDiff const *A = (SnapDiff const *)a, *B = (SnapDiff const *)b;
+	return snap_cmp_sites(A->before ? A->before : A->after, B->before ? B->before : B->after);
+}
+
+static int
+snap_cmp_diff_growth(void const *a, void const *b)
+{
+	SnapDiff const *A = (SnapDiff const *)a, *B = (SnapDiff const *)b;
+	return (A->bytes < B->bytes) - (A->bytes > B->bytes);
+}
+
+static int
+snap_diff(Snapshot const *before, Snapshot const *after)
+{
+	// every site of both, sorted by what they are so that the same site in each ends up side by side
+	SnapDiff *diffs   = (SnapDiff *)calloc(before->sites_n + after->sites_n + 1, sizeof(*diffs));
+	size_t    diffs_n = 0;
+	if (! diffs) {   return 1;   }
+	for (size_t i = 0; i < before->sites_n; ++i)
+	{   if (before->sites[i].n) {   diffs[diffs_n++].before = &before->sites[i];   }   }
+	for (size_t i = 0; i < after->sites_n; ++i)
+	{   if (after->sites[i].n)  {   diffs[diffs_n++].after  = &after->sites[i];    }   }
+	qsort(diffs, diffs_n, sizeof(*diffs), snap_cmp_diff_sites);
+
+	size_t merged_n = 0;
+	for (size_t i = 0; i < diffs_n; ++i)
+	{
+		SnapDiff        diff = diffs[i];
+		SnapDiff const *next = i + 1 < diffs_n ? &diffs[i + 1] : 0;
+		if (next && ! diff.before != ! next->before && ! snap_cmp_diff_sites(&diff, next))
+		{ // the same site in the other snapshot
+			if (next->before) {   diff.before = next->before;   }
+			else              {   diff.after  = next->after;    }
+			++i;
+		}
+		diff.bytes = (int64_t)(diff.after ? diff.after->bytes : 0) - (int64_t)(diff.before ? diff.before->bytes : 0);
+		diff.n     = (int64_t)(diff.after ? diff.after->n     : 0) - (int64_t)(diff.before ? diff.before->n     : 0);
+		diffs[merged_n++] = diff;
+	}
+	qsort(diffs, merged_n, sizeof(*diffs), snap_cmp_diff_growth);
+
+	printf("%+lld bytes, %+lld ptrs (%zu -> %zu bytes)\n",
+	       (long long)after->bytes - (long long)before->bytes, (long long)after->ptrs_n - (long long)before->ptrs_n,
+	       before->bytes, after->bytes);
+	printf("%14s %10s %14s  %s\n", "bytes", "ptrs", "now", "callsite");
+	for (size_t i = 0; i < merged_n; ++i)
+	{
+		SnapDiff const *diff = &diffs[i];
+		SnapSite const *site = diff->after ? diff->after : diff->before;
+		if (! diff->bytes && ! diff->n) {   continue;   }
+		printf("%+14lld %+10lld %14zu  %s - %s(%zu) - %s\n", (long long)diff->bytes, (long long)diff->n,
+		       diff->after ? diff->after->bytes : 0,
+		       snap_or(site->func), snap_or(site->file), site->line, snap_or(site->call));
+	}
+	free(diffs);
+	return 0;
+}
+
+// e.g. "main;ref_new(&r, 32, 1) (test.c:12) 4096"
+static int
+snap_folded(Snapshot const *snap)
+{
+	for (size_t i = 0; i < snap->sites_n; ++i)
+	{
+		SnapSite const *site = &snap->sites[i];
+		if (! site->n) {   continue;   }
+		printf("%s;", snap_or(site->func));
+		for (char const *c = snap_or(site->call); *c; ++c)
+		{   putchar(*c == ';' ? ',' : *c);   } // (';' separates frames)
+		printf(" (%s:%zu) %zu\n", snap_or(site->file), site->line, site->bytes);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	Snapshot snaps[2] = {{0}};
+	if (argc == 4 && ! strcmp(argv[1], "diff"))
+	{
+		if (! snap_load(argv[2], &snaps[0]) || ! snap_load(argv[3], &snaps[1])) {   return 1;   }
+		return snap_diff(&snaps[0], &snaps[1]);
+	}
+	if (argc == 3 && ! strcmp(argv[1], "folded"))
+	{
+		if (! snap_load(argv[2], &snaps[0])) {   return 1;   }
+		return snap_folded(&snaps[0]);
+	}
+	fprintf(stderr, "usage: %s diff before.snap after.snap\n"
+	                "       %s folded snap > out.folded\n", argv[0], argv[0]);
+	return 2;
+}
@@ -1,10 +1,11 @@
 #define SWEET_NOCOLOUR
+#define SWEET_NUM_TESTS 512
 #include "sweet.h"
 #include "stdlib.h"
 #include "stdio.h"
-#include "refcount.h"
-#define REFCOUNT_TEST
-#include "refcount.h"
+#include "string.h"
+#define REFEREE_IMPLEMENTATION
+#include "referee.h"
 
 #define struct(t) \
 struct t;\
@@ -17,49 +18,238 @@ struct (Tester) {
 	char *s;
 } Test_Zero = {0};
 
-int main()
+// the count once every thread's deferred incs/decs are in (ref_flush is a no-op without REFEREE_DEFERRED)
+static size_t
+count(Referee *ref, void *ptr)
+{   ref_flush(); return ref_count(ref, ptr);   }
+
+// ref_compact's relocate: swaps old_ptr for new_ptr in the user's array of ptrs
+typedef struct Kept { void **ptrs; size_t ptrs_n, moved_n; } Kept;
+static void
+relocate(void *user, void *old_ptr, void *new_ptr, size_t size)
+{
+	Kept *kept = user;
+	(void)size;
+	for (size_t i = 0; i < kept->ptrs_n; ++i)
+	{   if (kept->ptrs[i] == old_ptr) {   kept->ptrs[i] = new_ptr; ++kept->moved_n;   }   }
+}
+
+#if REFEREE_DEFERRED && REFEREE_THREADS && ! defined(_WIN32)
+#include <pthread.h>
+// logs incs_n incs or decs_n decs of ptr (then fills its log with fill_n more ptrs), then keeps its log
+// (by staying alive) until main is done
+typedef struct Logger { Referee *ref; void *ptr; size_t incs_n, decs_n, fill_n; pthread_barrier_t *logged, *done; } Logger;
+static char Fill[2 * Referee_Log_N];
+static void *
+logger(void *arg)
+{
+	Logger *l = arg;
+	for (size_t i = 0; i < l->incs_n; ++i) {   ref_inc(l->ref, l->ptr);     }
+	for (size_t i = 0; i < l->decs_n; ++i) {   ref_dec(l->ref, l->ptr);     }
+	for (size_t i = 0; i < l->fill_n; ++i) {   ref_inc(l->ref, &Fill[i]);   } // (untracked, so dropped when applied)
+	pthread_barrier_wait(l->logged);
+	pthread_barrier_wait(l->done);
+	return 0;
+}
+#endif
+
+#if REFEREE_CYCLES
+// a block holding counted references to up to 2 others, for ref_collect_cycles
+typedef struct Node { void *kids[2]; size_t kids_n; } Node;
+static Node *
+node_new(Referee *ref)
+{
+	Node *node = ref_new(ref, sizeof(Node), 1);
+	node->kids_n = 0;
+	return node;
+}
+// node takes a reference to kid
+static void
+node_hold(Referee *ref, Node *node, void *kid)
+{   ref_inc(ref, kid); node->kids[node->kids_n++] = kid;   }
+static void
+node_children(void *user, void *ptr, RefVisitFn *visit, void *ctx)
+{
+	Node *node = ptr;
+	(void)user;
+	for (size_t i = 0; i < node->kids_n; ++i) {   visit(ctx, node->kids[i]);   }
+}
+#endif
+
+#if REFEREE_FINALIZERS
+// a block that's given to a Finals' finalizer: tagged with its kind, and holding a reference to next
+typedef struct Linked { char tag; void *next; } Linked;
+// what a finalizer's been given
+typedef struct Finals { Referee *ref; char tag; size_t calls_n, ptrs_n, wrong_n; } Finals;
+static void
+finalize(void *user, void *const *ptrs, size_t ptrs_n)
+{
+	Finals *finals = user;
+	++finals->calls_n;
+	finals->ptrs_n += ptrs_n;
+	for (size_t i = 0; i < ptrs_n; ++i)
+	{
+		Linked *linked = ptrs[i];
+		finals->wrong_n += linked->tag != finals->tag;
+		if (linked->next) {   ref_dec(finals->ref, linked->next);   }
+	}
+}
+static Linked *
+linked_new(Referee *ref, uint32_t type, char tag, void *next, size_t count)
+{
+	Linked *linked = ref_new(ref, sizeof(Linked), count);
+	linked->tag  = tag;
+	linked->next = next;
+	ref_set_finalizer(ref, linked, type);
+	return linked;
+}
+#endif
+
+// a plain (locked-build) map, for map_ptr_many
+#define MAP_TYPES (CountMap, count_map, uint64_t, uint64_t)
+#include "hash.h"
+
+#if REFEREE_LOCKFREE && ! defined(_WIN32)
+#include <pthread.h>
+#define MAP_TYPES (StressMap, stress_map, uint64_t, uint64_t)
+#define MAP_LOCKFREE
+#include "hash.h"
+// each thread inserts, looks up and removes its own keys (value 3*key), while looking up everyone else's
+#define Stress_Threads_N 4
+#define Stress_Keys_N    20000 // per thread, so the map resizes many times over from empty
+#define Stress_Rounds_N  4
+typedef struct Stress { StressMap *map; uint64_t first; size_t wrong_n; } Stress;
+static void *
+stress(void *arg)
+{
+	Stress   *st  = arg;
+	StressMap *map = st->map;
+	for (size_t round = 0; round < Stress_Rounds_N; ++round)
+	{
+		for (uint64_t key = st->first; key < st->first + Stress_Keys_N; ++key)
+		{   st->wrong_n += (key % 2 || ! round ? stress_map_insert(map, key, 3 * key) != MAP_absent : 0);   }
+		for (uint64_t key = 1; key < 1 + Stress_Threads_N * Stress_Keys_N; key += 7)
+		{ // (another thread's key may come and go, but is never seen with the wrong value)
+			uint64_t val = stress_map_get(map, key);
+			st->wrong_n += val && val != 3 * key;
+		}
+		for (uint64_t key = st->first; key < st->first + Stress_Keys_N; ++key)
+		{
+			uint64_t val = stress_map_get(map, key);
+			st->wrong_n += val != 3 * key;
+			if (key % 2) {   st->wrong_n += stress_map_remove(map, key) != 3 * key;   }
+		}
+		for (uint64_t key = st->first; key < st->first + Stress_Keys_N; ++key)
+		{   st->wrong_n += !! stress_map_has(map, key) != ! (key % 2);   }
+	}
+	return 0;
+}
+#endif
+
+#if REFEREE_RECLAIM
+// an allocator that counts the frees (made by the reclaimer thread, so only read once it's flushed)
+typedef struct Counted { size_t frees_n; } Counted;
+static void *
+counted_realloc(void *allocator, void *ptr, size_t el_n, size_t el_size)
+{   (void)allocator; return realloc(ptr, el_n * el_size);   }
+static void
+counted_free(void *allocator, void *ptr)
+{   ++((Counted *)allocator)->frees_n; free(ptr);   }
+#endif
+
+#if REFEREE_SAMPLE
+// finds the CSV row for line in a REF_REPORT_CALLSITE report, filling bytes_out and n_out
+// returns 0 if there isn't one
+static int
+report_line(FILE *report, size_t line, size_t *bytes_out, size_t *n_out)
+{
+	char row[1024];
+	rewind(report);
+	while (fgets(row, sizeof(row), report))
+	{
+		size_t bytes, n, min_size, max_size, row_line;
+		if (sscanf(row, "%zu,%zu,%zu,%zu,,\"%*[^\"]\",%zu,", &bytes, &n, &min_size, &max_size, &row_line) == 5 && row_line == line)
+		{   *bytes_out = bytes, *n_out = n; return 1;   }
+	}
+	return 0;
+}
+// whether est is within 10% of exact
+static int
+near(size_t est, size_t exact)
+{   return 10 * (est > exact ? est - exact : exact - est) <= exact;   }
+#endif
+
+// ref_new from another file, for the REF_REPORT_FILE rows (defined at the end, under #line)
+static void *elsewhere_new(Referee *ref, size_t size);
+
+// referee_snapshot.c's reader (with its main out of the way)
+#define main referee_snapshot_main
+#include "referee_snapshot.c"
+#undef main
+
+// the site in snap with ptrs from line, or 0
+static SnapSite const *
+snap_line(Snapshot const *snap, size_t line)
+{
+	for (size_t i = 0; i < snap->sites_n; ++i)
+	{   if (snap->sites[i].n && snap->sites[i].line == line) {   return &snap->sites[i];   }   }
+	return 0;
+}
+
+// reads report's rows (after its header line) into rows, returning how many there are
+static size_t
+report_rows(FILE *report, char rows[][256], size_t rows_max)
 {
-	/* Tester test = { 2, 3.3, "hello" }; */
+	size_t rows_n = 0;
+	rewind(report);
+	if (! fgets(rows[0], 256, report)) {   return 0;   }
+	while (rows_n < rows_max && fgets(rows[rows_n], 256, report)) {   ++rows_n;   }
+	return rows_n;
+}
 
-	printf("1\n");
+int main()
+{
 	TestGroup("Reference counting")
 	{
 		TestGroup("init")
 		{
 			TestGroup("new")
 			{
-				Rc rc_ = {0}, *rc = &rc_;
-				Tester *val = rc_new(rc, sizeof(*val), 0);
-				Test(rc_info(rc, val)->refcount == 0);
-				Test(rc_info(rc, val)->el_size  == sizeof(Tester));
-				Test(rc_info(rc, val)->el_n     == 1);
+				Referee ref_ = {0}, *ref = &ref_;
+				Tester *val = ref_new(ref, sizeof(*val), 0);
+				Test(ref_info(ref, val)->refcount == 0);
+				Test(ref_info_el_size(ref_info(ref, val)) == sizeof(Tester));
+				Test(ref_info_el_n   (ref_info(ref, val)) == 1);
 
-				Test(rc_inc(rc, val) == val);
+				Test(ref_inc(ref, val) == val);
+				ref_reset(ref);
 			}
 
-			printf("2\n");
 			TestGroup("add/remove")
 			{
-				Rc rc_ = {0}, *rc = &rc_;
+				Referee ref_ = {0}, *ref = &ref_;
+				ref_set_default_allocator(ref);
 				Tester *val  = malloc(sizeof(*val)),
 					   *vals = malloc(sizeof(*vals) * 8);
 				TestGroup("add")
 				{
-					rc_add(rc, vals, sizeof(*val), 0);
-					rc_add_n(rc, vals, sizeof(*vals), 8, 0);
+					ref_add(ref, val, sizeof(*val), 0);
+					ref_add_n(ref, vals, 8, sizeof(*vals), 0);
 
-					Test(rc_info(rc, val )->el_size == sizeof(*val));
-					Test(rc_info(rc, vals)->el_size == sizeof(*vals) * 8);
-					Test(rc_info(rc, vals + 1) == 0);
+					Test(ref_info_el_size(ref_info(ref, val )) == sizeof(*val));
+					Test(ref_info_el_size(ref_info(ref, vals)) == sizeof(*vals));
+					Test(ref_info_el_n   (ref_info(ref, vals)) == 8);
+					Test(ref_info(ref, vals + 1) == 0);
 				}
 
-				printf("3\n");
 				TestGroup("remove")
 				{
-					Test(val == rc_remove(rc, val));
+					Test(val == ref_remove(ref, val));
+					Test(ref_info(ref, val) == 0);
+					Test(ref_info(ref, vals) != 0);
 				}
 
-	printf("4\n");
+				ref_remove(ref, vals);
 				free(val);
 				free(vals);
 			}
@@ -67,54 +257,724 @@ int main()
 
 		TestGroup("inc/dec/count")
 		{
-			Rc rc_ = {0}, *rc = &rc_;
-			Tester *val = rc_new(rc, sizeof(*val), 0);
-
-			Test(rc_info(rc, val)->refcount == 0);
-			Test(rc_count(rc, val) == 0);
-			rc_inc(rc, val);
-			Test(rc_info(rc, val)->refcount == 1);
-			Test(rc_count(rc, val) == 1);
-			rc_inc(rc, val);
-			Test(rc_info(rc, val)->refcount == 2);
-			Test(rc_count(rc, val) == 2);
-
-			rc_inc_c(rc, val, 3);
-			Test(rc_info(rc, val)->refcount == 5);
-			Test(rc_count(rc, val) == 5);
-
-			rc_dec_c(rc, val, 2);
-			Test(rc_info(rc, val)->refcount == 3);
-			Test(rc_count(rc, val) == 3);
-			rc_dec(rc, val);
-			Test(rc_info(rc, val)->refcount == 2);
-			Test(rc_count(rc, val) == 2);
-
-			rc_dec_c(rc, val, 64);
-			Test(rc_info(rc, val)->refcount == 0);
-			Test(rc_count(rc, val) == 0);
-			rc_dec(rc, val);
-			Test(rc_info(rc, val)->refcount == 0);
-			Test(rc_count(rc, val) == 0);
+			Referee ref_ = {0}, *ref = &ref_;
+			Tester *val = ref_new(ref, sizeof(*val), 0);
+
+			Test(count(ref, val) == 0);
+			ref_inc(ref, val);
+			Test(count(ref, val) == 1);
+			ref_inc(ref, val);
+			Test(count(ref, val) == 2);
+
+			ref_inc_c(ref, val, 3);
+			Test(count(ref, val) == 5);
+
+			ref_dec_c(ref, val, 2);
+			Test(count(ref, val) == 3);
+			ref_dec(ref, val);
+			Test(count(ref, val) == 2);
+
+			ref_dec_c(ref, val, 64);
+			Test(count(ref, val) == 0);
+			ref_dec(ref, val);
+			Test(count(ref, val) == 0);
+			ref_reset(ref);
 		}
 
 		TestGroup("purge")
 		{
-			Rc rc_ = {0}, *rc = &rc_;
-			Tester *val = rc_new(rc, sizeof(*val), 0);
-			Test(rc_info(rc, val)); 
-			Test(rc_purge(rc) == 1);
-			Test(! rc_info(rc, val)); 
+			Referee ref_ = {0}, *ref = &ref_;
+			Tester *val = ref_new(ref, sizeof(*val), 0);
+			Test(ref_info(ref, val));
+			Test(ref_purge(ref) == 1);
+			Test(ref_stats(ref).live_n == 0);
+			ref_reset(ref);
+		}
+
+		TestGroup("zero list")
+		{ // only what's at 0 when ref_purge is called goes, however it got there
+			Referee ref_ = {0}, *ref = &ref_;
+			void *ptrs[64];
+			for (int i = 0; i < 64; ++i) {   ptrs[i] = ref_new(ref, 16, 1);   }
+			for (int i = 0; i < 64; i += 2) {   ref_dec(ref, ptrs[i]);   }
+			for (int i = 0; i < 16; i += 2) {   ref_inc(ref, ptrs[i]);   } // revived before the purge
+			ref_recount(ref, ptrs[1], 0);
+			ref_flush();
+			Test(ref_stats(ref).zero_bytes == 16 * (32 - 8 + 1));
+
+			size_t left = 0;
+			Test(ref_purge_step(ref, 5, 0, &left) == 5);
+			Test(left == 32 - 8 + 1 - 5);
+			Test(ref_purge(ref) == left);
+			Test(ref_stats(ref).zero_bytes == 0);
+			Test(ref_stats(ref).live_n == 64 - (32 - 8 + 1));
+			Test(count(ref, ptrs[0]) == 1);
+			Test(count(ref, ptrs[3]) == 1);
+			Test(ref_purge(ref) == 0);
+			ref_reset(ref);
+		}
+
+#if REFEREE_SHARD_N > 1
+		TestGroup("shards")
+		{ // ptrs are spread over the shards, and each is found in its own
+			Referee ref_ = {0}, *ref = &ref_;
+			void  *ptrs[256];
+			size_t used[REFEREE_SHARD_N] = {0}, shards_used = 0;
+			for (int i = 0; i < 256; ++i)
+			{
+				ptrs[i] = ref_new(ref, 8 + i, 1);
+				shards_used += ! used[ref__shard(ref, ptrs[i]) - ref->shards]++;
+			}
+			Test(shards_used > REFEREE_SHARD_N / 2);
+
+			int all_found = 1;
+			for (int i = 0; i < 256; ++i) {   all_found &= count(ref, ptrs[i]) == 1;   }
+			Test(all_found);
+			Test(ref_stats(ref).live_n == 256);
+
+			for (int i = 0; i < 256; ++i) {   ref_dec(ref, ptrs[i]);   }
+			Test(ref_purge(ref) == 256);
+			Test(ref_stats(ref).live_n == 0);
+			ref_reset(ref);
+		}
+#endif
+
+		TestGroup("interior")
+		{ // (blocks carved out of one buffer, so that they're side by side)
+			Referee ref_ = {0}, *ref = &ref_;
+			static char buf[4096];
+			char *a = ref_add(ref, buf,       100,  1),
+			     *b = ref_add(ref, buf + 100, 300,  1),
+			     *c = ref_add(ref, buf + 1000, 1000, 1);
+			void *base = buf;
+			Test(ref_info_containing(ref, b, &base) == ref_info(ref, b) && base == b);
+			Test(ref_info_containing(ref, buf + 3000, &base) == 0 && base == 0);
+#if REFEREE_INTERIOR
+			Test(ref_info_containing(ref, a + 99,  &base) && base == a);
+			Test(ref_info_containing(ref, a + 100, &base) && base == b);
+			Test(ref_info_containing(ref, b + 299, &base) && base == b);
+			Test(ref_info_containing(ref, b + 300, &base) == 0);
+			Test(ref_info_containing(ref, c + 999, &base) && base == c);
+			Test(ref_info_containing(ref, c + 1000, 0) == 0);
+
+			Test(ref_inc_interior(ref, b + 150) == b + 150);
+			Test(count(ref, b) == 2);
+			Test(ref_dec_interior(ref, b + 150) == b + 150);
+			Test(count(ref, b) == 1);
+			Test(ref_inc_interior(ref, buf + 500) == 0);
+			Test(ref_dec_interior(ref, buf + 500) == 0);
+
+			for (int i = 0; i < 3; ++i)
+			{ // a block whose size is written through ref_info is still taken out of the index when it goes
+				RefInfo *info = ref_info(ref, c);
+# if REFEREE_COMPACT_INFO
+				info->size = 10;
+# else
+				info->el_n = 10, info->el_size = 1;
+# endif
+				Test(ref_remove(ref, c) == c);
+				Test(ref_add(ref, c, 1000, 1) == c);
+			}
+			Test(ref_info_containing(ref, c + 999, &base) && base == c);
+			ref_remove(ref, c);
+			char *d = ref_add(ref, buf + 512, 2048, 1); // (over where c was, which mustn't still be found)
+			Test(ref_info_containing(ref, c + 10, &base) && base == d);
+			c = d;
+#else
+			Test(ref_inc_interior(ref, b) == b); // (only the start is found)
+			Test(ref_inc_interior(ref, b + 150) == 0);
+			Test(ref_dec_interior(ref, b) == b);
+#endif
+			ref_remove(ref, a), ref_remove(ref, b), ref_remove(ref, c);
+			Test(ref_info_containing(ref, b + 150, &base) == 0 && base == 0);
+			ref_reset(ref);
+		}
+
+		TestGroup("many")
+		{ // over several batches, mixed with NULLs and untracked ptrs (which are skipped, and not counted as found)
+			Referee ref_ = {0}, *ref = &ref_;
+			static char untracked[600];
+			void   *ptrs[600];
+			size_t  deltas[600], counts[600], tracked_n = 0;
+			for (size_t i = 0; i < 600; ++i)
+			{
+				ptrs[i]   = i % 3 == 0 ? ref_new(ref, 8, 1) : i % 3 == 1 ? 0 : &untracked[i];
+				deltas[i] = 1 + i % 4;
+				counts[i] = 99;
+				tracked_n += i % 3 == 0;
+			}
+			Test(ref_inc_many(ref, ptrs, 600, deltas) == tracked_n);
+			ref_flush();
+			Test(ref_count_many(ref, ptrs, 600, counts) == tracked_n);
+			int counted = 1;
+			for (size_t i = 0; i < 600; ++i) {   counted &= counts[i] == (i % 3 == 0 ? 1 + deltas[i] : 0);   }
+			Test(counted);
+
+			Test(ref_dec_many(ref, ptrs, 600, deltas) == tracked_n);
+			Test(ref_dec_many(ref, ptrs, 600, 0) == tracked_n); // (1 each)
+			ref_flush();
+			Test(ref_count_many(ref, ptrs, 600, counts) == tracked_n);
+			counted = 1;
+			for (size_t i = 0; i < 600; ++i) {   counted &= counts[i] == 0;   }
+			Test(counted);
+			Test(ref_purge(ref) == tracked_n);
+			Test(ref_count_many(ref, ptrs, 600, counts) == 0);
+			Test(ref_inc_many(ref, ptrs, 0, 0) == 0 && ref_inc_many(ref, 0, 600, 0) == 0);
+
+			CountMap  map = {0};
+			uint64_t  keys[150];
+			uint64_t *vals[150];
+			for (uint64_t key = 1; key <= 100; ++key) {   count_map_insert(&map, key, 2 * key);   }
+			for (size_t i = 0; i < 150; ++i)          {   keys[i] = 150 - i;   } // (the last 50 are missing)
+			Test(count_map_ptr_many(&map, keys, 150, vals) == 100);
+			int found = 1;
+			for (size_t i = 0; i < 150; ++i) {   found &= keys[i] <= 100 ? vals[i] && *vals[i] == 2 * keys[i] : ! vals[i];   }
+			Test(found);
+			count_map_clear(&map);
+			ref_reset(ref);
+		}
+
+		TestGroup("handles")
+		{
+			Referee ref_ = {0}, *ref = &ref_;
+			RefHandle handle = ref_new_h(ref, 32, 1);
+			Test(handle != 0);
+			Test(ref_get_h(ref, handle) != 0);
+			Test(ref_count_h(ref, handle) == 1);
+			Test(ref_inc_h(ref, handle) == ref_get_h(ref, handle));
+			Test(ref_count_h(ref, handle) == 2);
+			ref_dec_h(ref, handle);
+			ref_dec_h(ref, handle);
+			Test(ref_count_h(ref, handle) == 0);
+
+			Test(ref_purge(ref) == 1);
+			Test(ref_get_h(ref, handle) == 0); // stale
+			Test(ref_inc_h(ref, handle) == 0);
+			Test(ref_free_h(ref, handle) == 0);
+
+			RefHandle next = ref_new_h(ref, 32, 1);
+			Test(next != 0 && next != handle);
+			Test(ref_free_h(ref, next) == 1);
+			Test(ref_get_h(ref, next) == 0);
+			ref_reset(ref);
+		}
+
+#if REFEREE_DEFERRED
+		TestGroup("deferred")
+		{
+			Referee ref_ = {0}, *ref = &ref_;
+			void *ptr = ref_new(ref, 16, 1);
+			ref_inc_c(ref, ptr, 3);
+			ref_dec(ref, ptr);
+			Test(ref_count(ref, ptr) == 1); // still in this thread's log
+			ref_flush();
+			Test(ref_count(ref, ptr) == 3);
+
+			ref_dec_c(ref, ptr, 3);
+			Test(ref_purge(ref) == 1); // (purge applies the logs itself)
+			Test(ref_stats(ref).live_n == 0);
+
+			ptr = ref_new(ref, 16, 1);
+			ref_inc(ref, ptr);
+			ref_free(ref, ptr); // with a change still logged for it
+			Test(ref_stats(ref).live_n == 0);
+			ref_flush(); // (nothing left to apply it to)
+			Test(ref_stats(ref).frees_n == 2);
+			ref_reset(ref);
+		}
+#endif
+
+#if REFEREE_DEFERRED && REFEREE_THREADS && ! defined(_WIN32)
+		TestGroup("deferred across threads")
+		{ // a dec logged in one thread of the ref that an inc still in another thread's log made
+			Referee ref_ = {0}, *ref = &ref_;
+			void *ptr = ref_new(ref, 16, 1);
+			pthread_barrier_t logged, done;
+			pthread_barrier_init(&logged, 0, 2);
+			pthread_barrier_init(&done,   0, 3);
+			Logger    inc = { ref, ptr, 1, 0, 0,             &logged, &done },
+			          dec = { ref, ptr, 0, 2, Referee_Log_N, &logged, &done }; // (filling its log)
+			pthread_t inc_thread, dec_thread;
+			pthread_create(&inc_thread, 0, logger, &inc);
+			pthread_barrier_wait(&logged);
+			pthread_create(&dec_thread, 0, logger, &dec);
+			pthread_barrier_wait(&logged);
+
+			Test(ref_count(ref, ptr) == 1); // the decs weren't applied with the rest of the full log
+			ref_flush();
+			Test(ref_count(ref, ptr) == 0);
+			Test(ref_purge(ref) == 1);
+
+			pthread_barrier_wait(&done);
+			pthread_join(inc_thread, 0);
+			pthread_join(dec_thread, 0);
+			pthread_barrier_destroy(&logged);
+			pthread_barrier_destroy(&done);
+			ref_reset(ref);
+		}
+#endif
+
+#if REFEREE_WEAK
+		TestGroup("weak")
+		{
+			Referee ref_ = {0}, *ref = &ref_;
+			void   *ptr  = ref_new(ref, 16, 1);
+			RefWeak weak = ref_weak(ref, ptr);
+			Test(weak != 0);
+			Test(ref_weak(ref, ptr) == weak);
+			Test(ref_upgrade(ref, weak) == ptr);
+			Test(count(ref, ptr) == 2);
+
+			ref_dec_c(ref, ptr, 2);
+			Test(ref_upgrade(ref, weak) == ptr); // at 0 but not yet purged: revived
+			ref_dec(ref, ptr);
+			Test(ref_purge(ref) == 1);
+			Test(ref_upgrade(ref, weak) == 0);
+			ref_reset(ref);
+		}
+#endif
+
+#if REFEREE_RECYCLE
+		TestGroup("recycle")
+		{
+			Referee ref_ = {0}, *ref = &ref_;
+			void *ptr = ref_new(ref, 64, 0);
+			Test(ref_purge(ref) == 1);
+			Test(ref_stats(ref).recycled_bytes >= 64);
+
+			void *again = ref_new(ref, 64, 1);
+			Test(again == ptr);
+			Test(ref_stats(ref).recycle_hits_n == 1);
+			Test(count(ref, again) == 1);
+
+			ref_dec(ref, again);
+			ref_purge(ref);
+			Test(ref_recycle_trim(ref, 0) >= 64);
+			Test(ref_stats(ref).recycled_bytes == 0);
+			ref_reset(ref);
+		}
+#endif
+
+#if REFEREE_BUDGET
+		TestGroup("budget")
+		{ // the ptrs that reached 0 longest ago are freed first to make room
+			Referee ref_ = {0}, *ref = &ref_;
+			Test(ref_set_budget(ref, 1000) == 0);
+			void *a = ref_new(ref, 400, 1),
+			     *b = ref_new(ref, 400, 1);
+			ref_dec(ref, b);
+			ref_flush(); // (ptrs that reach 0 in the same flush may be queued in any order)
+			ref_dec(ref, a);
+			ref_flush();
+			Test(ref_stats(ref).zero_bytes == 800);
+
+			void *c = ref_new(ref, 400, 1);
+			Test(ref_stats(ref).frees_n == 1);
+			Test(ref_stats(ref).live_bytes == 800);
+			Test(ref_stats(ref).live_n == 2);
+			Test(count(ref, a) == 0); // a is still there; b went first
+
+			ref_inc(ref, a);
+			void *d = ref_new(ref, 400, 1); // nothing at 0 to free, so it goes over
+			Test(d != 0);
+			TestVEq(ref_stats(ref).live_bytes, (size_t)1200, "%zu");
+			Test(ref_set_budget(ref, 0) == 1000);
+			(void)c;
+			ref_reset(ref);
+		}
+#endif
+
+#if REFEREE_CYCLES
+		TestGroup("cycles")
+		{
+			Referee ref_ = {0}, *ref = &ref_;
+			TestGroup("dead 2-cycle")
+			{
+				Node *a = node_new(ref), *b = node_new(ref);
+				node_hold(ref, a, b);
+				node_hold(ref, b, a);
+				ref_dec(ref, a);
+				ref_dec(ref, b);
+				Test(count(ref, a) == 1 && count(ref, b) == 1); // only held by each other
+				Test(ref_collect_cycles(ref, node_children, 0) == 2);
+				Test(count(ref, a) == 0 && count(ref, b) == 0);
+				Test(ref_purge(ref) == 2);
+			}
+			TestGroup("held from outside")
+			{
+				Node *a = node_new(ref), *b = node_new(ref);
+				node_hold(ref, a, b);
+				node_hold(ref, b, a);
+				ref_dec(ref, b); // (a possible root, but a is still held by the test)
+				Test(ref_collect_cycles(ref, node_children, 0) == 0);
+				Test(count(ref, a) == 2 && count(ref, b) == 1);
+				Test(ref_purge(ref) == 0);
+				ref_dec(ref, a);
+				Test(ref_collect_cycles(ref, node_children, 0) == 2);
+				Test(ref_purge(ref) == 2);
+			}
+			TestGroup("budget")
+			{ // each step only takes roots until about budget blocks have been visited
+				for (size_t i = 0; i < 100; ++i)
+				{
+					Node *a = node_new(ref), *b = node_new(ref);
+					node_hold(ref, a, b);
+					node_hold(ref, b, a);
+					ref_dec(ref, a);
+					ref_dec(ref, b);
+				}
+				size_t garbage_n = 0, steps_n = 0, roots_left = 0;
+				do
+				{
+					size_t found = ref_collect_cycles_step(ref, node_children, 0, 10, &roots_left);
+					if (found == REFEREE_INVALID) {   break;   }
+					garbage_n += found;
+					++steps_n;
+				} while (roots_left && steps_n < 1000);
+				TestVEq(garbage_n, (size_t)200, "%zu");
+				Test(steps_n >= 200 / 12); // (a step may finish the cycle its last root is in)
+				Test(roots_left == 0);
+				Test(ref_purge(ref) == 200);
+			}
+			TestGroup("children of garbage")
+			{ // what garbage holds is let go of: a block only it holds is garbage too, others just lose a ref
+				Node *a = node_new(ref), *b = node_new(ref), *only = node_new(ref), *shared = node_new(ref);
+				node_hold(ref, a, b);
+				node_hold(ref, b, a);
+				node_hold(ref, a, only);
+				node_hold(ref, b, shared);
+				ref_dec(ref, only);
+				ref_dec(ref, a);
+				ref_dec(ref, b);
+				Test(ref_collect_cycles(ref, node_children, 0) == 3);
+				Test(count(ref, only) == 0);
+				Test(count(ref, shared) == 1);
+				Test(ref_purge(ref) == 3);
+				Test(count(ref, shared) == 1);
+				ref_dec(ref, shared);
+				Test(ref_purge(ref) == 1);
+			}
+			ref_reset(ref);
+		}
+#endif
+
+#if REFEREE_FINALIZERS
+		TestGroup("finalizers")
+		{
+			Referee ref_ = {0}, *ref = &ref_;
+			Finals   a_finals = { ref, 'a' }, b_finals = { ref, 'b' };
+			uint32_t a = ref_finalizer_type(ref, finalize, &a_finals),
+			         b = ref_finalizer_type(ref, finalize, &b_finals);
+			Test(a && b && a != b);
+			Test(ref_finalizer_type(ref, finalize, &a_finals) == a);
+
+			TestGroup("chain")
+			{ // each finalizer decs the next block to 0, and the same purge frees it
+				Linked *z = linked_new(ref, a, 'a', 0, 1),
+				       *y = linked_new(ref, a, 'a', z, 1),
+				       *x = linked_new(ref, a, 'a', y, 0);
+				(void)x;
+				Test(ref_purge(ref) == 3);
+				Test(a_finals.ptrs_n == 3);
+				Test(ref_stats(ref).live_n == 0);
+			}
+			TestGroup("grouped by type")
+			{ // each finalizer only gets the blocks of its own type, however they were interleaved
+				a_finals.calls_n = a_finals.ptrs_n = 0;
+				for (size_t i = 0; i < 40; ++i) {   linked_new(ref, i % 2 ? b : a, i % 2 ? 'b' : 'a', 0, 0);   }
+				linked_new(ref, 0, 'c', 0, 0);
+				Test(ref_purge(ref) == 41);
+				Test(a_finals.ptrs_n == 20 && b_finals.ptrs_n == 20);
+				Test(a_finals.wrong_n == 0 && b_finals.wrong_n == 0);
+				Test(a_finals.calls_n <= REFEREE_SHARD_N && b_finals.calls_n <= REFEREE_SHARD_N); // (a call per batch)
+			}
+			TestGroup("free/remove")
+			{ // ref_free releases the block, so finalizes it; ref_remove just stops tracking it
+				a_finals.ptrs_n = 0;
+				Linked *freed   = linked_new(ref, a, 'a', 0, 1),
+				       *removed = ref_add(ref, malloc(sizeof(Linked)), sizeof(Linked), 1); // (so it can be removed)
+				removed->tag  = 'a';
+				removed->next = 0;
+				ref_set_finalizer(ref, removed, a);
+				ref_free(ref, freed);
+				Test(a_finals.ptrs_n == 1);
+				Test(ref_remove(ref, removed) == removed);
+				Test(a_finals.ptrs_n == 1);
+				Test(ref_purge(ref) == 0);
+				Test(a_finals.ptrs_n == 1);
+				free(removed);
+			}
+			ref_reset(ref);
 		}
+#endif
 
-		TestGroup("")
+#if REFEREE_LOCKFREE && ! defined(_WIN32)
+		TestGroup("lock-free map")
+		{ // (build.sh also runs this under -fsanitize=thread)
+			StressMap map = {0};
+			Stress    stresses[Stress_Threads_N];
+			pthread_t threads [Stress_Threads_N];
+			for (size_t i = 0; i < Stress_Threads_N; ++i)
+			{
+				stresses[i] = (Stress){ &map, 1 + i * Stress_Keys_N, 0 };
+				pthread_create(&threads[i], 0, stress, &stresses[i]);
+			}
+			size_t wrong_n = 0;
+			for (size_t i = 0; i < Stress_Threads_N; ++i)
+			{
+				pthread_join(threads[i], 0);
+				wrong_n += stresses[i].wrong_n;
+			}
+			TestVEq(wrong_n, (size_t)0, "%zu");
+			TestVEq(map.live, (size_t)(Stress_Threads_N * Stress_Keys_N / 2), "%zu");
+			Test(stress_map_clear(&map) == Stress_Threads_N * Stress_Keys_N / 2);
+		}
+#endif
+
+#if REFEREE_RECLAIM
+		TestGroup("reclaim")
+		{ // purged ptrs are freed by the reclaimer thread (the "compact" group covers ref_compact after a purge)
+			Counted counted = {0};
+			Referee ref_    = { &counted, counted_realloc, counted_free }, *ref = &ref_;
+			for (size_t i = 0; i < 1000; ++i) {   ref_new(ref, 32 + i % 64, i % 4 == 0);   }
+			Test(ref_purge(ref) == 750);
+			Test(ref_stats(ref).frees_n == 750);
+			ref_reclaim_flush(ref);
+			TestVEq(counted.frees_n, (size_t)750, "%zu");
+			ref_reclaim_flush(ref); // (with nothing to do, and the thread stopped)
+			Test(counted.frees_n == 750);
+
+			// a purge starts the thread again, and ref_reset waits for it before dropping the rest
+			for (size_t i = 0; i < 100; ++i) {   ref_new(ref, 16, 0);   }
+			Test(ref_purge(ref) == 100);
+			Test(ref_reset(ref) == 250);
+			TestVEq(counted.frees_n, (size_t)1100, "%zu");
+		}
+#endif
+
+#if REFEREE_SAMPLE
+		TestGroup("sample")
+		{ // the callsite rows are estimated from samples (each about 1 in Referee_Sample_Bytes bytes)
+			Referee ref_ = {0}, *ref = &ref_;
+			static char blocks[44000]; // (tracked as if they were much bigger, without the memory)
+			size_t big_line = __LINE__ + 1;
+			for (size_t i = 0;    i < 4000;  ++i) {   ref_add(ref, &blocks[i], 1 << 20, 1);   }
+			size_t small_line = __LINE__ + 1;
+			for (size_t i = 4000; i < 44000; ++i) {   ref_add(ref, &blocks[i], 1 << 16, 1);   }
+
+			FILE  *report = tmpfile();
+			size_t big_bytes = 0, big_n = 0, small_bytes = 0, small_n = 0;
+			Test(ref_report(report, ref, REF_REPORT_CALLSITE, REF_REPORT_CSV, 0) >= 2);
+			Test(report_line(report, big_line,   &big_bytes,   &big_n));
+			Test(report_line(report, small_line, &small_bytes, &small_n));
+			Test(near(big_n,       4000)); // (each sample counting for 1/chance ptrs on average, even when that's 1.16)
+			Test(near(big_bytes,   (size_t)4000 << 20));
+			Test(near(small_n,     40000));
+			Test(near(small_bytes, (size_t)40000 << 16));
+			fclose(report);
+
+			for (size_t i = 0; i < 44000; ++i) {   ref_remove(ref, &blocks[i]);   }
+			report = tmpfile();
+			Test(ref_report(report, ref, REF_REPORT_CALLSITE, REF_REPORT_CSV, 0) == 0); // (the samples go with their ptrs)
+			Test(report_line(report, big_line, &big_bytes, &big_n) == 0);
+			fclose(report);
+			ref_reset(ref);
+		}
+#endif
+
+		TestGroup("report")
 		{
+			Referee ref_ = {0}, *ref = &ref_;
+			for (size_t i = 1; i <= 10; ++i) {   ref_new(ref, 10 * i, 1);   }
+			char   rows[16][256], json[4096];
+			size_t bytes = 0, n = 0;
+			FILE  *report = tmpfile();
+			TestGroup("top-N")
+			{ // only the biggest rows are written, biggest first, though rows_n counts them all
+				Test(ref_report(report, ref, REF_REPORT_PTR, REF_REPORT_CSV, 3) == 3);
+				Test(report_rows(report, rows, 16) == 3);
+				Test(atoi(rows[0]) == 100 && atoi(rows[1]) == 90 && atoi(rows[2]) == 80);
+				fclose(report), report = tmpfile();
+				Test(ref_report(report, ref, REF_REPORT_PTR, REF_REPORT_JSON, 3) == 3);
+				rewind(report);
+				json[fread(json, 1, sizeof(json) - 1, report)] = 0;
+				Test(strstr(json, "\"rows_n\": 10") != 0);
+				Test(strstr(json, "\"bytes\": 70") == 0);
+			}
+			TestGroup("sizes")
+			{ // each row has the limit of its bucket of sizes
+				fclose(report), report = tmpfile();
+				Test(ref_report(report, ref, REF_REPORT_SIZE, REF_REPORT_CSV, 0) == 4); // (up to 15, 31, 63 and 127)
+				Test(report_rows(report, rows, 16) == 4);
+				Test(sscanf(rows[0], "%zu,%zu,", &bytes, &n) == 2 && bytes == 340 && n == 4);
+				Test(atoi(strrchr(rows[0], ',') + 1) == 127);
+				Test(atoi(strrchr(rows[3], ',') + 1) == 15);
+				fclose(report), report = tmpfile();
+				Test(ref_report(report, ref, REF_REPORT_SIZE, REF_REPORT_JSON, 1) == 1);
+				rewind(report);
+				json[fread(json, 1, sizeof(json) - 1, report)] = 0;
+				Test(strstr(json, "\"sizes_up_to\": 127}") != 0);
+			}
+#if REFEREE_DEBUG
+			TestGroup("files")
+			{ // the callsites in each file are merged
+				ref_new(ref, 5, 1);
+				elsewhere_new(ref, 1000);
+				elsewhere_new(ref, 1000);
+				fclose(report), report = tmpfile();
+				Test(ref_report(report, ref, REF_REPORT_CALLSITE, REF_REPORT_CSV, 0) == 3);
+				fclose(report), report = tmpfile();
+				Test(ref_report(report, ref, REF_REPORT_FILE, REF_REPORT_CSV, 0) == 2);
+				Test(report_rows(report, rows, 16) == 2);
+				char file[64] = "";
+				Test(sscanf(rows[0], "%zu,%zu,%*[^,],%*[^,],,\"%63[^\"]\"", &bytes, &n, file) == 3);
+				Test(bytes == 2000 && n == 2 && ! strcmp(file, "elsewhere.c"));
+				Test(sscanf(rows[1], "%zu,%zu,%*[^,],%*[^,],,\"%63[^\"]\"", &bytes, &n, file) == 3);
+				Test(bytes == 555 && n == 11 && strstr(file, "test_referee.c"));
+			}
+#endif
+			fclose(report);
+			ref_reset(ref);
+		}
 
+		TestGroup("snapshot")
+		{ // written and read back twice, growing at one callsite and starting at another in between
+			Referee     ref_ = {0}, *ref = &ref_;
+			char const *paths[2] = { "test_referee_0.snap", "test_referee_1.snap" };
+			Snapshot    snaps[2] = {{0}};
+			size_t      grown_line = 0, new_line = 0;
+			for (int snap_i = 0; snap_i < 2; ++snap_i)
+			{
+				grown_line = __LINE__ + 1;
+				for (int i = 0; i < 2 + snap_i; ++i) {   ref_new(ref, 100, 1);   }
+				new_line   = __LINE__ + 1;
+				for (int i = 0; snap_i && i < 2; ++i) {   ref_new(ref, 1000, 1);   }
+				FILE *out = fopen(paths[snap_i], "wb");
+				Test(out && ref_snapshot_write(out, ref) == (snap_i ? 7 : 2));
+				if (out) {   fclose(out);   }
+				Test(snap_load(paths[snap_i], &snaps[snap_i]));
+				remove(paths[snap_i]);
+			}
+			Test(snaps[0].ptrs_n == 2 && snaps[0].bytes == 200);
+			Test(snaps[1].ptrs_n == 7 && snaps[1].bytes == 2500);
+#if REFEREE_DEBUG
+			SnapSite const *before = snap_line(&snaps[0], grown_line), *after = snap_line(&snaps[1], grown_line),
+			               *added  = snap_line(&snaps[1], new_line);
+			Test(before && after && ! snap_cmp_sites(before, after)); // (matched by file, line and call, as diff does)
+			Test(after->bytes - before->bytes == 300 && after->n - before->n == 3);
+			Test(snap_line(&snaps[0], new_line) == 0);
+			Test(added && added->bytes == 2000 && added->n == 2);
+#else
+			Test(snaps[1].sites[0].bytes == 2500 && snaps[1].sites_n == 1); // (all under the unknown callsite)
+			(void)grown_line, (void)new_line;
+#endif
+			for (int snap_i = 0; snap_i < 2; ++snap_i)
+			{
+				for (size_t i = 0; i < snaps[snap_i].sites_n; ++i)
+				{   free(snaps[snap_i].sites[i].file), free(snaps[snap_i].sites[i].func), free(snaps[snap_i].sites[i].call);   }
+				free(snaps[snap_i].sites);
+			}
+			ref_reset(ref);
+		}
+
+		TestGroup("compact")
+		{ // with a RefArena, the survivors of mostly-garbage chunks are moved and relocated
+			RefArena arena = {0};
+			Referee  ref_  = { &arena, ref_arena_realloc, ref_arena_free }, *ref = &ref_;
+			void  *ptrs[2048], *kept_ptrs[2048];
+			size_t kept_n = 0;
+			for (int i = 0; i < 2048; ++i)
+			{
+				ptrs[i] = ref_new(ref, 100, i % 16 == 0);
+				memset(ptrs[i], i & 0xff, 100);
+				if (i % 16 == 0) {   kept_ptrs[kept_n++] = ptrs[i];   }
+			}
+			Test(ref_purge(ref) == 2048 - kept_n);
+
+			Kept   kept  = { kept_ptrs, kept_n, 0 };
+			size_t moved = ref_compact(ref, relocate, &kept);
+			Test(moved != REFEREE_INVALID && moved > 0);
+			Test(kept.moved_n == moved);
+
+			int intact = 1;
+			for (size_t i = 0; i < kept_n; ++i)
+			{
+				unsigned char *bytes = kept_ptrs[i];
+				intact &= count(ref, bytes) == 1 && bytes[0] == ((i * 16) & 0xff) && bytes[99] == bytes[0];
+			}
+			Test(intact);
+			Test(ref_stats(ref).live_n == kept_n);
+
+			Referee plain = {0};
+			Test(ref_compact(&plain, relocate, &kept) == REFEREE_INVALID);
+			ref_reset(ref);
+			ref_arena_release(&arena);
+		}
+
+		TestGroup("slabs")
+		{ // blocks come back to their size class's free list; big ones go to the system
+			RefSlabs     slabs = {0};
+			Referee      ref_  = { &slabs, ref_slabs_realloc, ref_slabs_free }, *ref = &ref_;
+			RefSlabStats stats[16];
+			size_t       large_i = ref_slabs_stats(&slabs, stats, 16) - 1;
+			Test(stats[large_i].size == 0 && stats[large_i].live_n == 0);
+
+			char  *a = ref_new(ref, 20, 1),
+			      *b = ref_new(ref, 20, 1),
+			      *c = ref_new(ref, 20, 0);
+			size_t cls = ref__slab_class_of(&slabs, a); // (with REFEREE_HEADERS, the header's in there too)
+			Test(cls != REFEREE_INVALID && ref__slab_class_of(&slabs, c) == cls);
+			Test(ref_purge(ref) == 1);
+			ref_reclaim_flush(ref); // (with REFEREE_RECLAIM, c is freed on the reclaimer thread)
+			char *d = ref_new(ref, 20, 1);
+			Test(d == c);                               // c's block, off the free list
+
+			char *big = ref_new(ref, 1000, 1);
+			memset(big, 0xab, 1000);
+			Test(ref__slab_class_of(&slabs, big) == REFEREE_INVALID);
+			ref_slabs_stats(&slabs, stats, 16);
+			Test(b - a == (ptrdiff_t)stats[cls].size);
+			TestVEq(stats[cls].slabs_n,    (size_t)1, "%zu");
+			TestVEq(stats[cls].live_n,     (size_t)3, "%zu");
+			TestVEq(stats[cls].capacity_n, Referee_Slab_Size / stats[cls].size, "%zu");
+			TestVEq(stats[large_i].live_n, (size_t)1, "%zu");
+
+			size_t live_128 = stats[5].live_n;
+			char  *grown    = ref_slabs_realloc(&slabs, 0, 1, 20);
+			memcpy(grown, "in the 32 class", 16);
+			Test(ref__slab_class_of(&slabs, grown) == 1);
+			Test(ref_slabs_realloc(&slabs, grown, 1, 32) == grown); // still fits
+			grown = ref_slabs_realloc(&slabs, grown, 1, 100);       // moves to the 128 class
+			Test(grown && strcmp(grown, "in the 32 class") == 0);
+			ref_slabs_stats(&slabs, stats, 16);
+			TestVEq(stats[5].size,   (size_t)128, "%zu");
+			TestVEq(stats[5].live_n, live_128 + 1, "%zu");
+
+			char *huge = ref_slabs_realloc(&slabs, 0, 1, 4096);
+			huge = ref_slabs_realloc(&slabs, huge, 1, 1 << 20); // large blocks stay large
+			Test(huge && ref__slab_class_of(&slabs, huge) == REFEREE_INVALID);
+			ref_slabs_free(&slabs, huge);
+			ref_slabs_free(&slabs, grown);
+			Test(ref_slabs_realloc(&slabs, 0, 1, 128) == grown);
+			ref_slabs_free(&slabs, grown);
+
+			Test((unsigned char)big[999] == 0xab);
+			ref_reset(ref);
+			ref_slabs_stats(&slabs, stats, 16);
+			size_t live_n = 0;
+			for (size_t i = 0; i <= large_i; ++i) {   live_n += stats[i].live_n;   }
+			TestVEq(live_n, (size_t)0, "%zu");
+			ref_slabs_release(&slabs);
+			ref_slabs_stats(&slabs, stats, 16);
+			TestVEq(stats[1].slabs_n, (size_t)0, "%zu");
+			(void)a; (void)b; (void)d;
 		}
 	}
 
-	PrintTestResults(sweetCONTINUE);
-	return 0;
+	return PrintTestResults(sweetCONTINUE) != 0;
 }
 
-
+#line 1 "elsewhere.c"
+static void *
+elsewhere_new(Referee *ref, size_t size)
+{   return ref_new(ref, size, 1);   }